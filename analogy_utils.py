@@ -4,7 +4,7 @@ See AnalogyUtils.md for documentation.
 """
 from collections import defaultdict
 import itertools
-from tactic_utils import RuleFixedpoint, RuleAny, GetMatcher
+from tactic_utils import RuleFixedpoint, RuleAny, GetMatcher, ScopedMatchers
 
 class Analogy:
     """Represents a single analogy between two things in the structure."""
@@ -57,43 +57,46 @@ class Analogy:
         If @no_follow, then it will not concretize any nodes, only lift/lower
         facts.
         """
-        partial = self.Partial({self.no_slip[":AlphaMAB"]: alpha_MAB})
-        recording = self.ts.start_recording()
-        while not no_follow:
-            if self.state == "concretize":
-                proposals = self.Propose(self.no_slip[":Concretize?Concrete:_"], partial)
-                for assignment, _ in proposals:
-                    alpha = assignment[self.no_slip[":AlphaAB"]]
-                    if (self.Injective(alpha) and self.Function(alpha)
-                            and self.ConcretizeFacts(alpha_MAB)):
+        # Every partial below holds @alpha_MAB, so their Matchers are not
+        # used again once it is extended.
+        with ScopedMatchers(self.rt):
+            partial = self.Partial({self.no_slip[":AlphaMAB"]: alpha_MAB})
+            recording = self.ts.start_recording()
+            while not no_follow:
+                if self.state == "concretize":
+                    proposals = self.Propose(self.no_slip[":Concretize?Concrete:_"], partial)
+                    for assignment, _ in proposals:
+                        alpha = assignment[self.no_slip[":AlphaAB"]]
+                        if (self.Injective(alpha) and self.Function(alpha)
+                                and self.ConcretizeFacts(alpha_MAB)):
+                            break
+                    else:
                         break
-                else:
-                    break
-            elif self.state == "exists":
-                proposals = self.Propose(self.no_slip[":ExistingConcrete:_"], partial)
-                for assignment, _ in proposals:
-                    alpha = assignment[self.no_slip[":AlphaAB"]]
-                    if (self.Injective(alpha) and self.Function(alpha)
-                            and self.FactsLower(alpha_MAB)):
+                elif self.state == "exists":
+                    proposals = self.Propose(self.no_slip[":ExistingConcrete:_"], partial)
+                    for assignment, _ in proposals:
+                        alpha = assignment[self.no_slip[":AlphaAB"]]
+                        if (self.Injective(alpha) and self.Function(alpha)
+                                and self.FactsLower(alpha_MAB)):
+                            break
+                    else:
                         break
                 else:
-                    break
-            else:
-                proposals = self.Propose(self.no_slip[":NewConcrete:_"], partial)
-                for assignment, _ in proposals:
-                    alpha = assignment[self.no_slip[":AlphaAB"]]
-                    if self.Function(alpha) and self.LiftFacts(alpha_MAB):
+                    proposals = self.Propose(self.no_slip[":NewConcrete:_"], partial)
+                    for assignment, _ in proposals:
+                        alpha = assignment[self.no_slip[":AlphaAB"]]
+                        if self.Function(alpha) and self.LiftFacts(alpha_MAB):
+                            break
+                    else:
                         break
-                else:
-                    break
-        if self.state == "concretize":
-            self.ConcretizeFacts(alpha_MAB)
-        else:
-            RuleFixedpoint(self.rt, self.no_slip[":NewFact:_"], partial)
-        if self.FactsMissing(alpha_MAB) or not self.FactsLower(alpha_MAB):
-            recording.rollback()
-            return False
-        return True
+            if self.state == "concretize":
+                self.ConcretizeFacts(alpha_MAB)
+            else:
+                RuleFixedpoint(self.rt, self.no_slip[":NewFact:_"], partial)
+            if self.FactsMissing(alpha_MAB) or not self.FactsLower(alpha_MAB):
+                recording.rollback()
+                return False
+            return True
 
     def LiftFacts(self, alpha_M):
         """For every fact (m, ?, ?) try to add abstract fact (alpha_M, ?, ?).
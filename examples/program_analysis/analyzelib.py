@@ -1,10 +1,12 @@
 """Helper methods for analyzing program source code."""
 from collections import defaultdict
 from tactic_utils import ApplyRulesMatching, SearchRules, GetMatcher, Fix
+from tactic_utils import ScopedMatchers
 from mapper import MapperCodelet
 from lazy_structure import LazyTextDocument, SPECIAL_CHARACTERS
 from ts_utils import RegisterRule, AssertNodesEqual
 from analogy_utils import Analogy
+from runtime.trace import traced
 
 def LoadDocument(path, extra_chunks=None, extra_special=None):
     """Load a document from the file system into a LazyTextDocument.
@@ -22,6 +24,7 @@ def LoadDocument(path, extra_chunks=None, extra_special=None):
     text = "".join(text)
     return LazyTextDocument(text, chunks + extra_special + SPECIAL_CHARACTERS)
 
+@traced()
 def CompleteAnalogyTactic(structure, sources):
     """Heuristic for completing an analogy involving code transformations.
 
@@ -31,36 +34,37 @@ def CompleteAnalogyTactic(structure, sources):
     @sources[2][0] should be the prompt before code, and @sources[2][1] should
     be a currently-empty LazyTextDocument to be generated by Sifter.
     """
-    structure.ts.commit()
-    print("Identifying word pairs...")
-    ApplyRulesMatching(structure.rt, "SameWord", dict())
-
-    print("Mapping the examples...")
-    analogy = Analogy.Begin(structure.rt, dict({
-        "/:Mapper:NoSlipRules:A":
-            structure.NodeOfChunk(sources[0][0], sources[0][0].chunks[0]),
-        "/:Mapper:NoSlipRules:B":
-            structure.NodeOfChunk(sources[1][0], sources[1][0].chunks[0]),
-        "/:Mapper:NoSlipRules:C": "/:Chunk",
-    }), extend_here=["/:Document"])
-    ExtendAnalogyTactic(structure, analogy)
-
-    print("Mapping the prompt...")
-    analogy = Analogy.Begin(structure.rt, dict({
-        "/:Mapper:NoSlipRules:A":
-            structure.NodeOfChunk(sources[0][0], sources[0][0].chunks[0]),
-        "/:Mapper:NoSlipRules:B":
-            structure.NodeOfChunk(sources[2][0], sources[2][0].chunks[0]),
-        "/:Mapper:NoSlipRules:C": "/:Chunk",
-    }), exists=True, extend_here=["/:Document"])
-    ExtendAnalogyTactic(structure, analogy)
-
-    print("Solving the prompt...")
-    analogy.state = "concretize"
-    Fix(analogy.ExtendMap, ["/:Document"])
-    Fix(analogy.ExtendMap)
-    Fix(analogy.ExtendMap, no_follow=True)
-    Fix(ApplyRulesMatching, structure.rt, "SolveWord", dict())
+    with ScopedMatchers(structure.rt):
+        structure.ts.commit()
+        print("Identifying word pairs...")
+        ApplyRulesMatching(structure.rt, "SameWord", dict())
+
+        print("Mapping the examples...")
+        analogy = Analogy.Begin(structure.rt, dict({
+            "/:Mapper:NoSlipRules:A":
+                structure.NodeOfChunk(sources[0][0], sources[0][0].chunks[0]),
+            "/:Mapper:NoSlipRules:B":
+                structure.NodeOfChunk(sources[1][0], sources[1][0].chunks[0]),
+            "/:Mapper:NoSlipRules:C": "/:Chunk",
+        }), extend_here=["/:Document"])
+        ExtendAnalogyTactic(structure, analogy)
+
+        print("Mapping the prompt...")
+        analogy = Analogy.Begin(structure.rt, dict({
+            "/:Mapper:NoSlipRules:A":
+                structure.NodeOfChunk(sources[0][0], sources[0][0].chunks[0]),
+            "/:Mapper:NoSlipRules:B":
+                structure.NodeOfChunk(sources[2][0], sources[2][0].chunks[0]),
+            "/:Mapper:NoSlipRules:C": "/:Chunk",
+        }), exists=True, extend_here=["/:Document"])
+        ExtendAnalogyTactic(structure, analogy)
+
+        print("Solving the prompt...")
+        analogy.state = "concretize"
+        Fix(analogy.ExtendMap, ["/:Document"])
+        Fix(analogy.ExtendMap)
+        Fix(analogy.ExtendMap, no_follow=True)
+        Fix(ApplyRulesMatching, structure.rt, "SolveWord", dict())
 
 def ExtendAnalogyTactic(structure, analogy):
     """Tactic to extend an analogy involving source code.
@@ -0,0 +1,66 @@
+"""Tests for the synthetic workload generators in workloads.py."""
+# pylint: disable=import-error
+import os
+import tempfile
+from collections import Counter
+from external.bazel_python.pytest_helper import main
+from ts_lib import TripletStructure
+from runtime.runtime import TSRuntime
+from letter_analogy import ExtractLetterGroup
+from letter_tactics import SolveLetterAnalogy
+import workloads
+
+def test_random_facts():
+    """Tests the size, skew and determinism of RandomFacts."""
+    facts = workloads.RandomFacts(100, 2000, skew=1.0, seed=1)
+    assert len(set(facts)) == 2000
+    assert facts == workloads.RandomFacts(100, 2000, skew=1.0, seed=1)
+    # The most popular type is in ~1/H(100) ~ 19% of the facts, compared to
+    # ~1% for uniform.
+    skewed = Counter(fact[2] for fact in facts).most_common(1)[0][1]
+    uniform = workloads.RandomFacts(100, 2000, skew=0.0, seed=1)
+    flat = Counter(fact[2] for fact in uniform).most_common(1)[0][1]
+    assert skewed > 200 > 60 > flat
+
+    ts = workloads.RandomStructure(100, 2000, seed=1)
+    assert sorted(ts.lookup(None, None, None)) == facts
+    with tempfile.TemporaryDirectory() as directory:
+        path = os.path.join(directory, "facts.tsv")
+        workloads.WriteFacts(path, facts)
+        assert list(workloads.ReadFacts(path)) == facts
+
+def test_letter_analogy_workload():
+    """Tests that generated letter analogies solve as expected."""
+    ts = TripletStructure()
+    solution = workloads.LetterAnalogyWorkload(ts, 4, seed=2)
+    assert len(solution) == 4
+    SolveLetterAnalogy(TSRuntime(ts), verbose=False)
+    assert ExtractLetterGroup(ts, ts["/:Analogy_def_top:To:_"]) == solution
+
+def test_turing_machine_workload():
+    """Tests that a generated Turing machine can take a step."""
+    ts = TripletStructure()
+    workloads.TuringMachineWorkload(ts, n_rules=7, tape_length=9, seed=3)
+    tape = [fact for fact in ts.lookup(None, None, "/:NextPair:Left")
+            if fact[0].startswith("/:MTape:")]
+    assert len(tape) == 8
+    assert len(ts.lookup("/:MSymbolType", None, None)) == 9
+    rt = TSRuntime(ts)
+    assert len(rt.rules) == 7
+    proposals = list(rt.propose_all())
+    assert len(proposals) == 1
+    _, delta = proposals[0]
+    delta.apply()
+    assert len(ts.lookup(None, None, "/:Mark")) == 1
+    assert ts.lookup(None, None, "/:Mark")[0][1] != "/:OriginSymbol"
+
+def test_document_workload():
+    """Tests building a workspace over synthetic documents."""
+    structure = workloads.DocumentWorkload(3, 40, vocabulary=10, seed=4)
+    assert len(structure.documents) == 3
+    n_chunks = sum(len(document.chunks) for document in structure.documents)
+    assert n_chunks > 100
+    assert len(structure.ts.lookup(None, None, "/:Chunk")) == n_chunks
+    assert len(structure.words) <= 10 + 4
+
+main(__name__, __file__)
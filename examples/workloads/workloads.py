@@ -0,0 +1,252 @@
+"""Synthetic workloads for benchmarking the runtime at scale.
+
+The bundled examples are toy-sized. The generators here build structures of
+controllable size, either from scratch or as parametric families of the
+examples:
+
+- RandomFacts: facts over a given number of nodes, with a tunable skew in how
+  often each node is used (so a few nodes become hubs, like /:Word does).
+- LetterAnalogyWorkload: the letter_analogy problem over N-letter strings.
+- TuringMachineWorkload: a turing_machine with K transition rules and a tape
+  of length L.
+- DocumentWorkload: a program_analysis LazyStructure over M synthetic
+  documents.
+
+The generators add to a TripletStructure directly, and WriteFacts/ReadFacts
+save and load the facts of any structure as a bulk fact file. Running this file
+writes a workload to such a file, eg.:
+
+    python3 workloads.py random --nodes 100000 --facts 1000000 --out facts.tsv
+    python3 workloads.py turing --rules 30 --tape 1000 --out tm.tsv
+
+All generators are deterministic given their seed.
+"""
+import argparse
+import contextlib
+import io
+import itertools
+import math
+import random
+import string # pylint: disable=deprecated-module
+import sys
+from timeit import default_timer as timer
+from ts_lib import TripletStructure
+from mapper import MapperCodelet
+import letter_analogy
+import turing_machine
+from lazy_structure import LazyStructure, LazyTextDocument, SPECIAL_CHARACTERS
+
+def ZipfWeights(n, skew):
+    """Cumulative weights (for random.choices) of a Zipf distribution.
+
+    The k-th of @n items (counting from 1) has weight 1/k^@skew.
+    """
+    return list(itertools.accumulate(
+        1.0 / ((rank + 1) ** skew) for rank in range(n)))
+
+def RandomFacts(n_nodes, n_facts, skew=1.0, seed=0):
+    """Returns @n_facts distinct random facts over @n_nodes nodes.
+
+    Facts are of the usual form (map node, value, type). The map node is
+    chosen uniformly, while the value and type are drawn from a Zipf
+    distribution with exponent @skew over the nodes: skew=0 is uniform, while
+    at skew=1 the k-th most popular node is in about 1/k as many facts as the
+    most popular one.
+    """
+    assert n_facts <= n_nodes ** 3
+    rng = random.Random(seed)
+    nodes = ["/:Node:{}".format(i) for i in range(n_nodes)]
+    cumulative = ZipfWeights(n_nodes, skew)
+    # Popularity should not follow node IDs.
+    popular = nodes.copy()
+    rng.shuffle(popular)
+    facts = set()
+    while len(facts) < n_facts:
+        batch = n_facts - len(facts)
+        values = rng.choices(popular, cum_weights=cumulative, k=batch)
+        types = rng.choices(popular, cum_weights=cumulative, k=batch)
+        for value, type_ in zip(values, types):
+            facts.add((rng.choice(nodes), value, type_))
+    return sorted(facts)
+
+def AddFacts(ts, facts):
+    """Adds @facts (and the nodes they use) to @ts as a single batch."""
+    nodes = sorted(set(node for fact in facts for node in fact))
+    ts.add_nodes([node for node in nodes if not ts.has_node(node)])
+    ts.add_facts(facts)
+
+def RandomStructure(n_nodes, n_facts, skew=1.0, seed=0):
+    """Returns a TripletStructure holding RandomFacts(...)."""
+    ts = TripletStructure()
+    AddFacts(ts, RandomFacts(n_nodes, n_facts, skew, seed))
+    ts.commit(False)
+    return ts
+
+def LetterAnalogyWorkload(ts, n_letters, seed=0):
+    """Adds a letter analogy over @n_letters-letter strings to @ts.
+
+    As in letter_analogy.Main, there are two examples and a prompt, each
+    mapping a string to its successor string (eg. abcd -> bcde), and they use
+    the same names, so letter_tactics.SolveLetterAnalogy applies. Strings
+    are runs of consecutive lowercase letters. The prompt and its solution
+    share no letters with the examples (otherwise the mapper may relate them
+    through the shared letter nodes), so @n_letters is at most 12. Returns
+    the expected solution.
+    """
+    assert 1 <= n_letters <= 12
+    rng = random.Random(seed)
+    def run(start, length=n_letters):
+        return string.ascii_lowercase[start:(start + length)]
+    def overlap(start, other):
+        return abs(start - other) <= n_letters
+    letter_analogy.LetterRelations(ts)
+    MapperCodelet(ts)
+    while True:
+        starts = [rng.randrange(26 - n_letters) for _ in range(3)]
+        if not any(overlap(starts[2], start) for start in starts[:2]):
+            break
+    letter_analogy.LetterAnalogy(
+        ts, ":Analogy_abc_bcd", run(starts[0]), run(starts[0] + 1))
+    letter_analogy.LetterAnalogy(
+        ts, ":Analogy_lmn_mno", run(starts[1]), run(starts[1] + 1))
+    letter_analogy.LetterAnalogy(ts, ":Analogy_def_top", run(starts[2]), None)
+    return run(starts[2] + 1)
+
+def TuringMachineWorkload(ts, n_rules, tape_length, n_symbols=3, seed=0):
+    """Adds a Turing machine with @n_rules transition rules to @ts.
+
+    The machine has ceil(@n_rules / @n_symbols) states and the rules cover
+    (state, read symbol) pairs in order, each writing a random symbol, moving
+    randomly and going to a random state. The tape holds @tape_length random
+    symbols, with the head on /:OriginSymbol (which starts as symbol 0, so the
+    first rule applies), in the middle. turing_machine.PrintTMState can print
+    it.
+    """
+    assert n_rules >= 1 and tape_length >= 1
+    rng = random.Random(seed)
+    n_states = math.ceil(n_rules / n_symbols)
+    states = [ts[":State:{}".format(i)] for i in range(n_states)]
+    symbols = [ts[":Symbol:{}".format(i)] for i in range(n_symbols)]
+    ts[":Mark"] # pylint: disable=pointless-statement
+    # TransitionRule describes every rule it adds.
+    with contextlib.redirect_stdout(io.StringIO()):
+        for i in range(n_rules):
+            turing_machine.TransitionRule(
+                ts,
+                name=":Transition{}".format(i),
+                state=states[i // n_symbols],
+                read_symbol=symbols[i % n_symbols],
+                write_symbol=rng.choice(symbols),
+                direction=rng.choice("LR"),
+                statep=rng.choice(states))
+    ts[":MState"].map({ts[":CurrentState"]: states[0]})
+    origin = tape_length // 2
+    cells = [ts[":OriginSymbol"] if i == origin else ts[":Tape:{}".format(i)]
+             for i in range(tape_length)]
+    for i, cell in enumerate(cells):
+        symbol = symbols[0] if i == origin else rng.choice(symbols)
+        ts[":MSymbolType"].map({cell: symbol})
+    for i, (left, right) in enumerate(zip(cells[:-1], cells[1:])):
+        ts[":MTape:{}".format(i)].map({
+            left: ts["/:NextPair:Left"],
+            right: ts["/:NextPair:Right"],
+        })
+    ts[":MSymbolMark"].map({cells[origin]: ts[":Mark"]})
+
+def SyntheticDocument(n_tokens, vocabulary, skew=1.0, rng=None):
+    """Returns a LazyTextDocument of @n_tokens code-like tokens.
+
+    Words are drawn from @vocabulary identifiers with Zipf exponent @skew,
+    and grouped into statements like "w3 ( w1 , w7 ) ;".
+    """
+    rng = rng or random.Random(0)
+    words = ["w{}".format(i) for i in range(vocabulary)]
+    cumulative = ZipfWeights(vocabulary, skew)
+    tokens = []
+    while len(tokens) < n_tokens:
+        name, *args = rng.choices(words, cum_weights=cumulative,
+                                  k=rng.randint(1, 4))
+        tokens.extend([name, "("] + " , ".join(args).split() + [")", ";"])
+    return LazyTextDocument(" ".join(tokens[:n_tokens]), SPECIAL_CHARACTERS)
+
+def DocumentWorkload(n_documents, n_tokens, vocabulary=100, skew=1.0,
+                     seed=0, codelet=MapperCodelet, add_chunks=True):
+    """Returns a LazyStructure over @n_documents SyntheticDocuments.
+
+    If @add_chunks, every chunk of every document is added to the workspace
+    (as the program_analysis examples do for the chunks they explore).
+    """
+    rng = random.Random(seed)
+    documents = [SyntheticDocument(n_tokens, vocabulary, skew, rng)
+                 for _ in range(n_documents)]
+    structure = LazyStructure(documents, codelet)
+    if add_chunks:
+        for document in documents:
+            for chunk in document.chunks:
+                structure.ChunkToNode(document, chunk)
+    return structure
+
+def WriteFacts(path, facts):
+    """Writes @facts to @path as a bulk fact file.
+
+    The file has one fact per line, with its three nodes separated by tabs.
+    Node names never contain whitespace (see TripletStructure.__getitem__).
+    """
+    with open(path, "w") as out:
+        for fact in facts:
+            out.write("\t".join(fact) + "\n")
+
+def ReadFacts(path):
+    """Yields the facts in the bulk fact file @path, see WriteFacts."""
+    with open(path, "r") as lines:
+        for line in lines:
+            line = line.rstrip("\n")
+            if line and not line.startswith("#"):
+                yield tuple(line.split("\t"))
+
+def Main(argv):
+    """Generates the workload described by @argv and writes it to a file."""
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--out", required=True,
+                        help="Bulk fact file to write.")
+    families = parser.add_subparsers(dest="family", required=True)
+    family = families.add_parser("random")
+    family.add_argument("--nodes", type=int, required=True)
+    family.add_argument("--facts", type=int, required=True)
+    family.add_argument("--skew", type=float, default=1.0)
+    family = families.add_parser("letters")
+    family.add_argument("--letters", type=int, required=True)
+    family = families.add_parser("turing")
+    family.add_argument("--rules", type=int, required=True)
+    family.add_argument("--tape", type=int, required=True)
+    family.add_argument("--symbols", type=int, default=3)
+    family = families.add_parser("documents")
+    family.add_argument("--documents", type=int, required=True)
+    family.add_argument("--tokens", type=int, required=True)
+    family.add_argument("--vocabulary", type=int, default=100)
+    family.add_argument("--skew", type=float, default=1.0)
+    args = parser.parse_args(argv)
+
+    start = timer()
+    if args.family == "random":
+        facts = RandomFacts(args.nodes, args.facts, args.skew, args.seed)
+    else:
+        if args.family == "letters":
+            ts = TripletStructure()
+            LetterAnalogyWorkload(ts, args.letters, args.seed)
+        elif args.family == "turing":
+            ts = TripletStructure()
+            TuringMachineWorkload(ts, args.rules, args.tape, args.symbols,
+                                  args.seed)
+        else:
+            ts = DocumentWorkload(args.documents, args.tokens,
+                                  args.vocabulary, args.skew, args.seed).ts
+        facts = ts.lookup(None, None, None, read_direct=True)
+    WriteFacts(args.out, facts)
+    print("Wrote {} facts over {} nodes to {} in {:.2f}s".format(
+        len(facts), len(set(node for fact in facts for node in fact)),
+        args.out, timer() - start), file=sys.stderr)
+
+if __name__ == "__main__":
+    Main(sys.argv[1:])
@@ -0,0 +1,54 @@
+"""Index from the constants in rule constraints to the rules using them.
+
+A fact can only unify with a constraint if it has the constraint's constants
+in the same slots. So if no fact added or removed by a delta has the
+constants of any constraint (must, try or never) of a rule, syncing a
+Matcher for that rule with the delta can not change its assignments, and
+the sync can be skipped. This matters for eg. the hundreds of successor
+rules returned by tactic_utils.SearchRules, most of which mention constants
+no given delta touches.
+"""
+from collections import defaultdict
+
+class ActivationIndex:
+    """Maps constant-bearing constraint shapes to the rules they appear in.
+
+    For example, every rule with a constraint (_, _, /:Mapper:TOP) is
+    registered under the key ("/:Mapper:TOP",) of shape (2,).
+    """
+    def __init__(self, rules):
+        """Indexes the constraints of all @rules."""
+        # Maps shape (the slots holding constants) |-> key (the constants in
+        # those slots) |-> set({rules}).
+        self.index = defaultdict(lambda: defaultdict(set))
+        # Rules with a constraint of only variables, which any fact can affect.
+        self.always = set()
+        for rule in rules:
+            self.add_rule(rule)
+
+    def add_rule(self, rule):
+        """Registers every constraint of @rule in the index."""
+        patterns = [rule.must_pattern, rule.try_pattern]
+        patterns.extend(rule.never_patterns.values())
+        for pattern in patterns:
+            for constraint in pattern.constraints:
+                shape = tuple(i for i, arg in enumerate(constraint)
+                              if isinstance(arg, str))
+                if not shape:
+                    self.always.add(rule)
+                    continue
+                key = tuple(constraint[i] for i in shape)
+                self.index[shape][key].add(rule)
+
+    def affected(self, delta):
+        """Returns the rules which @delta may affect.
+
+        Rules not returned have no constraint which any fact added or removed
+        by @delta unifies with.
+        """
+        rules = set(self.always)
+        for facts in (delta.add_facts, delta.remove_facts):
+            for fact in facts:
+                for shape, keys in self.index.items():
+                    rules.update(keys.get(tuple(fact[i] for i in shape), ()))
+        return rules
@@ -1,7 +1,9 @@
 """Methods handling satisfying rule assignments.
 """
 # pylint: disable=import-error,no-name-in-module
+from ts_cpp import stableName
 import runtime.utils as utils
+from runtime.trace import traced
 
 class Assignment:
     """Represents a single satisfying assignment to a /RULE in the Structure.
@@ -15,8 +17,11 @@ class Assignment:
         self.ts = rule.ts
         self.rule = rule
         self.assignment = assignment.copy()
-        self.base_hash = utils.real_hash(assignment)
+        # Flattened, sorted assignment which node_name(...) hashes. Computed
+        # lazily, since most assignments never insert nodes.
+        self.hash_parts = None
 
+    @traced()
     def apply(self):
         """Applies the rule + assignment to the structure and returns the map.
 
@@ -27,8 +32,13 @@ class Assignment:
         running_assignment = self.assignment.copy()
 
         self.add_nodes(running_assignment)
-        added_facts = self.add_facts(running_assignment)
-        self.remove(running_assignment, added_facts)
+        if self.ts.shadow is self.rule.template.cppstruct:
+            # Fast path: the facts are updated with one native call.
+            self.rule.template.apply(running_assignment)
+            self.remove_nodes(running_assignment)
+        else:
+            added_facts = self.add_facts(running_assignment)
+            self.remove(running_assignment, added_facts)
 
         return running_assignment
 
@@ -82,7 +92,9 @@ class Assignment:
         # example for where this semantics is useful is for something like the
         # Turing Machine example, where you might want to express keeping the
         # same head position as 'remove the current head position then put it
-        # back in the same spot.'
+        # back in the same spot.' However, @added_facts are translated while
+        # rule facts are not, so the check below never holds and subtracting
+        # wins in practice. CPPRuleTemplate keeps that behavior.
         translator = utils.Translator(running_assignment)
         subtract = set(self.assigned_of_type(running_assignment, "/SUBTRACT"))
         for fact in self.assigned_rule_facts(running_assignment):
@@ -95,13 +107,101 @@ class Assignment:
             if not self.ts.facts_about_node(node, True):
                 self.ts[node].remove()
 
+    def remove_nodes(self, running_assignment):
+        """Removes /REMOVE nodes and /SUBTRACT nodes which have no facts.
+
+        This is the node half of remove(...), for when the facts have already
+        been updated by the rule's template.
+        """
+        for node_type in ("/REMOVE", "/SUBTRACT"):
+            for node in self.assigned_of_type(running_assignment, node_type):
+                node = running_assignment[node]
+                if not self.ts.facts_about_node(node, True):
+                    self.ts[node].remove()
+
+    def footprint(self):
+        """Returns (reads, writes) of applying the assignment, or None if no-op.
+
+        Used to check whether assignments interfere, without applying them.
+        reads is (facts, patterns, nodes): the facts the match relies on, the
+        /TRY_MAP and /NO_MAP constraints it relies on (not) matching, with None
+        for unassigned variables, and the assigned nodes. writes is (added,
+        removed, removed_nodes) as apply() would change them in the current
+        structure, with a fresh object() standing in for each inserted node.
+        """
+        rule, ts = self.rule, self.ts
+        by_variable = dict({rule.node_to_variable[node]: value
+                            for node, value in self.assignment.items()})
+        def substitute(constraint):
+            return tuple(by_variable.get(arg) if isinstance(arg, int) else arg
+                         for arg in constraint)
+        read_facts, patterns = set(), []
+        for constraint in rule.must_pattern.constraints:
+            read_facts.add(substitute(constraint))
+        for constraint in rule.try_pattern.constraints:
+            fact = substitute(constraint)
+            if None in fact:
+                patterns.append(fact)
+            else:
+                read_facts.add(fact)
+        for never in rule.never_patterns.values():
+            patterns.extend(map(substitute, never.constraints))
+        reads = (read_facts, patterns, set(self.assignment.values()))
+
+        # Mirrors add_nodes, add_facts and remove.
+        running_assignment = self.assignment.copy()
+        inserted = list(self.unassigned_of_type(running_assignment, "/INSERT"))
+        for node in inserted:
+            running_assignment[node] = object()
+            for equivalent_node in rule.equal[node]:
+                running_assignment[equivalent_node] = running_assignment[node]
+        translator = utils.Translator(running_assignment)
+        relevant_nodes = (set(running_assignment.keys())
+                          - set(rule.nodes_by_type["/REMOVE"]))
+        must_include = set(rule.nodes_by_type["/INSERT"])
+        rule_added = set()
+        for fact in self.facts_of_nodes(sorted(relevant_nodes)):
+            if ((set(fact) & must_include) and
+                    (set(fact) & rule.all_nodes) <= relevant_nodes):
+                rule_added.add(translator.translate_tuple(fact))
+        fresh = set(running_assignment[node] for node in inserted)
+        added = set(fact for fact in rule_added if set(fact) & fresh
+                    or not ts.lookup(*fact, read_direct=True))
+        removed, removed_nodes = set(), set()
+        for node in self.assigned_of_type(running_assignment, "/REMOVE"):
+            removed.update(ts.facts_about_node(running_assignment[node], True))
+            removed_nodes.add(running_assignment[node])
+        subtract = set(self.assigned_of_type(running_assignment, "/SUBTRACT"))
+        for fact in self.assigned_rule_facts(running_assignment):
+            if not set(fact) & subtract:
+                continue
+            fact = translator.translate_tuple(fact)
+            if fact in added:
+                # Inserted, then subtracted again; see remove(...).
+                added.discard(fact)
+            elif fact in rule_added or ts.lookup(*fact, read_direct=True):
+                removed.add(fact)
+        for node in subtract:
+            node = running_assignment[node]
+            if set(ts.facts_about_node(node, True)) <= removed:
+                removed_nodes.add(node)
+        if not (inserted or added or removed or removed_nodes):
+            return None
+        return reads, (added, removed, removed_nodes)
+
     def node_name(self, node):
         """Returns the name to use for produced node @node.
 
         Ensures node names are deterministic and reproducible, regardless of
-        when exactly the match happened.
+        when exactly the match happened. Names are a stable 128-bit hash of
+        the assignment and @node, or a 64-bit one in decimal if the runtime
+        uses compact_names.
         """
-        return "/:" + utils.real_hash("{}{}".format(self.base_hash, node))
+        if self.hash_parts is None:
+            self.hash_parts = [part for item in sorted(self.assignment.items())
+                               for part in item]
+        return "/:" + stableName(self.hash_parts + [node],
+                                 self.rule.runtime.compact_names)
 
     def assigned_rule_facts(self, running_assignment):
         """Returns rule facts which do not involve remaining unassigned nodes.
@@ -0,0 +1,114 @@
+"""Saving and restoring a whole TSRuntime, to resume long tactic sessions.
+
+Save(rt, directory, matchers) writes a checkpoint of @rt to @directory and
+Restore(directory) returns an equivalent runtime, so a session can be resumed
+at any tactic boundary (ie. whenever the structure is clean) instead of
+re-running everything from TSRuntime(ts). A checkpoint holds:
+
+- the C++ Structure and node names, in a file mapped back in by Restore
+  rather than rebuilt fact by fact (see CPPStructure.save),
+- the TripletStructure: its nodes, fact index and delta path,
+- the parsed ProductionRules (see ProductionRule.checkpoint), which can not
+  be re-parsed once TSRuntime.extract_rules has removed the rule nodes, and
+- the state of long-lived Matchers (see Matcher.checkpoint), so they resume
+  without re-solving their assignments.
+
+The Python state is pickled. Restored deltas can be rolled back, but only in
+Python (the C++ transactions they were made in are not saved). The
+CPPMatchNetwork is rebuilt natively against the restored structure. Typical
+usage, through tactic_utils:
+
+    SaveCheckpoint(rt, "checkpoints/after_mapping")
+    ...
+    rt = RestoreCheckpoint("checkpoints/after_mapping")
+"""
+import os
+import pickle
+from collections import defaultdict
+from ts_lib import TripletStructure, TSDelta
+from runtime.activation import ActivationIndex
+from runtime.cpp_structure import CPPStructure, CPPMatchNetwork
+from runtime.importer import LazyFacts
+from runtime.matcher import Matcher
+from runtime.production_rule import ProductionRule
+from runtime.runtime import TSRuntime
+from runtime.trace import traced
+
+VERSION = 1
+STRUCTURE_FILE = "structure.ts"
+STATE_FILE = "state.pickle"
+
+@traced()
+def Save(rt, directory, matchers=None):
+    """Saves a checkpoint of @rt to @directory, creating it if needed.
+
+    @matchers is an optional dict {key: Matcher} of the Matchers of @rt to
+    save; keys can be anything picklable and are returned by Restore. The
+    structure must be clean.
+    """
+    ts = rt.ts
+    assert ts.is_clean(), "Commit or roll back changes before checkpointing."
+    os.makedirs(directory, exist_ok=True)
+    rt.solver.save(os.path.join(directory, STRUCTURE_FILE))
+    current = ts.freeze_frame()
+    state = dict({
+        "version": VERSION,
+        "compact_names": rt.compact_names,
+        "nodes": list(ts.nodes),
+        "display_names": ts.display_names,
+        "facts": dict(ts.facts.loaded() if isinstance(ts.facts, LazyFacts)
+                      else ts.facts),
+        "current_scope": ts.current_scope,
+        "path": [(delta.add_nodes, delta.add_facts,
+                  delta.remove_nodes, delta.remove_facts)
+                 for delta in ts.path[1:]],
+        "rules": [rule.checkpoint() for rule in rt.rules],
+        "matchers": dict({key: matcher.checkpoint(current)
+                          for key, matcher in (matchers or dict()).items()
+                          if matcher.rt is rt}),
+    })
+    # Written next to the final file and then renamed, like the structure.
+    temporary = os.path.join(directory, STATE_FILE + ".tmp")
+    with open(temporary, "wb") as state_file:
+        pickle.dump(state, state_file, protocol=pickle.HIGHEST_PROTOCOL)
+    os.replace(temporary, os.path.join(directory, STATE_FILE))
+
+@traced()
+def Restore(directory):
+    """Restores a checkpoint saved by Save to @directory.
+
+    Returns (rt, matchers), where @matchers maps the keys given to Save to
+    the restored Matchers.
+    """
+    with open(os.path.join(directory, STATE_FILE), "rb") as state_file:
+        state = pickle.load(state_file)
+    assert state["version"] == VERSION, \
+           f"{directory} is a version {state['version']} checkpoint."
+
+    ts = TripletStructure()
+    ts.nodes = dict.fromkeys(state["nodes"])
+    ts.display_names = state["display_names"]
+    ts.facts = defaultdict(list, state["facts"])
+    ts.current_scope = state["current_scope"]
+    for add_nodes, add_facts, remove_nodes, remove_facts in state["path"]:
+        delta = TSDelta(ts)
+        delta.add_nodes, delta.add_facts = add_nodes, add_facts
+        delta.remove_nodes, delta.remove_facts = remove_nodes, remove_facts
+        ts.path.append(delta)
+
+    # Mirrors TSRuntime.__init__, with the rules restored instead of
+    # extracted from the structure.
+    rt = TSRuntime.__new__(TSRuntime)
+    rt.ts = ts
+    rt.compact_names = state["compact_names"]
+    rt.solver = CPPStructure(ts, os.path.join(directory, STRUCTURE_FILE))
+    rt.network = CPPMatchNetwork(rt.solver)
+    rt.rules = [ProductionRule.from_checkpoint(rt, rule)
+                for rule in state["rules"]]
+    rt.rules_by_name = dict({rule.name: rule for rule in rt.rules})
+    rt.activation = ActivationIndex(rt.rules)
+
+    current = ts.freeze_frame()
+    matchers = dict({key: Matcher.from_checkpoint(rt, matcher, current)
+                     for key, matcher in state["matchers"].items()})
+    return rt, matchers
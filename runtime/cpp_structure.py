@@ -1,8 +1,13 @@
 """Python wrappers for the C++ solver."""
 from collections import defaultdict
 # pylint: disable=no-name-in-module
-from ts_cpp import Structure, Triplet, Solver
+from ts_cpp import Structure, Triplet, Solver, RuleTemplate
+from ts_cpp import NodeNames, CompiledRule, Fixedpoint, MatchNetwork
+from ts_cpp import matchAll, extractRules
 import runtime.utils as utils
+from runtime.importer import ImportLog
+from runtime.utils import freezedict
+from runtime.trace import traced
 
 class CPPStructure:
     """Represents an optimized TripletStructure.
@@ -10,65 +15,155 @@ class CPPStructure:
     Notably, the optimized TripletStructure is implemented in C++ and nodes are
     referenced by numerical indices, not strings.
     """
-    def __init__(self, ts):
-        """Initialize the CPPStructure."""
+    # Most assignments CPPStructure.solve fetches in one native call.
+    max_solve_batch = 256
+
+    def __init__(self, ts, path=None):
+        """Initialize the CPPStructure.
+
+        If @path is given, the C++ structure is opened from a file written by
+        save(...) rather than built from the facts of @ts, which must have the
+        same nodes and facts as when it was saved. Node IDs are then as when
+        it was saved, including those of removed nodes. See Structure::Open.
+
+        Otherwise, if the facts of @ts were imported (see runtime/importer.py),
+        the imported Structure and NodeNames are taken over and the changes
+        logged since the import replayed on them.
+        """
         self.ts = ts
-        self.cpp = Structure()
-        self.dictionary = dict({node: (i+1) for i, node in enumerate(ts.nodes)})
-        self.dictionary_back = [None] + ts.nodes
+        # self.names is a native copy of the dictionary, used by fixedpoint.
+        imported = path is None and isinstance(ts.shadow, ImportLog)
+        if imported:
+            self.names = ts.facts.names
+            # ts.facts reads from the imported Structure as it was, so changes
+            # go to a (copy-on-write) snapshot of it.
+            self.cpp = ts.facts.structure.snapshot()
+            self.dictionary_back = list(ts.facts.nodes)
+            self.dictionary = dict({node: i for i, node
+                                    in enumerate(self.dictionary_back) if i})
+        elif path is None:
+            self.names = NodeNames()
+            self.dictionary = dict({node: (i+1)
+                                    for i, node in enumerate(ts.nodes)})
+            self.dictionary_back = [None] + list(ts.nodes)
+            self.cpp = Structure()
+            for node in ts.nodes:
+                self.names.add(node)
+        else:
+            self.names = NodeNames()
+            self.cpp = Structure.open(path, self.names)
+            self.dictionary_back = [None] + [
+                self.names.name(i + 1) for i in range(self.names.size())]
+            self.dictionary = dict({node: i for i, node
+                                    in enumerate(self.dictionary_back) if i})
+            present = set(node for node in self.dictionary
+                          if self.names.isPresent(self.dictionary[node]))
+            assert present == set(ts.nodes), \
+                   f"{path} was saved with other nodes."
+
+        # CPPPatterns by their constraints; see CPPPattern.__init__. They hold
+        # node IDs, so they can not be shared between CPPStructures.
+        self.patterns = dict()
 
         self.translator = utils.Translator(self.dictionary)
-        existing = self.translator.translate_tuples(
-            ts.lookup(None, None, None, read_direct=True))
-        for fact in existing:
-            self.cpp.addFact(*fact)
+        if imported:
+            for method, argument in ts.shadow.changes:
+                getattr(self, method)(argument)
+        elif path is None:
+            existing = ts.lookup(None, None, None, read_direct=True)
+            for fact in self.translator.translate_tuples(existing):
+                self.cpp.addFact(*fact)
+        else:
+            existing = ts.lookup(None, None, None, read_direct=True)
+            assert self.cpp.size() == len(existing), \
+                   f"{path} was saved with other facts."
 
+        # Changes made through the shadow are recorded in the running
+        # transaction; see TripletStructure.shadow.
+        self.txn = self.cpp.begin()
         ts.shadow = self
 
-    def solve(self, pattern):
-        """Given a CPPPattern, yields solutions to it in the structure."""
+    def save(self, path):
+        """Saves the C++ structure and node names to a file at @path.
+
+        Other processes can then open it with CPPStructure(ts, path) instead
+        of rebuilding the C++ structure fact by fact.
+        """
+        self.cpp.save(path, self.names)
+
+    def solve(self, pattern, structure=None):
+        """Given a CPPPattern, yields solutions to it in the structure.
+
+        If @structure is given (eg. a version from published()), it is solved
+        against instead of the current structure.
+        """
+        if structure is None:
+            structure = self.cpp
         if not pattern.valid:
             return
         if not pattern.sorted_variables:
-            if all([self.ts.lookup(*fact, read_direct=True)
-                    for fact in pattern.raw_constraints]):
+            if structure.allTrue(pattern.constraints):
                 yield {}
             return
 
-        solver = Solver(self.cpp, len(pattern.sorted_variables),
+        solver = Solver(structure, len(pattern.sorted_variables),
                         pattern.constraints, pattern.maybe_equal)
 
+        # Assignments are fetched in doubling batches, each a single native
+        # call without the GIL, so callers wanting only the first few do not
+        # pay for the rest.
+        n_variables = len(pattern.sorted_variables)
+        batch = 1
         while solver.isValid():
-            assignment = solver.nextAssignment()
-            if assignment:
+            flat = solver.nextAssignments(batch)
+            for start in range(0, len(flat), n_variables):
                 # Need to convert back to a dict with the original ordering.
                 real_assignment = dict()
                 for i, variable in enumerate(pattern.sorted_variables):
-                    node = self.dictionary_back[assignment[i]]
+                    node = self.dictionary_back[flat[start + i]]
                     real_assignment[variable] = node
                 yield real_assignment
-            else:
-                return
+            batch = min(2 * batch, self.max_solve_batch)
 
-    def assignments(self, constraints, maybe_equal=None):
-        """Yields assignments to the constraints."""
+    def assignments(self, constraints, maybe_equal=None, structure=None):
+        """Yields assignments to the constraints, see solve(...)."""
         pattern = CPPPattern(self, constraints, maybe_equal)
-        yield from self.solve(pattern)
+        yield from self.solve(pattern, structure)
+
+    def publish(self):
+        """Makes the current structure the version returned by published().
+
+        Together these let other threads solve against a consistent version
+        of the structure, with the GIL released, while this one keeps changing
+        it. Neither side waits on the other.
+        """
+        self.cpp.publish()
+
+    def published(self):
+        """Returns the latest published version, to pass to solve(...).
+
+        May be called from any thread. Node names are only ever added to
+        self.dictionary_back, so solutions in old versions still translate.
+        """
+        return self.cpp.published()
 
     def add_node(self, node):
         """Add a node to the structure."""
+        node_id = self.names.add(node)
         if node not in self.dictionary:
-            self.dictionary[node] = len(self.dictionary) + 1
+            self.dictionary[node] = node_id
             self.dictionary_back.append(node)
+        assert self.dictionary[node] == node_id
 
     def remove_node(self, node):
-        """No-op.
+        """Marks the node as removed in self.names.
 
         Unconstrained nodes in patterns are not supported, hence for
         pattern-solving purposes a node is considered to be in the CPPStructure
         iff there are facts using it. the 'add_node' method above only assigns
         the node a numerical ID.
         """
+        self.names.remove(node)
 
     def add_fact(self, fact):
         """Add a fact to the structure."""
@@ -78,6 +173,128 @@ class CPPStructure:
         """Remove a fact from the structure."""
         self.cpp.removeFact(*self.translator.translate_tuple(fact))
 
+    def add_facts(self, facts):
+        """Add multiple facts to the structure with one native call."""
+        self.cpp.addFacts(self.flatten(facts))
+
+    def remove_facts(self, facts):
+        """Remove multiple facts from the structure with one native call."""
+        self.cpp.removeFacts(self.flatten(facts))
+
+    def remove_nodes_with_facts(self, nodes):
+        """Remove every fact using any of @nodes with one native call.
+
+        The nodes themselves are then removed through remove_node.
+        """
+        self.cpp.removeNodesWithFacts([self.dictionary[node] for node in nodes])
+
+    def extract_rules(self):
+        """Reads every /RULE in the structure with one native call.
+
+        Returns (rule, maps, facts) for each rule node, sorted by name, where
+        @maps and @facts are lists of facts; see ExtractRules in
+        ts_cpp/ts_lib.h.
+        """
+        if "/RULE" not in self.dictionary:
+            return []
+        extracted = [(self.dictionary_back[rule.rule],
+                      self.unflatten(rule.maps), self.unflatten(rule.facts))
+                     for rule in extractRules(self.cpp,
+                                              self.dictionary["/RULE"])]
+        return sorted(extracted, key=lambda rule: rule[0])
+
+    def flatten(self, facts):
+        """Translates @facts to a flat list of node IDs."""
+        return [self.dictionary[node] for fact in facts for node in fact]
+
+    def unflatten(self, flat):
+        """Inverse of flatten(...)."""
+        names = [self.dictionary_back[node] for node in flat]
+        return [tuple(names[i:(i + 3)]) for i in range(0, len(names), 3)]
+
+    def fixedpoint(self, rules, partial, compact_names):
+        """Runs the ProductionRules @rules to fixedpoint natively.
+
+        @partial is a partial assignment to rule node names, as for Matcher.
+        The TripletStructure is updated to match and the net change is
+        returned, as a tuple (fixedpoint, added_facts, removed_facts,
+        added_nodes, removed_nodes), where fixedpoint is the native
+        Fixedpoint. See runtime.py:TSRuntime.fixedpoint.
+        """
+        compiled, partials = [], []
+        for rule in rules:
+            values = [0] * rule.compiled.n_variables
+            for node, value in partial.items():
+                if node in rule.node_to_variable:
+                    values[rule.node_to_variable[node]] = \
+                        self.dictionary.get(value, -1)
+            if -1 not in values:
+                compiled.append(rule.compiled.rule)
+                partials.append(values)
+
+        fixedpoint = Fixedpoint(self.cpp, self.names, compact_names)
+        fixedpoint.run(compiled, partials)
+        # Nodes inserted natively get the next IDs.
+        for node_id in range(len(self.dictionary_back), self.names.size() + 1):
+            node = self.names.name(node_id)
+            self.dictionary[node] = node_id
+            self.dictionary_back.append(node)
+
+        added_nodes = [self.dictionary_back[node]
+                       for node in fixedpoint.addedNodes()]
+        removed_nodes = [self.dictionary_back[node]
+                         for node in fixedpoint.removedNodes()]
+        added_facts = self.unflatten(fixedpoint.addedFacts())
+        removed_facts = self.unflatten(fixedpoint.removedFacts())
+        self.ts.add_nodes(added_nodes)
+        self.ts.apply_shadowed(added_facts, removed_facts)
+        self.ts.remove_nodes(removed_nodes)
+        return (fixedpoint, added_facts, removed_facts, added_nodes,
+                removed_nodes)
+
+    def match_all(self, rules, n_threads=0):
+        """Solves the ProductionRules @rules natively and concurrently.
+
+        Returns, for each rule in order, its assignments as in
+        runtime/matcher.py:OneOffMatcher with an empty partial, as dicts
+        {variable: node}. The rules are solved on up to @n_threads threads
+        (one per core if 0) with the GIL released.
+        """
+        matches = matchAll(self.cpp, self.names,
+                           [rule.compiled.rule for rule in rules],
+                           [[0] * rule.compiled.n_variables for rule in rules],
+                           n_threads)
+        return [[dict({variable: self.dictionary_back[node]
+                       for variable, node
+                       in enumerate(flat[i:(i + rule.compiled.n_variables)])
+                       if node})
+                 for i in range(0, len(flat), rule.compiled.n_variables)]
+                for rule, flat in zip(rules, matches)]
+
+    def commit_txn(self):
+        """Ends the running transaction, returning its ID."""
+        txn = self.txn
+        self.cpp.commit(txn)
+        self.txn = self.cpp.begin()
+        return txn
+
+    def rollback_txn(self, txn):
+        """Undoes transaction @txn and every transaction after it.
+
+        Returns False, changing nothing, if the undo log no longer has @txn.
+        """
+        if not self.cpp.rollback(txn):
+            return False
+        self.txn = self.cpp.begin()
+        return True
+
+    def forget_txns(self, txn):
+        """Drops the undo log of the transactions before @txn (if not None).
+
+        If @txn is None, only the running transaction is kept.
+        """
+        self.cpp.forget(self.txn if txn is None else txn)
+
 class CPPPattern:
     """Represents a pre-processed existential search query.
 
@@ -94,13 +311,13 @@ class CPPPattern:
     For example, the [(1,3,3),(1,1,"/:A")] pattern might get pre-processed to
     the pattern [(-1,0,0),(-1,-1,1)], where -1<->1, 0<->3, and 1<->"/:A".
     """
-    cached = dict()
+    @traced()
     def __init__(self, cppstruct, constraints, maybe_equal):
         """Initialize and pre-process the pattern."""
         frozen = tuple(constraints)
-        if (frozen in CPPPattern.cached
-                and CPPPattern.cached[frozen][0] == maybe_equal):
-            cached = CPPPattern.cached[frozen][1]
+        if (frozen in cppstruct.patterns
+                and cppstruct.patterns[frozen][0] == maybe_equal):
+            cached = cppstruct.patterns[frozen][1]
             self.raw_constraints = cached.raw_constraints
             self.constraints = cached.constraints
             self.valid = cached.valid
@@ -150,4 +367,155 @@ class CPPPattern:
             set({abs(translation[var]) for var in maybe_equal[v]
                  if var in translation})
             for v in sorted_variables]
-        CPPPattern.cached[frozen] = (raw_maybe_equal, self)
+        cppstruct.patterns[frozen] = (raw_maybe_equal, self)
+
+class CPPRuleTemplate:
+    """Represents the pre-compiled action side of a ProductionRule.
+
+    The facts a rule may insert or subtract are compiled into a C++
+    RuleTemplate over the rule's variables, numbered as in CPPPattern (variable
+    i becomes -i). See runtime/assignment.py for the semantics this mirrors.
+    """
+    def __init__(self, cppstruct, rule):
+        """Compiles @rule against the nodes in @cppstruct."""
+        self.cppstruct = cppstruct
+        self.node_to_variable = rule.node_to_variable
+        self.n_variables = max(rule.node_to_variable.values()) + 1
+
+        remove = set(rule.nodes_by_type["/REMOVE"])
+        insert = set(rule.nodes_by_type["/INSERT"])
+        subtract = set(rule.nodes_by_type["/SUBTRACT"])
+        def compile_facts(nodes, keep):
+            return [self.compile_fact(rule, fact)
+                    for node in sorted(nodes)
+                    for fact in rule.indexed_facts[node]
+                    if keep(set(fact))]
+        inserts = compile_facts(
+            rule.all_nodes - remove,
+            lambda args: args & insert and not args & remove)
+        subtracts = compile_facts(rule.all_nodes, lambda args: args & subtract)
+        remove_slots = [rule.node_to_variable[node]
+                        for node in rule.nodes_by_type["/REMOVE"]]
+        self.template = RuleTemplate(
+            self.n_variables, inserts, subtracts, remove_slots)
+
+    def compile_fact(self, rule, fact):
+        """Translates a rule fact to a Triplet over variables and constants."""
+        return Triplet(*[-rule.node_to_variable[arg] if arg in rule.all_nodes
+                         else self.cppstruct.dictionary[arg]
+                         for arg in fact])
+
+    def apply(self, running_assignment):
+        """Applies the template to the structure with one native call.
+
+        The C++ structure is updated directly, then the change is mirrored in
+        the TripletStructure. Nodes are not added or removed.
+        """
+        cppstruct = self.cppstruct
+        values = [0] * self.n_variables
+        for node, value in running_assignment.items():
+            values[self.node_to_variable[node]] = cppstruct.dictionary[value]
+        added, removed = self.template.apply(cppstruct.cpp, values)
+        cppstruct.ts.apply_shadowed(cppstruct.unflatten(added),
+                                    cppstruct.unflatten(removed))
+
+class CPPRule:
+    """Represents a ProductionRule compiled for native fixedpoints.
+
+    Patterns are compiled as in CPPRuleTemplate, ie. variable i becomes -i.
+    """
+    def __init__(self, cppstruct, rule):
+        """Compiles @rule against the nodes in @cppstruct."""
+        self.n_variables = rule.template.n_variables
+        def compile_pattern(pattern):
+            return [Triplet(*[-arg if isinstance(arg, int)
+                              else cppstruct.dictionary[arg]
+                              for arg in constraint])
+                    for constraint in pattern.constraints]
+        nevers = [compile_pattern(rule.never_patterns[index])
+                  for index in sorted(rule.never_patterns)]
+        maybe_equal = [rule.maybe_equal_variables.get(variable, {variable})
+                       for variable in range(self.n_variables)]
+        def variables_of_type(node_type):
+            return [rule.node_to_variable[node]
+                    for node in rule.nodes_by_type[node_type]]
+        self.rule = CompiledRule(
+            self.n_variables,
+            compile_pattern(rule.must_pattern),
+            compile_pattern(rule.try_pattern),
+            nevers,
+            maybe_equal,
+            rule.template.template,
+            sorted(rule.node_to_variable.items()),
+            [(node, rule.node_to_variable[node])
+             for node in rule.nodes_by_type["/INSERT"]],
+            variables_of_type("/REMOVE"),
+            variables_of_type("/SUBTRACT"))
+
+class CPPMatchNetwork:
+    """Matches the must patterns of every Matcher in a runtime at once.
+
+    Wraps the C++ MatchNetwork, which shares matching work between patterns
+    with common constraints and is kept up to date by the C++ Structure
+    itself. See runtime/matcher.py:SharedPatternMatcher.
+    """
+    def __init__(self, cppstruct):
+        """Initializes an empty network over @cppstruct."""
+        self.cppstruct = cppstruct
+        self.network = MatchNetwork(cppstruct.cpp)
+        # Number of variables of each reader.
+        self.widths = []
+
+    def reader(self, pattern, partial):
+        """Adds a reader for assignments to @pattern extending @partial.
+
+        Returns the reader ID, or None if the network can not match @pattern,
+        ie. if it has no constraints or refers to nodes not yet in the
+        structure.
+        """
+        if not pattern.constraints:
+            return None
+        variables = [arg for constraint in pattern.constraints
+                     for arg in constraint if isinstance(arg, int)]
+        width = max(variables + list(partial.keys())) + 1
+        dictionary = self.cppstruct.dictionary
+        try:
+            constraints = [Triplet(*[-arg if isinstance(arg, int)
+                                     else dictionary[arg]
+                                     for arg in constraint])
+                           for constraint in pattern.constraints]
+            values = [0] * width
+            for variable, node in partial.items():
+                values[variable] = dictionary[node]
+        except KeyError:
+            return None
+        maybe_equal = [set(variable for variable
+                           in pattern.equivalence_class(variable)
+                           if variable < width)
+                       for variable in range(width)]
+        self.widths.append(width)
+        return self.network.addReader(constraints, maybe_equal, values)
+
+    def release(self, reader):
+        """Releases @reader and the join nodes only it used."""
+        self.network.removeReader(reader)
+
+    def assignments(self, reader):
+        """Returns the current assignments of @reader, as frozen dicts."""
+        return self.thaw(reader, self.network.assignments(reader))
+
+    def read(self, reader):
+        """Syncs the network and returns (removed, added) for @reader.
+
+        Both are sets of frozen dicts, relative to the previous read.
+        """
+        self.network.sync()
+        removed, added = self.network.read(reader)
+        return self.thaw(reader, removed), self.thaw(reader, added)
+
+    def thaw(self, reader, flat):
+        """Translates a flat buffer of assignments to frozen dicts."""
+        width, names = self.widths[reader], self.cppstruct.dictionary_back
+        return set(freezedict({variable: names[node] for variable, node
+                               in enumerate(flat[i:(i + width)]) if node})
+                   for i in range(0, len(flat), width))
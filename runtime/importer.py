@@ -0,0 +1,131 @@
+"""Bulk import of facts from N-Triples or TSV files into a TripletStructure.
+
+Adding facts one by one through ts[...].map(...) or ts.add_fact costs a
+Python call, eleven index appends and (in large structures) node lookups per
+fact. ImportFacts(ts, path) instead tokenizes the file natively, in parallel,
+into a C++ Structure (see ImportFacts in ts_cpp/ts_lib.h), and only
+registers the node names with @ts. The Python fact index, ts.facts, is then
+filled in lazily: each of its keys is read from the imported Structure the
+first time it is used. Likewise the CPPStructure of a later TSRuntime takes
+over the imported Structure instead of adding every fact to a new one.
+Typical usage:
+
+    ts = TripletStructure()
+    ImportFacts(ts, "analysis.nt", fmt="ntriples", prefix="/:")
+"""
+from collections import defaultdict
+# pylint: disable=no-name-in-module
+from ts_cpp import NodeNames, importFacts
+from ts_lib import TripletStructure
+from runtime.trace import traced
+
+@traced()
+def ImportFacts(ts, path, fmt="tsv", prefix="", n_threads=0):
+    """Imports the facts in the file at @path into the empty structure @ts.
+
+    @fmt is "tsv" or "ntriples" and node names are @prefix followed by each
+    term as written (less the angle brackets of IRIs); see ImportFacts in
+    ts_cpp/ts_lib.h for details. The file is read on up to @n_threads
+    threads (one per core if 0). Nodes are added in order of first
+    appearance. The imported nodes and facts are the initial state of @ts:
+    they are not recorded in ts.buffer and can not be rolled back. Later
+    changes are logged in ts.shadow (see ImportLog) until a CPPStructure
+    takes over the import. Returns the number of facts imported.
+    """
+    assert not ts.nodes and ts.is_clean() and ts.shadow is None, \
+           "Facts can only be imported into an empty structure."
+    names = NodeNames()
+    structure = importFacts(path, fmt, prefix, names, n_threads)
+    nodes = [names.name(i + 1) for i in range(names.size())]
+    ts.nodes.update(dict.fromkeys(nodes))
+    ts.display_names.update((node, node) for node in nodes)
+    ts.facts = LazyFacts(structure, names, nodes)
+    ts.shadow = ImportLog()
+    return structure.size()
+
+class ImportLog:
+    """TripletStructure.shadow of an import, until a CPPStructure takes it over.
+
+    Logs every node and fact change made after the import, in order, so that
+    CPPStructure can replay them on the imported Structure.
+    """
+    def __init__(self):
+        """Initializes an empty ImportLog."""
+        # (CPPStructure method, argument) for each change.
+        self.changes = []
+
+    def add_node(self, node):
+        """Logs the addition of @node."""
+        self.changes.append(("add_node", node))
+
+    def remove_node(self, node):
+        """Logs the removal of @node."""
+        self.changes.append(("remove_node", node))
+
+    def add_fact(self, fact):
+        """Logs the addition of @fact."""
+        self.changes.append(("add_fact", fact))
+
+    def remove_fact(self, fact):
+        """Logs the removal of @fact."""
+        self.changes.append(("remove_fact", fact))
+
+class LazyFacts(dict):
+    """TripletStructure.facts, filled in from an imported C++ Structure.
+
+    A key missing from the dict is looked up in the imported Structure, which
+    is never modified (CPPStructure changes a snapshot of it), and the result
+    stored under the key. The
+    TripletStructure updates every key of a fact it adds or removes (see
+    TripletStructure._iter_subfacts), loading them first, so keys always
+    hold what they would if every imported fact had been added in Python.
+    """
+    def __init__(self, structure, names, nodes):
+        """Initializes the LazyFacts over an import.
+
+        @names are the NodeNames the import interned into and @nodes their
+        names by ID (less one).
+        """
+        super().__init__()
+        self.structure = structure
+        self.names = names
+        self.nodes = [None] + nodes
+
+    def __missing__(self, key):
+        """Loads @key from the imported Structure."""
+        if isinstance(key, str):
+            node = self.names.find(key)
+            facts = []
+            if node:
+                facts = list(dict.fromkeys(
+                    fact for template in ((node, 0, 0), (0, node, 0),
+                                          (0, 0, node))
+                    for fact in self._lookup(template)))
+        else:
+            template = [0 if arg is None else self.names.find(arg)
+                        for arg in key]
+            facts = []
+            if all(node or arg is None for node, arg in zip(template, key)):
+                facts = self._lookup(template)
+        self[key] = facts
+        return facts
+
+    def loaded(self):
+        """Returns a defaultdict with every key, loading the ones not used yet.
+
+        Used where the whole index is needed at once, eg. by
+        runtime/checkpoint.py.
+        """
+        # pylint: disable=protected-access
+        facts = defaultdict(list, self)
+        for fact in self._lookup((0, 0, 0)):
+            for key in TripletStructure._iter_subfacts(fact):
+                if key not in self:
+                    facts[key].append(fact)
+        return facts
+
+    def _lookup(self, template):
+        """Imported facts matching @template, with names."""
+        flat = self.structure.lookupFlat(*template)
+        names = [self.nodes[node] for node in flat]
+        return [tuple(names[i:(i + 3)]) for i in range(0, len(names), 3)]
@@ -26,13 +26,18 @@ need to check for new assignments which map {1: A, 2: B, 3: C} or {1: B, 2: C,
 Note that profiling shows the vast majority of time is spent in MustMap, hence
 this implementation only optimizes/caches that layer (it re-computes TryMap,
 NoMap on every sync). In the future we can think through how to do differential
-updates to the latter two layers as well.
+updates to the latter two layers as well. The MustMap layer is additionally
+shared between all Matchers of a runtime through its CPPMatchNetwork (see
+SharedPatternMatcher), so constraints common to many rules are only matched
+once.
 """
+import copy
 from collections import defaultdict
 # pylint: disable=import-error,no-name-in-module
 import runtime.utils as utils
 from runtime.utils import freezedict, thawdict
 from runtime.assignment import Assignment
+from runtime.trace import traced
 
 class Matcher:
     """Keeps track of all assignments to a ProductionRule in the runtime."""
@@ -46,12 +51,26 @@ class Matcher:
             self.partial = dict({rule.node_to_variable[key]: value
                                  for key, value in partial.items()
                                  if key in rule.node_to_variable})
-        # Assignments to the 'MustMap' pattern.
-        self.must_matcher = PatternMatcher(rt, self.rule.must_pattern, self.partial)
+        # Assignments to the 'MustMap' pattern, shared with other Matchers in
+        # the runtime when possible.
+        reader = rt.network.reader(self.rule.must_pattern, self.partial)
+        if reader is None:
+            self.must_matcher = PatternMatcher(
+                rt, self.rule.must_pattern, self.partial)
+        else:
+            self.must_matcher = SharedPatternMatcher(rt.network, reader)
         self.must_assignments = dict()
         for assignment in self.must_matcher.assignments:
             self._add_must(assignment)
 
+    def release(self):
+        """Releases what the Matcher holds in the runtime's CPPMatchNetwork.
+
+        The Matcher may not be synced afterwards.
+        """
+        if isinstance(self.must_matcher, SharedPatternMatcher):
+            self.must_matcher.release()
+
     def assignments(self):
         """Yields assignments to self.rule satisfying self.partial.
 
@@ -69,12 +88,17 @@ class Matcher:
                 assign = thawdict(must_assignment)
                 yield Assignment(self.rule, node_to_variable.compose(assign))
 
+    @traced()
     def sync(self):
         """Update the assignments."""
         current = self.rt.ts.freeze_frame()
         delta = self.freeze_frame.delta_to_reach(current)
         self.freeze_frame = current
 
+        if self.rule not in self.rt.activation.affected(delta):
+            # No changed fact unifies with any of the rule's constraints.
+            return
+
         removed, added = self.must_matcher.sync(delta)
 
         for assign in removed:
@@ -115,14 +139,79 @@ class Matcher:
         if not invalid:
             entry["try"] = PatternMatcher(self.rt, self.rule.try_pattern, assignment)
 
+    def checkpoint(self, current):
+        """Returns the Matcher's state as picklable data, see from_checkpoint.
+
+        @current should be a freeze frame of the structure now; the Matcher's
+        own frame is saved relative to it. See runtime/checkpoint.py.
+        """
+        frame = current.delta_to_reach(self.freeze_frame)
+        entries = dict({
+            must: ([never.assignments for never in entry["nevers"]],
+                   None if entry["try"] is None else entry["try"].assignments)
+            for must, entry in self.must_assignments.items()})
+        return dict({
+            "rule": self.rule.name,
+            "partial": self.partial,
+            "frame": (frame.add_nodes, frame.remove_nodes,
+                      frame.add_facts, frame.remove_facts),
+            "must": self.must_matcher.assignments,
+            "entries": entries,
+        })
+
+    @classmethod
+    def from_checkpoint(cls, rt, state, current):
+        """Restores a Matcher saved by checkpoint() into @rt.
+
+        Assignments are restored as saved rather than solved for, so the next
+        sync() only does the work that sync() would have done without the
+        checkpoint. @current should be a freeze frame of the structure now.
+        """
+        self = cls.__new__(cls)
+        self.rt = rt
+        self.rule = rt.rules_by_name[state["rule"]]
+        self.partial = state["partial"].copy()
+        add_nodes, remove_nodes, add_facts, remove_facts = state["frame"]
+        self.freeze_frame = current
+        if add_nodes or remove_nodes or add_facts or remove_facts:
+            self.freeze_frame = copy.copy(current)
+            self.freeze_frame.nodes = (current.nodes - remove_nodes) | add_nodes
+            self.freeze_frame.facts = (current.facts - remove_facts) | add_facts
+        reader = rt.network.reader(self.rule.must_pattern, self.partial)
+        if reader is None:
+            self.must_matcher = PatternMatcher(
+                rt, self.rule.must_pattern, self.partial, state["must"])
+        else:
+            self.must_matcher = SharedPatternMatcher(
+                rt.network, reader, state["must"])
+        self.must_assignments = dict()
+        nevers = [self.rule.never_patterns[never]
+                  for never in sorted(self.rule.never_patterns)]
+        for must, saved in state["entries"].items():
+            never_assignments, try_assignments = saved
+            assignment = thawdict(must)
+            self.must_assignments[must] = dict({
+                "nevers": [PatternMatcher(rt, never, assignment, assignments)
+                           for never, assignments
+                           in zip(nevers, never_assignments)],
+                "try": None,
+            })
+            if try_assignments is not None:
+                self.must_assignments[must]["try"] = PatternMatcher(
+                    rt, self.rule.try_pattern, assignment, try_assignments)
+        return self
+
 class PatternMatcher:
     """Keeps track of assignments to a single Pattern (existential formula).
     """
-    def __init__(self, rt, pattern, partial):
+    def __init__(self, rt, pattern, partial, assignments=None):
         """Initialize the PatternMatcher.
 
         @pattern should be a Pattern instance, while @partial should be the
-        same partial assignment on the owning Matcher instance.
+        same partial assignment on the owning Matcher instance. If
+        @assignments (a set of frozen dicts) is given, eg. when restoring a
+        checkpoint, they are taken as the current assignments instead of
+        solving for them.
         """
         self.rt = rt
         self.pattern = pattern
@@ -134,8 +223,12 @@ class PatternMatcher:
         # Maps assignment |-> set({facts})
         self.facts_used_in_assignment = defaultdict(set)
 
-        # Initializes must, full.
-        self.full_sync()
+        if assignments is None:
+            # Initializes must, full.
+            self.full_sync()
+            return
+        for frozen in assignments:
+            self.add_assignment(thawdict(frozen), frozen)
 
     def full_sync(self):
         """Initializes self.must, self.full (non-differential).
@@ -233,6 +326,46 @@ class PatternMatcher:
             return assignment
         return None
 
+class SharedPatternMatcher:
+    """Drop-in replacement for PatternMatcher using a CPPMatchNetwork.
+
+    The network tracks the structure itself, so one sync of it updates every
+    SharedPatternMatcher in the runtime and @delta is not needed.
+    """
+    def __init__(self, network, reader, assignments=None):
+        """Initialize the SharedPatternMatcher given a network reader.
+
+        If @assignments is given, eg. when restoring a checkpoint, they are
+        taken as the current assignments even if the network's differ; the
+        next sync then reports the difference.
+        """
+        self.network = network
+        self.reader = reader
+        self.stale = assignments is not None
+        if assignments is None:
+            assignments = network.assignments(reader)
+        self.assignments = assignments
+
+    def release(self):
+        """Releases the network reader, see CPPMatchNetwork.release."""
+        self.network.release(self.reader)
+
+    def sync(self, delta):
+        """Updates the set of known assignments to match the current structure.
+        """
+        # pylint: disable=unused-argument
+        removed, added = self.network.read(self.reader)
+        if self.stale:
+            # The network's changes are relative to when the reader was
+            # added, not to self.assignments, so compare them all once.
+            current = self.network.assignments(self.reader)
+            removed = self.assignments - current
+            added = current - self.assignments
+            self.stale = False
+        self.assignments -= removed
+        self.assignments |= added
+        return removed, added
+
 class OneOffMatcher:
     """Drop-in replacement for Matcher which does not save state."""
     def __init__(self, rt, rule, partial):
@@ -271,3 +404,23 @@ class OneOffMatcher:
 
     def sync(self):
         """No-op for the OneOffMatcher, which is always up-to-date."""
+
+class SolvedMatcher:
+    """Drop-in replacement for OneOffMatcher with pre-solved assignments.
+
+    See TSRuntime.propose_all. @assignments should be dicts {variable: node},
+    as returned by CPPStructure.match_all.
+    """
+    def __init__(self, rule, assignments):
+        """Initialize the SolvedMatcher."""
+        self.rule = rule
+        self.solved = assignments
+
+    def assignments(self):
+        """Yields the pre-solved rule assignments."""
+        node_to_variable = utils.Translator(self.rule.node_to_variable)
+        for assignment in self.solved:
+            yield Assignment(self.rule, node_to_variable.compose(assignment))
+
+    def sync(self):
+        """No-op for the SolvedMatcher, which is never updated."""
@@ -0,0 +1,149 @@
+"""Approximate accounting of the memory used by a TSRuntime.
+
+Large structures can run out of memory in several places: the Python
+TripletStructure.facts index, the C++ Structure index, the CPPPattern cache,
+the MatchNetwork and the assignments and reverse indexes of long-lived
+Matchers (eg. tactic_utils.MATCHERS). MemoryUsage(...) reports the bytes
+attributed to each of them, so they can be told apart. Typical usage:
+
+    usage = MemoryUsage(rt, tactic_utils.MATCHERS.values())
+    print(Summary(usage))
+
+Python sizes are shallow sys.getsizeof sums over the containers and the
+tuples they own; objects shared between caches (eg. node name strings) are
+counted where they are owned, or not at all. C++ sizes come from the
+MemoryUsage methods of the native classes, see ts_cpp/ts_lib.h. The cost is
+linear in the number of index keys and cached assignments and nothing is
+copied, so sampling periodically during long runs is cheap relative to the
+runs themselves.
+"""
+import sys
+# pylint: disable=no-name-in-module
+from ts_cpp import Triplet
+from runtime.importer import LazyFacts
+from runtime.matcher import Matcher, PatternMatcher, SharedPatternMatcher
+
+# A Triplet as held by Python: the wrapper object and the C++ value.
+_TRIPLET_BYTES = sys.getsizeof(Triplet(1, 1, 1)) + (3 * 4)
+
+def MemoryUsage(rt, matchers=()):
+    """Returns a dict mapping each part of @rt to its approximate bytes.
+
+    @matchers should be the Matchers of @rt which are kept alive between
+    syncs, such as those in tactic_utils.MATCHERS. Keys starting with
+    "native." are C++ memory; see NativeShapes(...) for a breakdown of
+    "native.structure".
+    """
+    ts, cppstruct = rt.ts, rt.solver
+    usage = dict({
+        "python.facts": _FactsBytes(ts),
+        "python.nodes": (sys.getsizeof(ts.nodes) +
+                         sum(map(sys.getsizeof, ts.nodes)) +
+                         sys.getsizeof(ts.display_names)),
+        "python.dictionary": (sys.getsizeof(cppstruct.dictionary) +
+                              sys.getsizeof(cppstruct.dictionary_back)),
+        "python.patterns": _PatternsBytes(cppstruct),
+        "python.matcher_assignments": 0,
+        "python.matcher_reverse_indexes": 0,
+        "native.structure": cppstruct.cpp.memoryUsage().total(),
+        "native.network": rt.network.network.memoryUsage(),
+    })
+    for matcher in matchers:
+        if not isinstance(matcher, Matcher) or matcher.rt is not rt:
+            continue
+        assignments, reverse_indexes = _MatcherBytes(matcher)
+        usage["python.matcher_assignments"] += assignments
+        usage["python.matcher_reverse_indexes"] += reverse_indexes
+    return usage
+
+def NativeShapes(rt):
+    """Returns the usage of each shape of @rt's C++ Structure index.
+
+    The result maps each built shape, as a string like "011" (slot 0 is the
+    rightmost bit, see Structure::ShapeOf), to a dict of the fields of
+    StructureMemory::Shape. Unbuilt shapes are left out.
+    """
+    shapes = dict()
+    for shape, usage in enumerate(rt.solver.cpp.memoryUsage().shapes):
+        if not usage.keys:
+            continue
+        shapes["{:03b}".format(shape)] = dict({
+            field: getattr(usage, field)
+            for field in ("keys", "facts", "inline_buckets", "flat_buckets",
+                          "hub_buckets", "table_bytes", "flat_bytes",
+                          "hub_bytes")})
+    return shapes
+
+def Summary(usage):
+    """Returns a table of a MemoryUsage(...) result, largest first."""
+    width = max(len(name) for name in usage)
+    lines = ["{:<{}} {:>12}".format("Part", width, "MiB")]
+    for name in sorted(usage, key=lambda name: -usage[name]):
+        lines.append("{:<{}} {:>12.2f}".format(
+            name, width, usage[name] / float(1 << 20)))
+    lines.append("{:<{}} {:>12.2f}".format(
+        "total", width, sum(usage.values()) / float(1 << 20)))
+    return "\n".join(lines)
+
+def _FactsBytes(ts):
+    """Bytes of ts.facts, counting each fact tuple once."""
+    if isinstance(ts.facts, LazyFacts) and (None, None, None) not in ts.facts:
+        # Every change loads the key, so no fact changed since the import.
+        n_facts = ts.facts.structure.size()
+    else:
+        n_facts = len(ts.facts.get((None, None, None), ()))
+    return (sys.getsizeof(ts.facts) +
+            sum(map(sys.getsizeof, ts.facts.keys())) +
+            sum(map(sys.getsizeof, ts.facts.values())) +
+            (n_facts * sys.getsizeof((None, None, None))))
+
+def _PatternsBytes(cppstruct):
+    """Bytes of the CPPPattern cache, see CPPPattern.__init__."""
+    total = sys.getsizeof(cppstruct.patterns)
+    for key, (_, pattern) in cppstruct.patterns.items():
+        total += sys.getsizeof(key) + sys.getsizeof(pattern.__dict__)
+        if not pattern.valid:
+            continue
+        total += (sys.getsizeof(pattern.constraints) +
+                  (len(pattern.constraints) * _TRIPLET_BYTES) +
+                  sys.getsizeof(pattern.sorted_variables) +
+                  sys.getsizeof(pattern.maybe_equal) +
+                  sum(map(sys.getsizeof, pattern.maybe_equal)))
+    return total
+
+def _MatcherBytes(matcher):
+    """Returns (assignments, reverse indexes) bytes of a Matcher.
+
+    Assignments include the frozen assignments of every PatternMatcher (or
+    SharedPatternMatcher) of the Matcher and its per-assignment entries;
+    reverse indexes are the PatternMatchers' fact <-> assignment maps.
+    """
+    assignments = sys.getsizeof(matcher.must_assignments)
+    reverse_indexes = 0
+    pattern_matchers = [matcher.must_matcher]
+    for entry in matcher.must_assignments.values():
+        assignments += sys.getsizeof(entry) + sys.getsizeof(entry["nevers"])
+        pattern_matchers.extend(entry["nevers"])
+        if entry["try"] is not None:
+            pattern_matchers.append(entry["try"])
+    for pattern_matcher in pattern_matchers:
+        assignments += _FrozenSetBytes(pattern_matcher.assignments)
+        if isinstance(pattern_matcher, SharedPatternMatcher):
+            continue
+        assert isinstance(pattern_matcher, PatternMatcher)
+        relying = pattern_matcher.assignments_relying_on_fact
+        # The fact tuples are owned by the index, the frozen assignments by
+        # pattern_matcher.assignments.
+        reverse_indexes += sum(map(sys.getsizeof, relying.keys()))
+        for index in (relying, pattern_matcher.facts_used_in_assignment):
+            reverse_indexes += (sys.getsizeof(index) +
+                                sum(map(sys.getsizeof, index.values())))
+    return assignments, reverse_indexes
+
+def _FrozenSetBytes(frozens):
+    """Bytes of a set of frozen dicts (see utils.freezedict)."""
+    total = sys.getsizeof(frozens)
+    pair = sys.getsizeof((None, None))
+    for frozen in frozens:
+        total += sys.getsizeof(frozen) + (len(frozen) * pair)
+    return total
@@ -2,7 +2,9 @@
 """
 # pylint: disable=no-name-in-module,import-error
 from collections import defaultdict
+import itertools
 from runtime.pattern import Pattern
+from runtime.cpp_structure import CPPRuleTemplate, CPPRule
 import runtime.utils as utils
 
 MAP_TYPES = ["/MUST_MAP", "/TRY_MAP", "/NO_MAP"]
@@ -12,9 +14,12 @@ NODE_TYPES = MAP_TYPES + ACTION_TYPES
 class ProductionRule:
     """Represents a single /RULE in the TripletStructure.
     """
-    def __init__(self, runtime, rule):
+    def __init__(self, runtime, rule, maps, facts):
         """Initializes a ProductionRule given the corresponding node.
 
+        @maps and @facts are the facts making up the rule, as returned by
+        CPPStructure.extract_rules.
+
         NOTE: The structure can be modified arbitrarily once a ProductionRule
         is initialized; all relevant information is copied into the object
         itself.
@@ -23,29 +28,80 @@ class ProductionRule:
         self.ts = runtime.ts
         self.name = rule
         self.is_backtracking = None
-        self.parse_rule()
+        self.parse_rule(maps)
         self.assign_variables()
-        self.prepare_constraints()
+        self.indexed_facts = dict({node: [] for node in self.all_nodes})
+        for fact in facts:
+            if fact[0] in self.indexed_facts:
+                self.indexed_facts[fact[0]].append(fact)
         self.facts = [fact for node in self.all_nodes
-                      for fact in self.ts.lookup(node, None, None)]
-        self.indexed_facts = dict({
-            node: self.ts.lookup(node, None, None).copy()
-            for node in self.all_nodes
-        })
+                      for fact in self.indexed_facts[node]]
+        self.prepare_constraints()
+        self.template = CPPRuleTemplate(self.runtime.solver, self)
+        self.compiled = CPPRule(self.runtime.solver, self)
 
-    def parse_rule(self):
-        """Parses the relevant nodes to the rule (eg. MUST_MAP, etc.)
+    # Attributes set by parsing, which checkpoint() saves.
+    PARSED = ("name", "is_backtracking", "nodes_by_type", "map_nodes",
+              "all_nodes", "equal", "maybe_equal", "node_to_variable",
+              "variable_to_node", "maybe_equal_variables", "facts",
+              "indexed_facts")
+
+    def checkpoint(self):
+        """Returns the parsed rule as picklable data, see from_checkpoint.
+
+        See runtime/checkpoint.py.
         """
-        rule_node, solver = self.name, self.runtime.solver
+        state = dict({name: getattr(self, name) for name in self.PARSED})
+        # Patterns refer to the runtime, so only their constraints are saved.
+        state["must"] = self.must_pattern.constraints
+        state["try"] = self.try_pattern.constraints
+        state["nevers"] = dict({index: pattern.constraints for index, pattern
+                                in self.never_patterns.items()})
+        return state
+
+    @classmethod
+    def from_checkpoint(cls, runtime, state):
+        """Restores a ProductionRule saved by checkpoint() into @runtime.
+
+        Unlike __init__, this does not read the structure (from which rule
+        nodes have since been removed, see TSRuntime.extract_rules). Only the
+        native template and compiled rule are rebuilt.
+        """
+        self = cls.__new__(cls)
+        self.runtime = runtime
+        self.ts = runtime.ts
+        for name in cls.PARSED:
+            setattr(self, name, state[name])
+
+        def pattern(constraints):
+            return Pattern(self.runtime, constraints,
+                           self.maybe_equal_variables, self.variable_to_node)
+        self.must_pattern = pattern(state["must"])
+        self.try_pattern = pattern(state["try"])
+        self.never_patterns = defaultdict(lambda: pattern([]))
+        for index, constraints in state["nevers"].items():
+            self.never_patterns[index] = pattern(constraints)
+        self.template = CPPRuleTemplate(self.runtime.solver, self)
+        self.compiled = CPPRule(self.runtime.solver, self)
+        return self
+
+    def parse_rule(self, maps):
+        """Parses the relevant nodes to the rule (eg. MUST_MAP, etc.)
 
+        @maps are the facts (map, value, key) about the map nodes of the rule,
+        see ExtractRules in ts_cpp/ts_lib.h.
+        """
         self.nodes_by_type = defaultdict(list)
         self.nodes_by_type["/NO_MAP"] = defaultdict(list)
         self.map_nodes = []
-        self.all_nodes = set({rule_node})
-        pattern = [(0, rule_node, "/RULE"), (0, 1, 2)]
-        for assignment in solver.assignments(pattern):
-            self.all_nodes.add(assignment[0])
-            value, key = assignment[1], assignment[2]
+        self.all_nodes = set({self.name})
+        # Values of each map node under /= and /MAYBE=.
+        equivalences = dict({"/=": defaultdict(list),
+                             "/MAYBE=": defaultdict(list)})
+        for map_node, value, key in maps:
+            self.all_nodes.add(map_node)
+            if key in equivalences:
+                equivalences[key][map_node].append(value)
             try:
                 node_type = next(node_type for node_type in NODE_TYPES
                                  if key.startswith(node_type))
@@ -61,20 +117,13 @@ class ProductionRule:
                 self.map_nodes.append(value)
             self.all_nodes.add(value)
 
+        # Nodes are equal if they are values of the same map node.
         self.equal = defaultdict(set)
-        for assignment in solver.assignments([(0, rule_node, "/RULE"),
-                                              (0, 1, "/="),
-                                              (0, 2, "/=")]):
-            # NOTE that assignments will call this for each permutation of the
-            # two, so we don't actually need to special-case that.
-            self.equal[assignment[1]].add(assignment[2])
-
         self.maybe_equal = defaultdict(set)
-        for assignment in solver.assignments([(0, rule_node, "/RULE"),
-                                              (0, 1, "/MAYBE="),
-                                              (0, 2, "/MAYBE=")]):
-            # NOTE see above.
-            self.maybe_equal[assignment[1]].add(assignment[2])
+        for key, equal in (("/=", self.equal), ("/MAYBE=", self.maybe_equal)):
+            for values in equivalences[key].values():
+                for value, other in itertools.permutations(values, 2):
+                    equal[value].add(other)
 
     def assign_variables(self):
         """Gives each node in the mapping a variable name/ID/number.
@@ -115,9 +164,8 @@ class ProductionRule:
     def prepare_constraints(self):
         """Extracts the constraints corresponding to the rule.
 
-        MUST be called after parse_rule().
+        MUST be called after parse_rule() and indexing self.indexed_facts.
         """
-        ts = self.ts
         node_to_variable = utils.Translator(self.node_to_variable)
 
         # We will keep track of which nodes have constraints on them to avoid
@@ -136,7 +184,7 @@ class ProductionRule:
         self.try_pattern = pattern()
         self.never_patterns = defaultdict(pattern)
         relevant_facts = (fact for node in self.map_nodes
-                          for fact in ts.lookup(node, None, None))
+                          for fact in self.indexed_facts[node])
         for fact in relevant_facts:
             constrained.update(fact)
             constraint = node_to_variable.translate_tuple(fact)
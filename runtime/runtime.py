@@ -1,23 +1,35 @@
 """Methods for parsing and executing TripletStructures according to their rules.
 """
 # pylint: disable=import-error,no-name-in-module
-from runtime.cpp_structure import CPPStructure
+from collections import defaultdict
+from runtime.activation import ActivationIndex
+from runtime.cpp_structure import CPPStructure, CPPMatchNetwork
 from runtime.production_rule import ProductionRule
 from runtime.interactive import TSREPL
-from runtime.matcher import OneOffMatcher
+from runtime.matcher import OneOffMatcher, SolvedMatcher
+from runtime.trace import traced
 
 class TSRuntime:
     """A runtime for interpreting and executing triplet structures.
     """
-    def __init__(self, ts):
+    @traced()
+    def __init__(self, ts, compact_names=False):
         """Initializes a new TSRuntime.
+
+        If @compact_names, nodes inserted by rules get (shorter) numeric names
+        instead of hex ones; see Assignment.node_name.
         """
         ts.commit(False)
         self.ts = ts
+        self.compact_names = compact_names
         # The Solver handles the 'dirty work' of actually finding matches to
         # rule implicants.
         self.solver = CPPStructure(self.ts)
+        # Shared by every Matcher; see runtime/matcher.py.
+        self.network = CPPMatchNetwork(self.solver)
         self.extract_rules()
+        # Used by Matchers to skip syncs which can not affect their rule.
+        self.activation = ActivationIndex(self.rules)
         ts.commit(False)
 
     def interactive(self):
@@ -40,17 +52,15 @@ class TSRuntime:
         self.rules = []
         self.rules_by_name = dict()
 
-        rule_nodes = set(fact[1] for fact in ts.lookup(None, None, "/RULE"))
-        for rule_node in sorted(rule_nodes):
-            rule = ProductionRule(self, rule_node)
+        for rule_node, maps, facts in self.solver.extract_rules():
+            rule = ProductionRule(self, rule_node, maps, facts)
             self.rules.append(rule)
             self.rules_by_name[rule.name] = rule
 
         avoid_nodes = set(avoid_node for rule in self.rules
                           for avoid_node in rule.all_nodes)
-        for avoid_node in avoid_nodes:
-            ts[avoid_node].remove_with_facts()
-        for node in ts.nodes.copy():
+        ts.remove_nodes_with_facts(sorted(avoid_nodes))
+        for node in list(ts.nodes):
             if not node.startswith("/:"):
                 ts[node].remove()
 
@@ -70,6 +80,92 @@ class TSRuntime:
             if self.ts.path[-1] is delta:
                 self.ts.rollback(-1)
 
+    @traced()
+    def matcher_batch(self, matcher):
+        """Applies a maximal set of non-interfering assignments of a Matcher.
+
+        Assignments are considered in matcher.assignments() order and added to
+        the batch unless they interfere with one already in it, ie. one of
+        them removes a fact or node the other reads, adds a fact which could
+        match a /TRY_MAP or /NO_MAP constraint the other relies on, or writes
+        a fact the other writes; see Assignment.footprint. Assignments which
+        would not change the structure are skipped. Applying the batch in order
+        is then the same as applying its assignments one at a time, but it is
+        committed as a single TSDelta and the Matcher is only synced once.
+
+        Returns (assignments, delta), where delta is None if the batch is
+        empty.
+        """
+        assert self.ts.is_clean()
+        batch = []
+        read_facts, read_nodes, written_facts = set(), set(), set()
+        removed_facts, removed_nodes = set(), set()
+        # Maps shape |-> set({keys}) of the patterns read or facts added so
+        # far, as in ActivationIndex. Facts are indexed under every shape.
+        patterns, added_facts = defaultdict(set), defaultdict(set)
+        shapes = [tuple(i for i in range(3) if (mask >> i) & 1)
+                  for mask in range(8)]
+        def project(fact, shape):
+            return tuple(fact[i] for i in shape)
+        def shape_of(pattern):
+            return tuple(i for i in range(3) if pattern[i] is not None)
+        for assignment in matcher.assignments():
+            footprint = assignment.footprint()
+            if footprint is None:
+                continue
+            (facts, reads, nodes), (added, removed, unnoded) = footprint
+            interferes = (
+                bool(removed & read_facts) or bool(facts & removed_facts) or
+                bool(unnoded & read_nodes) or bool(nodes & removed_nodes) or
+                bool((added | removed) & written_facts) or
+                any(project(fact, shape) in keys for fact in added
+                    for shape, keys in patterns.items()) or
+                any(project(pattern, shape_of(pattern))
+                    in added_facts[shape_of(pattern)] for pattern in reads))
+            if interferes:
+                continue
+            batch.append(assignment)
+            read_facts.update(facts)
+            read_nodes.update(nodes)
+            written_facts.update(added | removed)
+            removed_facts.update(removed)
+            removed_nodes.update(unnoded)
+            for pattern in reads:
+                patterns[shape_of(pattern)].add(
+                    project(pattern, shape_of(pattern)))
+            for fact in added:
+                for shape in shapes:
+                    added_facts[shape].add(project(fact, shape))
+        for assignment in batch:
+            assignment.apply()
+        return batch, self.ts.commit(commit_if_clean=False) or None
+
+    def fixedpoint(self, rules, partial=None):
+        """Applies the rules named @rules natively until fixedpoint.
+
+        Uses semi-naive evaluation: each round fires every match found for
+        it, and while rounds only add facts the next round only looks for
+        matches using the facts just added. Unlike
+        tactic_utils.RuleFixedpoint, firings are not re-synced one at a time,
+        so for rules which interfere with each other the result can depend on
+        firing order. The whole run is committed as one TSDelta.
+
+        Returns a dict summarizing the change.
+        """
+        assert self.ts.is_clean()
+        rules = [self.rules_by_name[rule] for rule in rules]
+        native, added_facts, removed_facts, added_nodes, removed_nodes = \
+            self.solver.fixedpoint(rules, partial or dict(), self.compact_names)
+        return dict({
+            "rounds": native.rounds(),
+            "firings": native.firings(),
+            "added_facts": added_facts,
+            "removed_facts": removed_facts,
+            "added_nodes": added_nodes,
+            "removed_nodes": removed_nodes,
+            "delta": self.ts.commit(commit_if_clean=False) or None,
+        })
+
     def propose(self, rule, partial=None):
         """Propose TSDeltas based on the rules.
 
@@ -80,13 +176,38 @@ class TSRuntime:
         matcher = OneOffMatcher(self, rule, partial or dict())
         yield from self.matcher_propose(matcher)
 
-    def propose_all(self, rules=None):
+    def propose_all(self, rules=None, n_threads=None):
         """Helper to yield proposals from multiple ProductionRules.
+
+        By default each rule is only solved once the proposals of the ones
+        before it are exhausted, so callers stopping at the first proposal
+        they keep (eg. interactive.py) do not pay for the rest. If
+        @n_threads is given, the matches of all the rules are instead first
+        solved concurrently, on up to @n_threads threads (one per core if 0,
+        see CPPStructure.match_all), then proposed in the order of @rules
+        exactly as propose would. If the caller keeps a proposal (or
+        otherwise changes the structure) in between, the remaining rules are
+        solved again with propose.
         """
         if rules is None:
             rules = [rule.name for rule in self.rules]
-        for rule in rules:
-            yield from self.propose(rule)
+        if n_threads is None:
+            for rule in rules:
+                yield from self.propose(rule)
+            return
+        assert self.ts.is_clean()
+        def head():
+            return len(self.ts.path), (self.ts.path or [None])[-1]
+        length, last = head()
+        solved = self.solver.match_all(
+            [self.rules_by_name[rule] for rule in rules], n_threads)
+        for rule, assignments in zip(rules, solved):
+            if (head()[0] != length or head()[1] is not last
+                    or not self.ts.is_clean()):
+                yield from self.propose(rule)
+                continue
+            matcher = SolvedMatcher(self.rules_by_name[rule], assignments)
+            yield from self.matcher_propose(matcher)
 
     def get_rule(self, name):
         """Returns the ProductionRule associated with @name.
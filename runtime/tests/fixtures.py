@@ -0,0 +1,15 @@
+"""Structures shared by the runtime tests."""
+from ts_utils import RegisterRule
+
+def AddMarkB(ts, n_facts):
+    """Adds @n_facts nodes /:Node{i} of type /:A and the rule /:MarkB:_.
+
+    /:MarkB:_ marks every /:A node as a /:B node, once.
+    """
+    for i in range(n_facts):
+        ts["/:Fact{}".format(i)].map({ts["/:Node{}".format(i)]: ts["/:A"]})
+    with ts.scope("/:MarkB"):
+        ts[":MustMap:MA"].map({ts[":MustMap:X"]: ts["/:A"]})
+        ts[":NoMap:MB"].map({ts[":MustMap:X"]: ts["/:B"]})
+        ts[":Insert:MB"].map({ts[":MustMap:X"]: ts["/:B"]})
+        RegisterRule(ts)
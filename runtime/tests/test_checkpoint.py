@@ -0,0 +1,83 @@
+"""Tests for checkpoint.py"""
+import tempfile
+from external.bazel_python.pytest_helper import main
+from ts_lib import TripletStructure
+from runtime.tests.fixtures import AddMarkB
+from runtime.runtime import TSRuntime
+from tactic_utils import RuleFixedpoint, GetMatcher
+from tactic_utils import SaveCheckpoint, RestoreCheckpoint
+
+def _facts(rt):
+    """All facts in @rt's structure, sorted."""
+    return sorted(rt.ts.lookup(None, None, None))
+
+def test_save_restore():
+    """Tests resuming a runtime and its Matchers from a checkpoint."""
+    ts = TripletStructure()
+    AddMarkB(ts, 20)
+    rt = TSRuntime(ts)
+    matcher = GetMatcher(rt, "/:MarkB:_", dict({}))
+    for _ in range(3):
+        matcher.sync()
+        _ = next(rt.matcher_propose(matcher))
+    # Leave the Matcher behind the structure.
+    ts[":Fact20"].map({ts[":Node20"]: ts[":A"]})
+    ts.commit()
+
+    with tempfile.TemporaryDirectory() as directory:
+        SaveCheckpoint(rt, directory)
+        restored = RestoreCheckpoint(directory)
+        # The structure is mapped from the checkpoint.
+        assert restored.solver.cpp.memoryUsage().mapped_bytes > 0
+
+        assert restored is not rt
+        assert _facts(restored) == _facts(rt)
+        assert sorted(restored.ts.nodes) == sorted(rt.ts.nodes)
+        assert len(restored.ts.path) == len(rt.ts.path)
+        assert [rule.name for rule in restored.rules] == ["/:MarkB:_"]
+        original, copy = rt.rules[0], restored.rules[0]
+        assert copy.nodes_by_type == original.nodes_by_type
+        assert copy.indexed_facts == original.indexed_facts
+        assert (copy.must_pattern.constraints
+                == original.must_pattern.constraints)
+        assert set(copy.never_patterns) == set(original.never_patterns)
+
+        resumed = GetMatcher(restored, "/:MarkB:_", dict({}))
+        assert resumed is not matcher
+        assert resumed.rule is copy
+        assert set(resumed.must_assignments) == set(matcher.must_assignments)
+        assert resumed.freeze_frame.facts == matcher.freeze_frame.facts
+
+        # Both runs carry on to the same result.
+        RuleFixedpoint(rt, "/:MarkB:_")
+        RuleFixedpoint(restored, "/:MarkB:_")
+        assert _facts(restored) == _facts(rt)
+        assert len(restored.ts.lookup(None, None, "/:B")) == 21
+        assert restored.solver.cpp.size() == len(_facts(restored))
+
+        # Deltas from before the checkpoint can still be rolled back.
+        restored.ts.rollback(2)
+        rt.ts.rollback(2)
+        assert _facts(restored) == _facts(rt)
+        assert restored.solver.cpp.size() == len(_facts(restored))
+
+def test_save_after_rollback():
+    """Tests checkpointing after proposals inserting nodes are rolled back."""
+    ts = TripletStructure()
+    AddMarkB(ts, 5)
+    rt = TSRuntime(ts)
+    matcher = GetMatcher(rt, "/:MarkB:_", dict({}))
+    matcher.sync()
+    # Each proposal inserts a node and is rolled back before the next.
+    assert len(list(rt.matcher_propose(matcher))) == 5
+    assert ts.is_clean() and not ts.lookup(None, None, "/:B")
+
+    with tempfile.TemporaryDirectory() as directory:
+        SaveCheckpoint(rt, directory)
+        restored = RestoreCheckpoint(directory)
+        assert _facts(restored) == _facts(rt)
+        assert sorted(restored.ts.nodes) == sorted(rt.ts.nodes)
+        RuleFixedpoint(restored, "/:MarkB:_")
+        assert len(restored.ts.lookup(None, None, "/:B")) == 5
+
+main(__name__, __file__)
@@ -1,8 +1,19 @@
 """Tests for cpp_structure.py"""
 from collections import defaultdict
+from concurrent.futures import ThreadPoolExecutor
+import os
+import tempfile
 from external.bazel_python.pytest_helper import main
 from ts_lib import TripletStructure
-from runtime.cpp_structure import CPPStructure, CPPPattern
+from ts_utils import RegisterRule, AssertNodesEqual
+from runtime.runtime import TSRuntime
+from tactic_utils import RuleFixedpoint, GetMatcher, ScopedMatchers
+from tactic_utils import MATCHERS
+# pylint: disable=no-name-in-module
+from ts_cpp import Solver, Structure, Triplet, RuleTemplate, stableName
+from runtime.cpp_structure import CPPStructure, CPPPattern, CPPMatchNetwork
+from runtime.pattern import Pattern
+from runtime.utils import freezedict
 
 def test_simple_constraints():
     """Tests the CPPStructure class."""
@@ -50,4 +61,522 @@ def test_simple_constraints():
     # Test we can pull from the cache correctly.
     assert list(ts_cpp.assignments(constraints, maybe_equal)) == truth
 
+def test_is_true_many():
+    """Tests the batched membership check on the C++ Structure."""
+    ts = TripletStructure()
+    ts[":A"].map({ts[":B"]: ts[":C"]})
+    ts_cpp = CPPStructure(ts)
+    a, b, c = (ts_cpp.dictionary[node] for node in ("/:A", "/:B", "/:C"))
+    assert ts_cpp.cpp.isTrue(a, b, c)
+    assert not ts_cpp.cpp.isTrue(c, b, a)
+    assert ts_cpp.cpp.isTrueMany([a, b, c, c, b, a, a, b, c]) == [
+        True, False, True]
+    ts.remove_fact(("/:A", "/:B", "/:C"))
+    assert ts_cpp.cpp.isTrueMany([a, b, c]) == [False]
+    assert ts_cpp.cpp.isTrueMany([]) == []
+
+def test_lazy_index():
+    """Tests that the C++ index only builds the shapes that are looked up."""
+    ts = TripletStructure()
+    ts[":A"].map({ts[":B"]: ts[":C"]})
+    ts[":B"].map({ts[":B"]: ts[":C"]})
+    ts_cpp = CPPStructure(ts)
+    assert ts_cpp.cpp.materializedShapes() == 0
+    # Solving for 0 looks up (0, /:B, /:C).
+    assert (list(ts_cpp.assignments([(0, "/:B", "/:C")]))
+            == [dict({0: "/:A"}), dict({0: "/:B"})])
+    assert ts_cpp.cpp.materializedShapes() == (1 << 0b110)
+    # Built shapes are maintained...
+    ts.remove_fact(("/:A", "/:B", "/:C"))
+    assert list(ts_cpp.assignments([(0, "/:B", "/:C")])) == [dict({0: "/:B"})]
+    # ...and kept through compactions with only modifications in between...
+    ts_cpp.cpp.compactIndex()
+    assert ts_cpp.cpp.materializedShapes() == (1 << 0b110)
+    ts[":A"].map({ts[":B"]: ts[":C"]})
+    ts.remove_fact(("/:A", "/:B", "/:C"))
+    ts_cpp.cpp.compactIndex()
+    assert ts_cpp.cpp.materializedShapes() == (1 << 0b110)
+    # ...until they go unused while other shapes are looked up.
+    assert len(list(ts_cpp.assignments([(0, 0, "/:C")]))) == 1
+    ts_cpp.cpp.compactIndex()
+    assert ts_cpp.cpp.materializedShapes() == (1 << 0b100)
+    ts[":A"].map({ts[":B"]: ts[":C"]})
+    assert (list(ts_cpp.assignments([(0, "/:B", "/:C")]))
+            == [dict({0: "/:A"}), dict({0: "/:B"})])
+
+def test_concurrent_solves():
+    """Tests that solves from several Python threads agree with serial ones."""
+    ts = TripletStructure()
+    for i in range(30):
+        for j in range(i % 7, 30, 7):
+            ts[":%d" % i].map({ts[":%d" % j]: ts[":Next"]})
+    ts_cpp = CPPStructure(ts)
+    constraints = [(0, 1, "/:Next"), (1, 2, "/:Next"), (2, 3, "/:Next")]
+    serial = list(ts_cpp.assignments(constraints))
+    # More than one batch of assignments.
+    assert len(serial) > CPPStructure.max_solve_batch
+    # Every thread races to build the shapes lazily.
+    ts_cpp.cpp.compactIndex()
+    ts_cpp.cpp.compactIndex()
+    assert ts_cpp.cpp.materializedShapes() == 0
+    with ThreadPoolExecutor(4) as executor:
+        results = list(executor.map(
+            lambda _: list(ts_cpp.assignments(constraints)), range(8)))
+    assert results == [serial] * 8
+
+def test_published():
+    """Tests solving published versions while the structure changes."""
+    ts = TripletStructure()
+    ts_cpp = CPPStructure(ts)
+    constraints = [(0, 1, "/:Near"), (1, 0, "/:Near")]
+    assert not list(ts_cpp.assignments(constraints,
+                                       structure=ts_cpp.published()))
+
+    def write():
+        # Both directions of each pair are published together.
+        for i in range(0, 200, 2):
+            a, b = ts[":%d" % i], ts[":%d" % (i + 1)]
+            a.map({b: ts[":Near"]})
+            b.map({a: ts[":Near"]})
+            ts_cpp.publish()
+    def read(_):
+        sizes = []
+        for _ in range(50):
+            version = ts_cpp.published()
+            near = list(ts_cpp.assignments([(0, 1, "/:Near")],
+                                           structure=version))
+            assert len(list(ts_cpp.assignments(
+                constraints, structure=version))) == len(near)
+            sizes.append(len(near))
+        return sizes
+    with ThreadPoolExecutor(4) as executor:
+        readers = [executor.submit(read, i) for i in range(3)]
+        write()
+        for reader in readers:
+            # Versions only ever grow.
+            assert reader.result() == sorted(reader.result())
+
+    # Versions are not affected by later changes.
+    ts.remove_fact(("/:0", "/:1", "/:Near"))
+    final = ts_cpp.published()
+    assert len(list(ts_cpp.assignments(constraints, structure=final))) == 200
+    assert len(list(ts_cpp.assignments(constraints))) == 198
+
+def test_snapshot():
+    """Tests solving against a snapshot while the structure changes."""
+    ts = TripletStructure()
+    ts[":A"].map({ts[":B"]: ts[":C"]})
+    ts_cpp = CPPStructure(ts)
+    snapshot = ts_cpp.cpp.snapshot()
+    ts[":B"].map({ts[":B"]: ts[":C"]})
+    ts.remove_fact(("/:A", "/:B", "/:C"))
+
+    pattern = CPPPattern(ts_cpp, [(0, "/:B", "/:C")], None)
+    def solve(structure):
+        solver = Solver(structure, 1, pattern.constraints, pattern.maybe_equal)
+        return [ts_cpp.dictionary_back[assignment[0]]
+                for assignment in iter(solver.nextAssignment, [])]
+    assert solve(snapshot) == ["/:A"]
+    assert solve(ts_cpp.cpp) == ["/:B"]
+
+    ts_cpp.cpp.restore(snapshot)
+    assert solve(ts_cpp.cpp) == ["/:A"]
+
+def test_save_open():
+    """Tests opening a saved structure instead of rebuilding it."""
+    ts = TripletStructure()
+    for i in range(40):
+        ts[":Node{}".format(i)].map({ts[":Node{}".format(i % 7)]: ts[":R"]})
+    built = CPPStructure(ts)
+    with tempfile.TemporaryDirectory() as directory:
+        path = os.path.join(directory, "structure.bin")
+        built.save(path)
+        opened = CPPStructure(ts, path)
+        assert opened.cpp.memoryUsage().mapped_bytes == os.path.getsize(path)
+        for key in [(0, 0, 0), (1, 0, 0), (0, 1, 0), (0, 0, 8), (2, 3, 0),
+                    (2, 0, 8), (0, 3, 8), (2, 3, 8), (9, 9, 9), (99, 0, 0)]:
+            assert (len(opened.cpp.lookup(*key)) ==
+                    len(built.cpp.lookup(*key)))
+            assert opened.cpp.isTrue(*key) == built.cpp.isTrue(*key)
+        constraints = [(0, 1, "/:R"), (1, 2, "/:R")]
+        assert (list(opened.assignments(constraints)) ==
+                list(built.assignments(constraints)))
+
+        # Changes copy the structure out of the file, which is left as is.
+        ts[":Node0"].map({ts[":Node38"]: ts[":R"], ts[":Node39"]: ts[":R"]})
+        ts.remove_fact(("/:Node1", "/:Node1", "/:R"))
+        assert opened.cpp.memoryUsage().mapped_bytes == 0
+        assert opened.cpp.size() == 41
+        assert list(opened.assignments([("/:Node0", 0, "/:R")])) == [
+            dict({0: "/:Node0"}), dict({0: "/:Node38"}),
+            dict({0: "/:Node39"})]
+        assert Structure.open(path, None).size() == 40
+        mismatched = False
+        try:
+            CPPStructure(ts, path)
+        except AssertionError:
+            mismatched = True
+        assert mismatched
+
+def test_transactions():
+    """Tests rolling back and re-applying deltas through the undo log."""
+    ts = TripletStructure()
+    ts[":A"].map({ts[":B"]: ts[":C"]})
+    ts.commit()
+    ts_cpp = CPPStructure(ts)
+    def cpp_has(fact):
+        return ts_cpp.cpp.isTrue(*ts_cpp.translator.translate_tuple(fact))
+    abc, bca = ("/:A", "/:B", "/:C"), ("/:B", "/:C", "/:A")
+
+    ts[":B"].map({ts[":C"]: ts[":A"]})
+    ts.remove_fact(abc)
+    delta = ts.commit()
+    assert delta.shadow_txn is not None
+    assert cpp_has(bca) and not cpp_has(abc)
+    ts.rollback(-1)
+    assert cpp_has(abc) and not cpp_has(bca)
+    delta.apply()
+    assert cpp_has(bca) and not cpp_has(abc)
+
+    # The running buffer is rolled back as well, as is the first commit (which
+    # was made before the CPPStructure existed).
+    ts[":A"].map({ts[":C"]: ts[":B"]})
+    ts.rollback(1)
+    assert not ts.lookup(None, None, None)
+    assert not any(map(cpp_has, [abc, bca, ("/:A", "/:C", "/:B")]))
+    # Rolling back later deltas shouldn't redo the above.
+    ts[":X"].map({ts[":X"]: ts[":X"]})
+    ts.commit()
+    ts.rollback(-1)
+    assert not any(map(cpp_has, [abc, bca, ("/:X", "/:X", "/:X")]))
+
+    # Deltas whose transaction has been dropped from the undo log are replayed
+    # through the shadow instead.
+    yyy = ("/:Y", "/:Y", "/:Y")
+    ts[":Y"].map({ts[":Y"]: ts[":Y"]})
+    delta = ts.commit()
+    ts_cpp.forget_txns(None)
+    assert not ts_cpp.rollback_txn(delta.shadow_txn[1]) and cpp_has(yyy)
+    ts.rollback(-1)
+    assert not cpp_has(yyy)
+
+def test_remove_nodes_with_facts():
+    """Tests removing nodes with their facts natively."""
+    ts = TripletStructure()
+    for i in range(10):
+        ts[":A{}".format(i)].map({ts[":B{}".format(i % 3)]: ts[":C"]})
+    ts[":B0"].map({ts[":B1"]: ts[":B0"]})
+    ts.commit()
+    ts_cpp = CPPStructure(ts)
+    # Builds the shape holding every fact, so it is maintained too.
+    ts_cpp.cpp.lookup(0, 0, 0)
+    ts.remove_nodes_with_facts(["/:B0", "/:B1", "/:Missing"])
+    assert not ts.has_node("/:B0") and not ts.has_node("/:B1")
+    assert len(ts.lookup(None, None, None)) == 3
+    assert ts_cpp.cpp.size() == 3
+    assert (sorted(ts_cpp.unflatten(ts_cpp.cpp.lookupFlat(0, 0, 0)))
+            == sorted(ts.lookup(None, None, None)))
+    ts.rollback()
+    assert ts_cpp.cpp.size() == len(ts.lookup(None, None, None)) == 11
+
+def test_extract_rules():
+    """Tests reading rules, and their equivalences, natively."""
+    ts = TripletStructure()
+    with ts.scope(":Rule"):
+        ts[":MustMap:A"].map({ts[":MustMap:B"]: ts["/:X"]})
+        ts[":Insert:C"].map({ts[":MustMap:B"]: ts["/:X"]})
+        RegisterRule(ts)
+        AssertNodesEqual(ts, ts[":MustMap:A, :Insert:C"], "")
+    solver = CPPStructure(ts)
+    extracted = solver.extract_rules()
+    assert [rule for rule, _, _ in extracted] == ["/:Rule:_"]
+    _, maps, facts = extracted[0]
+    assert ("/:Rule:Equivalence:0", "/:Rule:MustMap:A", "/=") in maps
+    assert ("/:Rule:MustMap:A", "/:Rule:MustMap:B", "/:X") in facts
+
+    rt = TSRuntime(ts)
+    rule = rt.rules_by_name["/:Rule:_"]
+    assert sorted(rule.nodes_by_type["/MUST_MAP"]) == [
+        "/:Rule:MustMap:A", "/:Rule:MustMap:B"]
+    assert rule.nodes_by_type["/INSERT"] == ["/:Rule:Insert:C"]
+    assert rule.equal["/:Rule:MustMap:A"] == set({"/:Rule:Insert:C"})
+    assert rule.equal["/:Rule:Insert:C"] == set({"/:Rule:MustMap:A"})
+    assert (rule.node_to_variable["/:Rule:MustMap:A"]
+            == rule.node_to_variable["/:Rule:Insert:C"])
+    assert rule.indexed_facts["/:Rule:Insert:C"] == [
+        ("/:Rule:Insert:C", "/:Rule:MustMap:B", "/:X")]
+    # The rule's nodes are removed, while /:X is not.
+    assert not any(node.startswith("/:Rule") for node in ts.nodes)
+    assert ts.has_node("/:X")
+
+def test_rule_template():
+    """Tests applying a RuleTemplate directly."""
+    ts = TripletStructure()
+    ts[":A"].map({ts[":B"]: ts[":C"]})
+    ts[":B"].map({ts[":B"]: ts[":C"], ts[":C"]: ts[":A"]})
+    ts_cpp = CPPStructure(ts)
+    a, b, c = (ts_cpp.dictionary["/:" + name] for name in "ABC")
+    # Insert (0, 1, C), subtract (0, 1, C) and (1, B, C), remove 2.
+    template = RuleTemplate(
+        3, [Triplet(0, -1, c)], [Triplet(0, -1, c), Triplet(-1, b, c)], [2])
+
+    # Subtracting takes precedence over inserting, and unassigned variables
+    # skip the instruction.
+    assert (template.apply(ts_cpp.cpp, [a, a, 0])
+            == ([a, a, c], [a, a, c, a, b, c]))
+    assert not ts_cpp.cpp.isTrue(a, a, c) and not ts_cpp.cpp.isTrue(a, b, c)
+    assert template.apply(ts_cpp.cpp, [0, 0, b]) == ([], [b, b, c, b, c, a])
+    assert not ts_cpp.cpp.isTrue(b, c, a)
+
+def test_subtract_inserted_fact():
+    """Tests that both rule action paths subtract a fact also inserted.
+
+    This is eg. a Turing machine transition back to the same state.
+    """
+    def apply(native):
+        ts = TripletStructure()
+        with ts.scope(":Stay"):
+            with ts.scope(":MustMap:Subtract"):
+                ts[":MState"].map({ts[":State"]: ts["/:On"]})
+            with ts.scope(":Insert"):
+                ts[":MState"].map({ts[":State"]: ts["/:On"]})
+            RegisterRule(ts, auto_assert_equal=True)
+        ts[":MState"].map({ts[":CurrentState"]: ts[":On"]})
+        ts[":Other"].map({ts[":CurrentState"]: ts[":Off"]})
+        rt = TSRuntime(ts)
+        matcher = GetMatcher(rt, "/:Stay:_", dict())
+        matcher.sync()
+        assignment, = matcher.assignments()
+        if not native:
+            # Without the CPPStructure shadow, Assignment.apply does not use
+            # the rule's native template.
+            ts.shadow = None
+        assignment.apply()
+        return sorted(ts.lookup(None, None, None)), list(ts.nodes)
+    native = apply(native=True)
+    assert native == apply(native=False)
+    assert native[0] == [("/:Other", "/:CurrentState", "/:Off")]
+
+def test_scoped_matchers():
+    """Tests that ScopedMatchers releases the readers of its Matchers."""
+    ts = TripletStructure()
+    ts[":A"].map({ts[":B"]: ts[":C"]})
+    with ts.scope(":Rule"):
+        ts[":MustMap:X"].map({ts[":Y"]: ts["/:C"]})
+        ts[":Insert:X"].map({ts[":Y"]: ts["/:D"]})
+        RegisterRule(ts)
+    rt = TSRuntime(ts)
+    kept = GetMatcher(rt, "/:Rule:_", dict())
+    size = rt.network.network.size()
+    with ScopedMatchers(rt):
+        assert GetMatcher(rt, "/:Rule:_", dict()) is kept
+        GetMatcher(rt, "/:Rule:_", {"/:Rule:MustMap:X": "/:A"})
+        assert rt.network.network.size() > size
+    # Only the Matcher added within the block is released.
+    assert [matcher for key, matcher in MATCHERS.items()
+            if key[0] == id(rt)] == [kept]
+    assert rt.network.network.size() == size
+
+def test_stable_name():
+    """Regression test for stableName (SipHash-2-4-128)."""
+    # The reference test vector for the empty message.
+    assert stableName([], False) == "a3817f04ba25a8e66df67214c7550293"
+    name = stableName(["/:A", "/:B", "/:C"], False)
+    assert name == "5aead656ec1bfe155440fb9a4ef7de70"
+    assert stableName(["/:A", "/:B", "/:C"], True) == "1584734820764150362"
+    # Parts are delimited.
+    assert stableName(["/:A", "/:B/:C"], False) != name
+
+def test_fixedpoint():
+    """Tests the native fixedpoint against applying matches one at a time."""
+    def less_than_pairs(one_at_a_time, batch=False):
+        ts = TripletStructure()
+        with ts.scope(":Transitive"):
+            with ts.scope(":MustMap"):
+                ts[":AB"].map({ts[":A"]: ts["/:Less"], ts[":B"]: ts["/:More"]})
+                ts[":BC"].map({ts[":B"]: ts["/:Less"], ts[":C"]: ts["/:More"]})
+            ts[":NoMap:AC"].map({
+                ts[":MustMap:A"]: ts["/:Less"], ts[":MustMap:C"]: ts["/:More"],
+            })
+            ts[":Insert:AC"].map({
+                ts[":MustMap:A"]: ts["/:Less"], ts[":MustMap:C"]: ts["/:More"],
+            })
+            RegisterRule(ts)
+        for less, more in zip("abcd", "bcde"):
+            ts[":??"].map({ts[":" + less]: ts[":Less"],
+                           ts[":" + more]: ts[":More"]})
+        ts.commit()
+        rt = TSRuntime(ts)
+        if batch:
+            matcher = GetMatcher(rt, "/:Transitive:_", dict())
+            # Distance 2 for (a, c), (b, d) and (c, e) in one batch.
+            assert len(rt.matcher_batch(matcher)[0]) == 3
+            assert RuleFixedpoint(rt, "/:Transitive:_", batch=True)
+        elif one_at_a_time:
+            assert RuleFixedpoint(rt, "/:Transitive:_")
+        else:
+            summary = rt.fixedpoint(["/:Transitive:_"])
+            # Distances 2, then 3 and 4, then nothing new.
+            assert (summary["rounds"], summary["firings"]) == (3, 6)
+            assert len(summary["added_nodes"]) == 6
+            assert len(summary["added_facts"]) == 12
+            assert ts.path[-1] is summary["delta"]
+        return sorted((less, more)
+                      for fact, less, _ in ts.lookup(None, None, "/:Less")
+                      for _, more, _ in ts.lookup(fact, None, "/:More")
+                      if not fact.startswith("/:Transitive"))
+    pairs = less_than_pairs(one_at_a_time=False)
+    assert pairs == less_than_pairs(one_at_a_time=True)
+    assert pairs == less_than_pairs(one_at_a_time=True, batch=True)
+    assert len(pairs) == 10
+
+def test_fixedpoint_after_rollback():
+    """Tests that rolling back node changes updates the native names too."""
+    ts = TripletStructure()
+    with ts.scope(":Transitive"):
+        with ts.scope(":MustMap"):
+            ts[":AB"].map({ts[":A"]: ts["/:Less"], ts[":B"]: ts["/:More"]})
+            ts[":BC"].map({ts[":B"]: ts["/:Less"], ts[":C"]: ts["/:More"]})
+        ts[":NoMap:AC"].map({
+            ts[":MustMap:A"]: ts["/:Less"], ts[":MustMap:C"]: ts["/:More"],
+        })
+        ts[":Insert:AC"].map({
+            ts[":MustMap:A"]: ts["/:Less"], ts[":MustMap:C"]: ts["/:More"],
+        })
+        RegisterRule(ts)
+    for less, more in zip("abc", "bcd"):
+        ts[":??"].map({ts[":" + less]: ts[":Less"],
+                       ts[":" + more]: ts[":More"]})
+    ts.commit()
+    rt = TSRuntime(ts)
+    def assert_names_current():
+        names = rt.solver.names
+        assert set(node for node, i in rt.solver.dictionary.items()
+                   if names.isPresent(i)) == set(ts.nodes)
+
+    # Nodes inserted by a rolled-back run are free to be inserted again.
+    first = rt.fixedpoint(["/:Transitive:_"])
+    ts.rollback(-1)
+    assert_names_current()
+    again = rt.fixedpoint(["/:Transitive:_"])
+    assert sorted(again["added_nodes"]) == sorted(first["added_nodes"])
+
+    # A node whose removal is rolled back is live again, so the next node
+    # inserted for the same match gets another name.
+    node = next(node for node in again["added_nodes"]
+                if ("/:a" in ts.lookup(node, None, "/:Less")[0]
+                    and "/:c" in ts.lookup(node, None, "/:More")[0]))
+    ts[node].remove_with_facts()
+    ts.commit()
+    ts.rollback(-1)
+    assert ts.has_node(node)
+    assert_names_current()
+    ts.remove_facts(ts.facts_about_node(node))
+    ts.commit()
+    final = rt.fixedpoint(["/:Transitive:_"])
+    assert len(final["added_nodes"]) == 1 and node not in final["added_nodes"]
+    assert_names_current()
+
+def test_propose_all():
+    """Tests that concurrent proposals match sequential ones, in order."""
+    ts = TripletStructure()
+    for name in ("Less", "More"):
+        with ts.scope(":Mirror" + name):
+            with ts.scope(":MustMap"):
+                ts[":AB"].map({ts[":A"]: ts["/:" + name]})
+            ts[":NoMap:BA"].map({ts[":MustMap:A"]: ts["/:Mirrored"]})
+            ts[":Insert:BA"].map({ts[":MustMap:A"]: ts["/:Mirrored"]})
+            RegisterRule(ts)
+    for less, more in zip("abcd", "bcde"):
+        ts[":??"].map({ts[":" + less]: ts[":Less"],
+                       ts[":" + more]: ts[":More"]})
+    ts.commit()
+    rt = TSRuntime(ts)
+    rules = ["/:MirrorMore:_", "/:MirrorLess:_"]
+    def proposals(proposer):
+        return [(sorted(assignment.items()), sorted(delta.add_facts))
+                for assignment, delta in proposer]
+    sequential = [proposal for rule in rules
+                  for proposal in proposals(rt.propose(rule))]
+    assert len(sequential) == 8
+    for n_threads in (0, 1, 3):
+        assert proposals(rt.propose_all(rules, n_threads)) == sequential
+    # By default, no rule is solved ahead of its proposals.
+    rt.solver.match_all = None
+    assert proposals(rt.propose_all(rules)) == sequential
+
+def test_activation_index():
+    """Tests that deltas only activate rules whose constants they touch."""
+    ts = TripletStructure()
+    with ts.scope(":Symmetric"):
+        with ts.scope(":MustMap"):
+            ts[":AB"].map({ts[":A"]: ts["/:Near"], ts[":B"]: ts["/:Near"]})
+        ts[":Insert:BA"].map({ts[":MustMap:B"]: ts["/:Near"]})
+        RegisterRule(ts)
+    ts[":x"].map({ts[":y"]: ts[":Near"]})
+    ts.commit()
+    rt = TSRuntime(ts)
+    rule = rt.rules_by_name["/:Symmetric:_"]
+    assert rt.activation.index[(2,)][("/:Near",)] == {rule}
+
+    ts[":x"].map({ts[":y"]: ts[":Far"]})
+    assert rule not in rt.activation.affected(ts.commit())
+    ts[":z"].map({ts[":y"]: ts[":Near"]})
+    assert rule in rt.activation.affected(ts.commit())
+
+def test_match_network():
+    """Tests that readers share join nodes and follow the structure."""
+    ts = TripletStructure()
+    for a, b in ("xy", "yz", "zx"):
+        ts[":" + a].map({ts[":" + b]: ts[":R"]})
+    ts_cpp = CPPStructure(ts)
+    network = CPPMatchNetwork(ts_cpp)
+
+    edge = Pattern(None, [(0, 1, "/:R")], None, None)
+    # Variables 0 and 2 may be the same node, so cycles are paths too.
+    path_constraints = [(1, 2, "/:R"), (0, 1, "/:R")]
+    maybe_equal = {0: {0, 2}, 1: {1}, 2: {0, 2}}
+    path = Pattern(None, path_constraints, maybe_equal, None)
+    edges = network.reader(edge, dict())
+    paths = network.reader(path, dict())
+    from_x = network.reader(path, {0: "/:x"})
+    # @edges and @paths share their first join node, while @from_x starts
+    # with the constraint on /:x.
+    assert network.network.size() == 4
+    assert len(network.assignments(edges)) == 3
+    assert network.assignments(paths) == set(
+        freezedict(assignment) for assignment
+        in ts_cpp.assignments(path_constraints, path.maybe_equal))
+    assert network.assignments(from_x) == {
+        freezedict({0: "/:x", 1: "/:y", 2: "/:z"})}
+
+    ts[":z"].map({ts[":y"]: ts[":R"]})
+    assert network.read(paths) == (set(), {
+        freezedict({0: "/:z", 1: "/:y", 2: "/:z"}),
+        freezedict({0: "/:y", 1: "/:z", 2: "/:y"})})
+    assert network.read(from_x) == (set(), set())
+    ts.remove_fact(("/:x", "/:y", "/:R"))
+    removed, added = network.read(paths)
+    assert len(removed) == 2 and not added
+    assert network.read(from_x) == (
+        {freezedict({0: "/:x", 1: "/:y", 2: "/:z"})}, set())
+
+    # Releasing @from_x drops the join nodes only it used.
+    network.release(from_x)
+    assert network.network.size() == 2
+    # Networks on the same structure each get every change, even once
+    # another one is gone.
+    other = CPPMatchNetwork(ts_cpp)
+    other_edges = other.reader(edge, dict())
+    del other
+    ts[":x"].map({ts[":z"]: ts[":R"]})
+    assert network.read(edges) == (
+        set(), {freezedict({0: "/:x", 1: "/:z"})})
+    another = CPPMatchNetwork(ts_cpp)
+    another_edges = another.reader(edge, dict())
+    ts.remove_fact(("/:x", "/:z", "/:R"))
+    assert another.read(another_edges) == network.read(edges) == (
+        {freezedict({0: "/:x", 1: "/:z"})}, set())
+    assert other_edges == another_edges == 0
+
 main(__name__, __file__)
@@ -0,0 +1,124 @@
+"""Tests for importer.py"""
+import os
+import sys
+import tempfile
+from external.bazel_python.pytest_helper import main
+from ts_lib import TripletStructure
+from runtime.tests.fixtures import AddMarkB
+from runtime.runtime import TSRuntime
+from runtime.importer import ImportFacts
+from runtime.memory import MemoryUsage
+from tactic_utils import RuleFixedpoint
+
+def _index(ts, key):
+    """The facts under @key in ts.facts, sorted."""
+    if isinstance(key, str):
+        return sorted(ts.facts_about_node(key))
+    return sorted(ts.lookup(*key))
+
+def _write(directory, name, lines):
+    """Writes @lines to a file in @directory and returns its path."""
+    path = os.path.join(directory, name)
+    with open(path, "w") as out:
+        out.write("\n".join(lines) + "\n")
+    return path
+
+def test_import_tsv():
+    """Tests that importing facts is the same as adding them in Python."""
+    with tempfile.TemporaryDirectory() as directory:
+        path = _write(directory, "facts.tsv", ["# A comment."] + [
+            "/:Fact{}\t/:Node{}\t/:A".format(i, i % 10) for i in range(30)])
+        ts = TripletStructure()
+        assert ImportFacts(ts, path, n_threads=4) == 30
+    eager = TripletStructure()
+    for i in range(30):
+        eager["/:Fact{}".format(i)].map({
+            eager["/:Node{}".format(i % 10)]: eager["/:A"]})
+    eager.commit()
+    assert ts.is_clean()
+    assert list(ts.nodes) == list(eager.nodes)
+    assert ts.display_names == eager.display_names
+
+    keys = [(None, None, None), (None, "/:Node3", None),
+            ("/:Fact4", None, None), (None, None, "/:A"),
+            ("/:Fact4", "/:Node4", "/:A"), ("/:Fact4", "/:Node5", "/:A"),
+            ("/:Missing", None, None), "/:Node3", "/:A", "/:Missing"]
+    for key in keys:
+        assert _index(ts, key) == _index(eager, key)
+
+    # Changes are made on top of the keys as imported.
+    for structure in (ts, eager):
+        structure["/:Fact0"].map({structure["/:Node9"]: structure["/:B"]})
+        structure.remove_fact(("/:Fact1", "/:Node1", "/:A"))
+    for key in keys + [(None, None, "/:B"), "/:Node9", "/:Fact1"]:
+        assert _index(ts, key) == _index(eager, key)
+    ts.rollback(0)
+    eager.rollback(0)
+    for key in keys:
+        assert _index(ts, key) == _index(eager, key)
+
+    # Rules run on imported facts as on any others.
+    for structure in (ts, eager):
+        AddMarkB(structure, 0)
+    imported, added = TSRuntime(ts), TSRuntime(eager)
+    RuleFixedpoint(imported, "/:MarkB:_")
+    RuleFixedpoint(added, "/:MarkB:_")
+    assert len(ts.lookup(None, None, "/:B")) == 10
+    assert _index(ts, (None, None, None)) == _index(eager, (None, None, None))
+
+def test_runtime_takes_over_import():
+    """Tests that TSRuntime uses the imported Structure without reloading it."""
+    with tempfile.TemporaryDirectory() as directory:
+        path = _write(directory, "facts.tsv", [
+            "/:Fact{}\t/:Node{}\t/:A".format(i, i % 10) for i in range(30)])
+        untouched, ts = TripletStructure(), TripletStructure()
+        ImportFacts(untouched, path)
+        ImportFacts(ts, path)
+
+    rt = TSRuntime(untouched)
+    assert rt.solver.names is untouched.facts.names
+    assert rt.solver.cpp.size() == 30
+    assert (None, None, None) not in untouched.facts
+    # Facts not loaded into Python are still counted.
+    usage = MemoryUsage(rt)["python.facts"]
+    assert usage >= 30 * sys.getsizeof((None, None, None))
+
+    # Changes made before the runtime exists are replayed on the import.
+    ts["/:Fact0"].map({ts["/:Node9"]: ts["/:B"]})
+    ts.remove_fact(("/:Fact1", "/:Node1", "/:A"))
+    ts.commit()
+    ts["/:Fact2"].map({ts["/:Node9"]: ts["/:B"]})
+    ts.rollback(0)
+    AddMarkB(ts, 0)
+    rt = TSRuntime(ts)
+    assert rt.solver.names is ts.facts.names
+    assert "/:Node3" not in ts.facts
+    assert rt.solver.cpp.size() == 30
+    RuleFixedpoint(rt, "/:MarkB:_")
+    assert len(ts.lookup(None, None, "/:B")) == 10
+    assert not ts.lookup("/:Fact1", None, None)
+    assert rt.solver.cpp.size() == len(ts.lookup(None, None, None)) == 39
+
+def test_import_ntriples():
+    """Tests node names of N-Triples terms and malformed files."""
+    with tempfile.TemporaryDirectory() as directory:
+        path = _write(directory, "facts.nt", [
+            "<http://a> <http://p> \"x\"@en .",
+            "_:b0 <http://p> <http://a>.",
+        ])
+        ts = TripletStructure()
+        assert ImportFacts(ts, path, fmt="ntriples", prefix="/:") == 2
+        assert list(ts.nodes) == ["/:http://a", "/:http://p", "/:\"x\"@en",
+                                  "/:_:b0"]
+        assert ts.lookup(None, None, "/:http://a") == [
+            ("/:_:b0", "/:http://p", "/:http://a")]
+
+        path = _write(directory, "bad.tsv", ["/:A\t/:B\t/:C", "/:A\t/:B"])
+        failed = False
+        try:
+            ImportFacts(TripletStructure(), path)
+        except RuntimeError as error:
+            failed = "bad.tsv:2:" in str(error)
+        assert failed
+
+main(__name__, __file__)
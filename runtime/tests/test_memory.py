@@ -0,0 +1,48 @@
+"""Tests for memory.py"""
+from external.bazel_python.pytest_helper import main
+from ts_lib import TripletStructure
+from runtime.tests.fixtures import AddMarkB
+from runtime.runtime import TSRuntime
+from runtime.memory import MemoryUsage, NativeShapes, Summary
+from tactic_utils import RuleFixedpoint, MATCHERS
+
+def test_memory_usage():
+    """Tests that every part of a runtime is accounted for."""
+    ts = TripletStructure()
+    AddMarkB(ts, 50)
+    rt = TSRuntime(ts)
+    before = MemoryUsage(rt, MATCHERS.values())
+    assert before["python.matcher_assignments"] == 0
+    assert before["python.matcher_reverse_indexes"] == 0
+
+    RuleFixedpoint(rt, "/:MarkB:_")
+    usage = MemoryUsage(rt, MATCHERS.values())
+    assert set(usage) == set(before)
+    assert all(bytes_ >= 0 for bytes_ in usage.values())
+    for part in ("python.facts", "python.nodes", "python.dictionary",
+                 "python.patterns", "python.matcher_assignments",
+                 "native.structure", "native.network"):
+        assert usage[part] > 0, part
+    assert usage["python.facts"] > before["python.facts"]
+    assert usage["native.structure"] > before["native.structure"]
+
+    # Every built shape indexes every fact exactly once.
+    n_facts = len(rt.ts.lookup(None, None, None))
+    shapes = NativeShapes(rt)
+    assert shapes
+    for shape in shapes.values():
+        assert shape["facts"] == n_facts
+        assert shape["keys"] == (shape["inline_buckets"]
+                                 + shape["flat_buckets"]
+                                 + shape["hub_buckets"])
+    # The 100 /:A and /:B facts are under two hub keys of shape (0, 0, C).
+    assert shapes["100"]["hub_buckets"] == 2
+    assert shapes["100"]["hub_bytes"] > 0
+
+    lines = Summary(usage).splitlines()
+    assert lines[0].split() == ["Part", "MiB"]
+    assert lines[1].split()[0] == max(usage, key=lambda part: usage[part])
+    assert lines[-1].split()[0] == "total"
+    assert len(lines) == len(usage) + 2
+
+main(__name__, __file__)
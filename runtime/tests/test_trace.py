@@ -0,0 +1,84 @@
+"""Tests for trace.py"""
+import json
+import os
+import tempfile
+from external.bazel_python.pytest_helper import main
+from ts_lib import TripletStructure
+from runtime.tests.fixtures import AddMarkB
+from runtime.runtime import TSRuntime
+from runtime.trace import Tracer, span, traced
+from tactic_utils import RuleFixedpoint
+
+@traced()
+def _Tactic(rt):
+    """Marks every /:A node as a /:B node."""
+    with span("MarkAll", rule="/:MarkB:_"):
+        RuleFixedpoint(rt, "/:MarkB:_")
+        RuleFixedpoint(rt, "/:MarkB:_", one_at_a_time=False)
+
+def _Runtime():
+    """Returns a runtime with some /:A nodes and a rule marking them."""
+    ts = TripletStructure()
+    AddMarkB(ts, 5)
+    return TSRuntime(ts)
+
+def test_tracer():
+    """Tests nesting of Python and native spans."""
+    rt = _Runtime()
+    with Tracer() as tracer:
+        _Tactic(rt)
+    assert len(rt.ts.lookup(None, None, "/:B")) == 5
+
+    names = set(event[0] for event in tracer.events)
+    assert {"_Tactic", "MarkAll", "RuleFixedpoint", "Matcher.sync",
+            "Assignment.apply", "TripletStructure.commit",
+            "RuleTemplate::Apply", "Fixedpoint::Run"} <= names
+    # Nothing is recorded once the Tracer stops.
+    n_events = len(tracer.events)
+    _Tactic(_Runtime())
+    assert len(tracer.events) == n_events
+
+    stacks = set(stack for stack, _ in tracer.stacks())
+    assert ("_Tactic",) in stacks
+    assert ("_Tactic", "MarkAll", "RuleFixedpoint", "Assignment.apply",
+            "RuleTemplate::Apply") in stacks
+    assert ("_Tactic", "MarkAll", "RuleFixedpoint", "Fixedpoint::Run",
+            "Fixedpoint::Round") in stacks
+    # Self times add up to the time of the outermost span.
+    total = sum(self_time for _, self_time in tracer.stacks())
+    outermost = next(event[3] for event in tracer.events
+                     if event[0] == "_Tactic")
+    assert abs(total - outermost) < 1.0
+
+    folded = tracer.folded()
+    assert "_Tactic;MarkAll;RuleFixedpoint;Fixedpoint::Run " in folded
+    summary = tracer.summary()
+    assert summary.splitlines()[0].split() == [
+        "Span", "Calls", "Total", "(ms)", "Self", "(ms)"]
+    assert "RuleFixedpoint" in summary
+
+    with tempfile.TemporaryDirectory() as directory:
+        path = os.path.join(directory, "trace.json")
+        tracer.write_chrome_trace(path)
+        with open(path, "r") as trace_file:
+            events = json.load(trace_file)["traceEvents"]
+    assert len(events) == n_events
+    mark_all = next(event for event in events if event["name"] == "MarkAll")
+    assert mark_all["ph"] == "X" and mark_all["cat"] == "python"
+    assert mark_all["args"] == dict({"rule": "/:MarkB:_"})
+    run = next(event for event in events
+               if event["name"] == "Fixedpoint::Run")
+    assert run["cat"] == "native" and run["tid"] == mark_all["tid"]
+    assert (mark_all["ts"] <= run["ts"]
+            and run["ts"] + run["dur"] <= mark_all["ts"] + mark_all["dur"])
+
+def test_disabled():
+    """Tests that spans are no-ops when no Tracer is running."""
+    with span("Unused", rule="/:MarkB:_") as unused:
+        assert unused is not None
+    assert _Tactic.__name__ == "_Tactic"
+    with Tracer() as tracer:
+        pass
+    assert not tracer.events
+
+main(__name__, __file__)
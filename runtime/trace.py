@@ -0,0 +1,249 @@
+"""Opt-in tracing of where the time goes in a run.
+
+A span is a named interval of wall-clock time on one thread; spans nest. The
+runtime marks its main phases as spans (rule fixedpoints, Matcher syncs,
+CPPPattern planning, applying Assignments and committing or rolling back
+TSDeltas), and while a Tracer is running the C++ engine records its own spans
+(Solver search, MatchNetwork syncs, native fixedpoints, ...) on the same clock,
+including on the threads of CPPStructure.match_all. Tactics can add their own
+with @traced or `with span(...)`. Typical usage:
+
+    with Tracer() as tracer:
+        SolveLetterAnalogy(rt)
+    tracer.write_chrome_trace("trace.json")
+    tracer.write_folded("trace.folded")
+    print(tracer.summary())
+
+The Chrome trace can be opened in chrome://tracing or https://ui.perfetto.dev,
+and the folded stacks fed to flamegraph.pl or https://www.speedscope.app.
+Setting the TS_TRACE environment variable to a path traces the whole process
+and writes the Chrome trace there when it exits.
+
+When no Tracer is running, span(...) and @traced functions cost about one
+extra Python call, and native spans a relaxed atomic load.
+"""
+import atexit
+from collections import defaultdict
+import functools
+import json
+import os
+import threading
+# pylint: disable=no-name-in-module
+from ts_cpp import enableTrace, takeTrace, traceNow, traceThread
+from ts_lib import TripletStructure, TSDelta
+
+# The running Tracer, if any.
+_TRACER = None
+
+class _NullSpan:
+    """Stands in for a span when no Tracer is running."""
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type_, value, traceback):
+        return False
+
+_NULL_SPAN = _NullSpan()
+
+class _Span:
+    """A span being recorded to @tracer, see span(...)."""
+    __slots__ = ("tracer", "name", "args", "start")
+
+    def __init__(self, tracer, name, args):
+        self.tracer = tracer
+        self.name = name
+        self.args = args
+        self.start = None
+
+    def __enter__(self):
+        self.start = traceNow()
+        return self
+
+    def __exit__(self, type_, value, traceback):
+        self.tracer.record(self.name, self.start, traceNow() - self.start,
+                           self.args)
+        return False
+
+def span(name, **args):
+    """Returns a context manager recording its body as a span.
+
+    @args are shown with the span in the Chrome trace, eg. the rule being
+    applied. They should be JSON-serializable.
+    """
+    if _TRACER is None:
+        return _NULL_SPAN
+    return _Span(_TRACER, name, args or None)
+
+def traced(name=None):
+    """Decorator recording each call of a function as a span.
+
+    The span is called @name, or the function's qualified name by default.
+    For generators, this only covers creating the generator.
+    """
+    def decorator(function):
+        label = name or function.__qualname__
+        @functools.wraps(function)
+        def wrapper(*args, **kwargs):
+            if _TRACER is None:
+                return function(*args, **kwargs)
+            with _Span(_TRACER, label, None):
+                return function(*args, **kwargs)
+        return wrapper
+    return decorator
+
+# ts_lib.py does not depend on the runtime, so its phases are wrapped here.
+for _class, _methods in ((TripletStructure, ("commit", "rollback")),
+                         (TSDelta, ("apply", "rollback"))):
+    for _method in _methods:
+        setattr(_class, _method, traced()(getattr(_class, _method)))
+
+class Tracer:
+    """Records the spans of every thread while it is running.
+
+    Only one Tracer may run at a time. Times are in microseconds.
+    """
+    def __init__(self):
+        """Initializes a Tracer with no events."""
+        # (name, thread, start, duration, args, native) tuples.
+        self.events = []
+        self.threads = threading.local()
+
+    def start(self):
+        """Starts recording spans."""
+        global _TRACER # pylint: disable=global-statement
+        assert _TRACER is None, "Another Tracer is already running."
+        # Drop any native events left over from an earlier Tracer.
+        takeTrace()
+        _TRACER = self
+        enableTrace(True)
+
+    def stop(self):
+        """Stops recording spans and collects those of the C++ engine."""
+        global _TRACER # pylint: disable=global-statement
+        assert _TRACER is self
+        enableTrace(False)
+        _TRACER = None
+        self.events.extend(
+            (event.name, event.thread, event.start, event.duration, None, True)
+            for event in takeTrace())
+
+    def __enter__(self):
+        self.start()
+        return self
+
+    def __exit__(self, type_, value, traceback):
+        self.stop()
+        return False
+
+    def record(self, name, start, duration, args=None):
+        """Records a span of the calling thread."""
+        try:
+            thread = self.threads.id
+        except AttributeError:
+            # Native spans are recorded under the same IDs.
+            thread = self.threads.id = traceThread()
+        self.events.append((name, thread, start, duration, args, False))
+
+    def chrome_trace(self):
+        """Returns the spans in Chrome's Trace Event Format, as a dict."""
+        pid = os.getpid()
+        trace_events = []
+        for name, thread, start, duration, args, native in self.events:
+            event = dict({
+                "name": name,
+                "cat": "native" if native else "python",
+                "ph": "X",
+                "ts": start,
+                "dur": duration,
+                "pid": pid,
+                "tid": thread,
+            })
+            if args:
+                event["args"] = dict({key: str(value)
+                                      for key, value in args.items()})
+            trace_events.append(event)
+        return dict({"traceEvents": trace_events, "displayTimeUnit": "ms"})
+
+    def write_chrome_trace(self, path):
+        """Writes chrome_trace() to @path as JSON."""
+        with open(path, "w") as out:
+            json.dump(self.chrome_trace(), out)
+
+    def stacks(self):
+        """Yields (stack, self_time) for every span.
+
+        The stack is a tuple of span names from the outermost span of its
+        thread, and self_time excludes the time spent in nested spans.
+        """
+        by_thread = defaultdict(list)
+        for name, thread, start, duration, _, _ in self.events:
+            by_thread[thread].append((start, -duration, name))
+        for events in by_thread.values():
+            # Parents before children which start at the same time.
+            events.sort()
+            # [name, end, self_time] of the enclosing spans.
+            open_spans = []
+            def pop():
+                name, _, self_time = open_spans.pop()
+                return (tuple(span[0] for span in open_spans) + (name,),
+                        self_time)
+            for start, negative_duration, name in events:
+                while open_spans and open_spans[-1][1] <= start:
+                    yield pop()
+                if open_spans:
+                    open_spans[-1][2] += negative_duration
+                open_spans.append([name, start - negative_duration,
+                                   -negative_duration])
+            while open_spans:
+                yield pop()
+
+    def folded(self):
+        """Returns the spans as folded stacks, for flame graphs.
+
+        Each line is a ;-separated stack followed by its total self time in
+        (integer) microseconds, as read by flamegraph.pl.
+        """
+        totals = defaultdict(float)
+        for stack, self_time in self.stacks():
+            totals[stack] += self_time
+        return "".join("{} {}\n".format(";".join(stack), round(total))
+                       for stack, total in sorted(totals.items()))
+
+    def write_folded(self, path):
+        """Writes folded() to @path."""
+        with open(path, "w") as out:
+            out.write(self.folded())
+
+    def summary(self, limit=25):
+        """Returns a table of the @limit span names with the most self time.
+
+        Total time includes nested spans, so it double-counts recursive ones.
+        """
+        counts, totals, self_times = \
+            defaultdict(int), defaultdict(float), defaultdict(float)
+        for name, _, _, duration, _, _ in self.events:
+            counts[name] += 1
+            totals[name] += duration
+        for stack, self_time in self.stacks():
+            self_times[stack[-1]] += self_time
+        names = sorted(counts, key=lambda name: -self_times[name])[:limit]
+        width = max([len(name) for name in names] + [4])
+        lines = ["{:<{}} {:>9} {:>12} {:>12}".format(
+            "Span", width, "Calls", "Total (ms)", "Self (ms)")]
+        for name in names:
+            lines.append("{:<{}} {:>9} {:>12.2f} {:>12.2f}".format(
+                name, width, counts[name], totals[name] / 1000.,
+                self_times[name] / 1000.))
+        return "\n".join(lines)
+
+def _TraceProcess(path):
+    """Traces the rest of the process, writing the Chrome trace to @path."""
+    tracer = Tracer()
+    tracer.start()
+    def finish():
+        tracer.stop()
+        tracer.write_chrome_trace(path)
+    atexit.register(finish)
+
+if os.environ.get("TS_TRACE"):
+    _TraceProcess(os.environ["TS_TRACE"])
@@ -3,7 +3,10 @@
 Matthew considers this to be written "in the DSL," although it's somewhat on
 the border.
 """
+from contextlib import contextmanager
+import runtime.checkpoint as checkpoint
 from runtime.matcher import Matcher, OneOffMatcher
+from runtime.trace import span
 
 def SearchRules(rt, search_term):
     """Returns all rules with @search_term in their name.
@@ -47,22 +50,84 @@ def GetMatcher(rt, rule, partial, one_off=False):
         MATCHERS[key] = Matcher(rt, rule, partial)
     return MATCHERS[key]
 
-def RuleFixedpoint(rt, rule, partial=None):
+def ReleaseMatchers(rt, keep=()):
+    """Drops the MATCHERS of @rt not in @keep, releasing their network readers.
+
+    Used when a tactic is done with its rules, so their join nodes no longer
+    take memory or sync time.
+    """
+    for key in [key for key in MATCHERS
+                if key[0] == id(rt) and key not in keep]:
+        MATCHERS.pop(key).release()
+
+@contextmanager
+def ScopedMatchers(rt):
+    """Releases the MATCHERS of @rt added within the block when it exits.
+
+    Used by tactics whose partials hold nodes of a single run (eg. the map
+    nodes of an analogy). Each distinct partial has its own Matcher, so
+    otherwise they would all be kept, and synced, as long as @rt is.
+    """
+    keep = set(MATCHERS)
+    try:
+        yield
+    finally:
+        ReleaseMatchers(rt, keep)
+
+def SaveCheckpoint(rt, directory):
+    """Saves @rt and its MATCHERS to @directory, see runtime/checkpoint.py.
+
+    Should be called between tactics, when the structure is clean.
+    """
+    matchers = dict({(rule.name, partial): matcher
+                     for (rt_id, rule, partial), matcher in MATCHERS.items()
+                     if rt_id == id(rt)})
+    checkpoint.Save(rt, directory, matchers)
+
+def RestoreCheckpoint(directory):
+    """Returns the runtime saved by SaveCheckpoint to @directory.
+
+    Its Matchers are registered in MATCHERS, so RuleFixedpoint carries on
+    from where they were when it was saved.
+    """
+    rt, matchers = checkpoint.Restore(directory)
+    for (rule, partial), matcher in matchers.items():
+        MATCHERS[(id(rt), rt.rules_by_name[rule], partial)] = matcher
+    return rt
+
+def RuleFixedpoint(rt, rule, partial=None, one_at_a_time=True, batch=False):
     """Given a rule, applies it repeatedly until fixedpoint is reached.
+
+    If not @one_at_a_time, the rule is run natively with semi-naive evaluation
+    instead of re-syncing after every firing; see TSRuntime.fixedpoint. If
+    @batch, each sync is followed by applying every non-interfering match at
+    once; see TSRuntime.matcher_batch. This is meant for confluent rules (eg.
+    successor marking), whose firings touch disjoint facts.
     """
-    matcher = GetMatcher(rt, rule, partial or dict({}))
+    with span("RuleFixedpoint", rule=rule):
+        if not one_at_a_time:
+            return rt.fixedpoint([rule], partial)["firings"] > 0
+        matcher = GetMatcher(rt, rule, partial or dict({}))
 
-    did_anything = False
-    while True:
-        matcher.sync()
-        # NOTE: for correctness, rt.matcher_propose assumes you only ever use
-        # exactly one of the things it yields.
-        try:
-            _ = next(rt.matcher_propose(matcher))
-        except StopIteration:
-            break
-        did_anything = True
-    return did_anything
+        if batch:
+            did_anything = False
+            while True:
+                matcher.sync()
+                if rt.matcher_batch(matcher)[1] is None:
+                    return did_anything
+                did_anything = True
+
+        did_anything = False
+        while True:
+            matcher.sync()
+            # NOTE: for correctness, rt.matcher_propose assumes you only ever
+            # use exactly one of the things it yields.
+            try:
+                _ = next(rt.matcher_propose(matcher))
+            except StopIteration:
+                break
+            did_anything = True
+        return did_anything
 
 def RuleAny(rt, rule, partial, one_off=True):
     """True iff @rule has any matches extending @partial in the structure."""
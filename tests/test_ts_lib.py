@@ -195,6 +195,43 @@ def test_remove_node_with_facts():
     for node_name in node_names:
         run_for_node(ts, node_name)
 
+def test_node_order():
+    """Tests that ts.nodes keeps nodes in the order they were added."""
+    ts = TripletStructure()
+    ts[":A, :B, :C, :D"]
+    ts[":B"].remove()
+    ts.remove_node("/:Missing")
+    assert list(ts.nodes) == ["/:A", "/:C", "/:D"]
+    assert not ts.has_node("/:B")
+    ts[":B"]
+    assert list(ts.nodes) == ["/:A", "/:C", "/:D", "/:B"]
+    assert list(ts.nodes) == list(ts.display_names)
+    ts.rollback()
+    assert not ts.nodes
+
+    # Nodes can be removed while iterating over a scope.
+    for node in ts.scope(":Scope")[":X, :Y, :Z"]:
+        node.display_name(str(node))
+    for node in ts.scope(":Scope"):
+        node.remove()
+    assert not ts.nodes
+
+def test_remove_nodes_with_facts():
+    """Tests removing several nodes and their facts at once."""
+    ts = TripletStructure()
+    ts[":A"].map({ts[":B"]: ts[":C"], ts[":C"]: ts[":D"]})
+    ts[":D"].map({ts[":D"]: ts[":E"]})
+    ts.commit()
+    ts.remove_nodes_with_facts(["/:C", "/:E", "/:Missing"])
+    assert ts.lookup(None, None, None) == []
+    assert ts.facts_about_node("/:A") == []
+    assert not ts.has_node("/:C") and not ts.has_node("/:E")
+    assert ts.buffer.remove_facts == set({
+        ("/:A", "/:B", "/:C"), ("/:A", "/:C", "/:D"), ("/:D", "/:D", "/:E")})
+    ts.rollback()
+    assert len(ts.lookup(None, None, None)) == 3
+    assert len(ts.lookup("/:A", None, None)) == 2
+
 def test_fact_invariants():
     """Tests that some desired invariants always hold."""
     ts = TripletStructure()
@@ -0,0 +1,441 @@
+// Micro-benchmarks for Structure and Solver, without the Python bindings.
+//
+// Usage: structure_benchmark [--filter=SUBSTRING] [--repetitions=N]
+//                            [--scale=X] [--seed=N] [--list]
+//
+// Every case builds a synthetic structure (untimed), then times a single
+// operation over it, eg. adding every fact or enumerating every solution to
+// a pattern. Each case is run --repetitions times, each time on a freshly
+// built structure, and sizes are multiplied by --scale. The results are
+// printed to stdout as a single JSON object:
+//
+//   {"context": {...},
+//    "benchmarks": [{"name": "lookup/shape=011", "params": {...},
+//                    "repetitions": 5, "ops": 100000,
+//                    "seconds": {"min": ..., "median": ..., "max": ...},
+//                    "ns_per_op": ...}, ...]}
+//
+// where ns_per_op is computed from the median.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ts_lib.h"
+
+namespace {
+
+typedef std::mt19937 Random;
+
+// Measures the timed part of a case, which each case marks with Start and
+// Stop around its setup.
+class Timer {
+ public:
+  void Start() { start_ = std::chrono::steady_clock::now(); }
+  void Stop() {
+    seconds_ = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start_).count();
+  }
+  double seconds() const { return seconds_; }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+  double seconds_ = 0.0;
+};
+
+struct Case {
+  std::string name;
+  std::vector<std::pair<std::string, size_t>> params;
+  // Runs the case once, returning the number of operations timed.
+  std::function<size_t(Random *, Timer *)> run;
+};
+
+// Synthetic structures. Nodes 1..n_labels are used as labels (the middle
+// slot of facts) and the following n_nodes nodes as vertices, so the facts
+// form a labelled graph over the vertices.
+struct Graph {
+  size_t n_labels;
+  size_t n_nodes;
+  std::vector<Triplet> facts;
+
+  Node Label(size_t i) const { return Node(1 + i); }
+  Node Vertex(size_t i) const { return Node(1 + n_labels + i); }
+};
+
+// @n_nodes vertices, each with @degree out-edges to uniformly random
+// vertices under uniformly random labels.
+Graph RandomGraph(size_t n_nodes, size_t degree, size_t n_labels,
+                  Random *random) {
+  Graph graph{n_labels, n_nodes, {}};
+  std::set<Triplet> seen;
+  for (size_t from = 0; from < n_nodes; from++) {
+    for (size_t i = 0; i < degree; i++) {
+      Triplet fact(graph.Vertex(from), graph.Label((*random)() % n_labels),
+                   graph.Vertex((*random)() % n_nodes));
+      if (seen.insert(fact).second) {
+        graph.facts.push_back(fact);
+      }
+    }
+  }
+  std::shuffle(graph.facts.begin(), graph.facts.end(), *random);
+  return graph;
+}
+
+// A single hub vertex with an edge to each of @n_nodes vertices, all under
+// one label, so (hub, label, 0) and (0, label, 0) are hub keys.
+Graph StarGraph(size_t n_nodes, Random *random) {
+  Graph graph{1, n_nodes + 1, {}};
+  for (size_t i = 1; i <= n_nodes; i++) {
+    graph.facts.emplace_back(graph.Vertex(0), graph.Label(0), graph.Vertex(i));
+  }
+  std::shuffle(graph.facts.begin(), graph.facts.end(), *random);
+  return graph;
+}
+
+Structure Build(const Graph &graph) {
+  Structure structure;
+  for (const Triplet &fact : graph.facts) {
+    structure.AddFact(fact);
+  }
+  return structure;
+}
+
+std::string ShapeName(uint8_t shape) {
+  std::string name;
+  for (uint8_t j = 0; j < 3; j++) {
+    name += ((shape >> j) & 0b1) ? '1' : '0';
+  }
+  return name;
+}
+
+// Enumerates every solution to @constraints (over @n_variables variables,
+// all required to be distinct) and returns how many there were.
+size_t SolveAll(const Structure &structure, size_t n_variables,
+                const std::vector<Triplet> &constraints) {
+  std::vector<std::set<size_t>> maybe_equal(n_variables);
+  for (size_t i = 0; i < n_variables; i++) {
+    maybe_equal[i].insert(i);
+  }
+  Solver solver(structure, n_variables, constraints, maybe_equal);
+  size_t n_solutions = 0;
+  while (solver.IsValid()) {
+    if (solver.NextAssignment().empty()) {
+      break;
+    }
+    n_solutions++;
+  }
+  return n_solutions;
+}
+
+std::vector<Case> Cases(double scale) {
+  auto scaled = [scale](size_t n) {
+    return std::max(size_t(1), size_t(n * scale));
+  };
+  std::vector<Case> cases;
+
+  for (size_t materialized : {0, 1}) {
+    size_t n_nodes = scaled(20000), degree = 5, n_labels = 50;
+    cases.push_back({
+      "insert/bulk",
+      {{"nodes", n_nodes}, {"degree", degree}, {"labels", n_labels},
+       {"materialized", materialized}},
+      [=](Random *random, Timer *timer) {
+        Graph graph = RandomGraph(n_nodes, degree, n_labels, random);
+        Structure structure;
+        if (materialized) {
+          structure.MaterializeShapes(0xFF);
+        }
+        timer->Start();
+        for (const Triplet &fact : graph.facts) {
+          structure.AddFact(fact);
+        }
+        timer->Stop();
+        return graph.facts.size();
+      }});
+  }
+
+  {
+    size_t n_nodes = scaled(20000), degree = 5, n_labels = 50;
+    cases.push_back({
+      "insert/batch",
+      {{"nodes", n_nodes}, {"degree", degree}, {"labels", n_labels}},
+      [=](Random *random, Timer *timer) {
+        Graph graph = RandomGraph(n_nodes, degree, n_labels, random);
+        std::vector<Node> flat;
+        for (const Triplet &fact : graph.facts) {
+          flat.insert(flat.end(), fact.begin(), fact.end());
+        }
+        Structure structure;
+        timer->Start();
+        structure.AddFacts(flat);
+        timer->Stop();
+        return graph.facts.size();
+      }});
+  }
+
+  {
+    size_t n_nodes = scaled(50000);
+    cases.push_back({
+      "remove/hub",
+      {{"nodes", n_nodes}},
+      [=](Random *random, Timer *timer) {
+        Graph graph = StarGraph(n_nodes, random);
+        Structure structure = Build(graph);
+        // Removals have to update every built shape, so build the ones
+        // holding the hub keys.
+        structure.MaterializeShapes(0xFF);
+        std::shuffle(graph.facts.begin(), graph.facts.end(), *random);
+        timer->Start();
+        for (const Triplet &fact : graph.facts) {
+          structure.RemoveFact(fact);
+        }
+        timer->Stop();
+        return graph.facts.size();
+      }});
+  }
+
+  for (uint8_t shape = 0; shape < 8; shape++) {
+    size_t n_nodes = scaled(20000), degree = 5, n_labels = 50;
+    // Fewer lookups of the keys with large buckets: (0, 0, 0) holds every
+    // fact and (0, label, 0) about nodes * degree / labels.
+    size_t n_lookups = scaled(shape == 0b000 ? 10 :
+                              shape == 0b010 ? 1000 : 100000);
+    cases.push_back({
+      "lookup/shape=" + ShapeName(shape),
+      {{"nodes", n_nodes}, {"degree", degree}, {"labels", n_labels},
+       {"lookups", n_lookups}},
+      [=](Random *random, Timer *timer) {
+        Graph graph = RandomGraph(n_nodes, degree, n_labels, random);
+        Structure structure = Build(graph);
+        structure.MaterializeShapes(1 << shape);
+        // Keys of existing facts with the holes of @shape.
+        std::vector<Triplet> keys;
+        for (size_t i = 0; i < n_lookups; i++) {
+          Triplet key = graph.facts[(*random)() % graph.facts.size()];
+          for (uint8_t j = 0; j < 3; j++) {
+            if (!((shape >> j) & 0b1)) {
+              key[j] = 0;
+            }
+          }
+          keys.push_back(key);
+        }
+        size_t checksum = 0;
+        timer->Start();
+        for (const Triplet &key : keys) {
+          for (const Triplet &fact : structure.Lookup(key)) {
+            checksum += fact[0];
+          }
+        }
+        timer->Stop();
+        // Keeps the loop from being optimized out.
+        if (checksum == 0) {
+          std::fprintf(stderr, "empty lookups\n");
+        }
+        return keys.size();
+      }});
+  }
+
+  {
+    size_t n_nodes = scaled(20000), degree = 5, n_labels = 50;
+    cases.push_back({
+      "open/mapped",
+      {{"nodes", n_nodes}, {"degree", degree}, {"labels", n_labels}},
+      [=](Random *random, Timer *timer) {
+        Graph graph = RandomGraph(n_nodes, degree, n_labels, random);
+        const char *directory = std::getenv("TMPDIR");
+        std::string path = std::string(directory ? directory : "/tmp") +
+                           "/structure_benchmark.bin";
+        Build(graph).Save(path, nullptr);
+        // Opening maps the file, then the first lookup of each label pages
+        // in its range.
+        size_t checksum = 0;
+        timer->Start();
+        Structure structure = Structure::Open(path, nullptr);
+        for (size_t i = 0; i < n_labels; i++) {
+          checksum += structure.Lookup(Triplet(0, graph.Label(i), 0)).size();
+        }
+        timer->Stop();
+        std::remove(path.c_str());
+        if (checksum != graph.facts.size()) {
+          std::fprintf(stderr, "wrong mapped lookups\n");
+        }
+        return n_labels;
+      }});
+  }
+
+  {
+    size_t n_nodes = scaled(20000), degree = 5, n_labels = 50;
+    size_t n_checks = scaled(200000);
+    cases.push_back({
+      "is_true/half_misses",
+      {{"nodes", n_nodes}, {"degree", degree}, {"labels", n_labels},
+       {"checks", n_checks}},
+      [=](Random *random, Timer *timer) {
+        Graph graph = RandomGraph(n_nodes, degree, n_labels, random);
+        Structure structure = Build(graph);
+        std::vector<Node> flat;
+        for (size_t i = 0; i < n_checks; i++) {
+          Triplet fact = graph.facts[(*random)() % graph.facts.size()];
+          if (i % 2) {
+            fact[1] = graph.Label((*random)() % n_labels);
+          }
+          flat.insert(flat.end(), fact.begin(), fact.end());
+        }
+        timer->Start();
+        std::vector<bool> results = structure.IsTrueMany(flat);
+        timer->Stop();
+        return results.size();
+      }});
+  }
+
+  // Solver enumeration. Patterns use a single label, so with @degree
+  // out-edges per vertex and @n_labels labels each vertex has about
+  // degree / n_labels matching out-edges. Chains and cycles are kept small
+  // since Solver::GetOptions also looks up the constraints of a variable
+  // whose other variables are still unassigned, which here means scanning
+  // the whole (0, label, 0) bucket for every partial assignment.
+  struct Pattern {
+    std::string name;
+    size_t length;
+    size_t n_nodes, degree;
+  };
+  for (const Pattern &pattern : std::vector<Pattern>{
+           {"chain", 3, 500, 8}, {"chain", 5, 200, 8},
+           {"star", 3, 20000, 8}, {"star", 5, 1000, 12},
+           {"cycle", 3, 1000, 16}, {"cycle", 4, 500, 16}}) {
+    size_t n_nodes = scaled(pattern.n_nodes), degree = pattern.degree;
+    size_t n_labels = 2;
+    cases.push_back({
+      "solve/" + pattern.name,
+      {{"length", pattern.length}, {"nodes", n_nodes}, {"degree", degree},
+       {"labels", n_labels}},
+      [=](Random *random, Timer *timer) {
+        Graph graph = RandomGraph(n_nodes, degree, n_labels, random);
+        Structure structure = Build(graph);
+        Node label = graph.Label(0);
+        // Variable i is -i. A chain is x0 -> x1 -> ... -> x_length, a star
+        // is x0 -> x_i for each i in [1, length] and a cycle is a chain
+        // with x_length = x0.
+        std::vector<Triplet> constraints;
+        size_t n_variables = pattern.length + 1;
+        for (size_t i = 0; i < pattern.length; i++) {
+          Node from = pattern.name == "star" ? 0 : -Node(i);
+          Node to = -Node(i + 1);
+          if (pattern.name == "cycle" && i + 1 == pattern.length) {
+            to = 0;
+          }
+          constraints.emplace_back(from, label, to);
+        }
+        if (pattern.name == "cycle") {
+          n_variables = pattern.length;
+        }
+        // Builds the shapes the solver looks up, so the timing only covers
+        // the search itself.
+        structure.MaterializeShapes(0xFF);
+        timer->Start();
+        size_t n_solutions = SolveAll(structure, n_variables, constraints);
+        timer->Stop();
+        return n_solutions;
+      }});
+  }
+
+  return cases;
+}
+
+// Formats @params as a JSON object.
+std::string ParamsJson(
+    const std::vector<std::pair<std::string, size_t>> &params) {
+  std::string json = "{";
+  for (size_t i = 0; i < params.size(); i++) {
+    json += (i ? ", \"" : "\"") + params[i].first + "\": " +
+            std::to_string(params[i].second);
+  }
+  return json + "}";
+}
+
+// Returns the value of --@flag=VALUE in @arg, or nullptr if it is not that
+// flag.
+const char *FlagValue(const char *arg, const char *flag) {
+  size_t length = std::strlen(flag);
+  if (std::strncmp(arg, "--", 2) != 0 ||
+      std::strncmp(arg + 2, flag, length) != 0 || arg[2 + length] != '=') {
+    return nullptr;
+  }
+  return arg + 3 + length;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string filter;
+  size_t repetitions = 5;
+  double scale = 1.0;
+  unsigned seed = 1;
+  bool list = false;
+  for (int i = 1; i < argc; i++) {
+    const char *value = nullptr;
+    if ((value = FlagValue(argv[i], "filter"))) {
+      filter = value;
+    } else if ((value = FlagValue(argv[i], "repetitions"))) {
+      repetitions = std::max(1, std::atoi(value));
+    } else if ((value = FlagValue(argv[i], "scale"))) {
+      scale = std::atof(value);
+    } else if ((value = FlagValue(argv[i], "seed"))) {
+      seed = unsigned(std::atoi(value));
+    } else if (std::strcmp(argv[i], "--list") == 0) {
+      list = true;
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--filter=SUBSTRING] [--repetitions=N] "
+                   "[--scale=X] [--seed=N] [--list]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  std::vector<Case> cases;
+  for (const Case &c : Cases(scale)) {
+    std::string full_name = c.name + " " + ParamsJson(c.params);
+    if (full_name.find(filter) != std::string::npos) {
+      cases.push_back(c);
+    }
+  }
+  if (list) {
+    for (const Case &c : cases) {
+      std::printf("%s %s\n", c.name.c_str(), ParamsJson(c.params).c_str());
+    }
+    return 0;
+  }
+
+  std::printf("{\"context\": {\"repetitions\": %zu, \"scale\": %g, "
+              "\"seed\": %u},\n \"benchmarks\": [", repetitions, scale, seed);
+  for (size_t i = 0; i < cases.size(); i++) {
+    const Case &c = cases[i];
+    Random random(seed);
+    std::vector<double> seconds;
+    size_t ops = 0;
+    for (size_t r = 0; r < repetitions; r++) {
+      Timer timer;
+      ops = c.run(&random, &timer);
+      seconds.push_back(timer.seconds());
+    }
+    std::sort(seconds.begin(), seconds.end());
+    double median = seconds[seconds.size() / 2];
+    std::printf("%s\n  {\"name\": \"%s\", \"params\": %s, "
+                "\"repetitions\": %zu, \"ops\": %zu, "
+                "\"seconds\": {\"min\": %.9f, \"median\": %.9f, "
+                "\"max\": %.9f}, \"ns_per_op\": %.3f}",
+                i ? "," : "", c.name.c_str(), ParamsJson(c.params).c_str(),
+                repetitions, ops, seconds.front(), median, seconds.back(),
+                ops ? 1e9 * median / ops : 0.0);
+    std::fflush(stdout);
+  }
+  std::printf("]}\n");
+  return 0;
+}
@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include "ts_lib.h"
+
+Bucket::Bucket(const Bucket &other)
+    : size_(other.size_), capacity_(kInlineFacts) {
+  if (other.IsHub()) {
+    capacity_ = kHubCapacity;
+    hub_ = new PostingList(*other.hub_);
+    return;
+  }
+  if (!other.IsInline()) {
+    capacity_ = other.capacity_;
+    heap_ = new Node[3 * capacity_];
+  }
+  std::copy(other.data(), other.data() + (3 * size_), data());
+}
+
+Bucket::Bucket(Bucket &&other) noexcept
+    : size_(other.size_), capacity_(other.capacity_) {
+  if (other.IsInline()) {
+    std::copy(other.inline_, other.inline_ + (3 * size_), inline_);
+  } else if (other.IsHub()) {
+    hub_ = other.hub_;
+  } else {
+    heap_ = other.heap_;
+  }
+  other.size_ = 0;
+  other.capacity_ = kInlineFacts;
+}
+
+Bucket &Bucket::operator=(Bucket other) noexcept {
+  this->~Bucket();
+  new (this) Bucket(std::move(other));
+  return *this;
+}
+
+Bucket::~Bucket() {
+  if (IsHub()) {
+    delete hub_;
+  } else if (!IsInline()) {
+    delete[] heap_;
+  }
+}
+
+Bucket::Iterator Bucket::begin() const {
+  return IsHub() ? Iterator(hub_->begin()) : Iterator(data());
+}
+
+Bucket::Iterator Bucket::end() const {
+  return IsHub() ? Iterator(hub_->end()) : Iterator(data() + (3 * size_));
+}
+
+void Bucket::Add(const Triplet &fact, uint8_t shape) {
+  if (IsHub()) {
+    hub_->Add(fact);
+    size_++;
+    return;
+  }
+  if (size_ == capacity_) {
+    Reallocate(2 * capacity_);
+  }
+  std::copy(fact.begin(), fact.end(), data() + (3 * size_));
+  size_++;
+  if (size_ > kHubThreshold) {
+    ToHub(shape);
+  }
+}
+
+bool Bucket::Remove(const Triplet &fact) {
+  if (IsHub()) {
+    if (!hub_->Remove(fact)) {
+      return false;
+    }
+    size_--;
+    // Leave some slack so a key hovering around the threshold doesn't get
+    // re-encoded on every change.
+    if (size_ <= kHubThreshold / 2) {
+      ToFlat();
+    }
+    return true;
+  }
+  Node *nodes = data();
+  for (uint32_t i = 0; i < size_; i++) {
+    Node *at = nodes + (3 * i);
+    if (at[0] != fact[0] || at[1] != fact[1] || at[2] != fact[2]) {
+      continue;
+    }
+    // Shift the rest down so iteration order stays insertion order.
+    std::memmove(at, at + 3, sizeof(Node) * 3 * (size_ - i - 1));
+    size_--;
+    // Hub keys are often emptied out again (eg. by rollbacks), so go back to
+    // inline storage once the facts fit.
+    if (!IsInline() && size_ <= kInlineFacts) {
+      Reallocate(kInlineFacts);
+    }
+    return true;
+  }
+  return false;
+}
+
+void Bucket::Reallocate(uint32_t capacity) {
+  assert(capacity >= size_);
+  Node *old_data = data();
+  bool was_inline = IsInline();
+  if (capacity == kInlineFacts) {
+    Node *old_heap = heap_;
+    std::copy(old_heap, old_heap + (3 * size_), inline_);
+    delete[] old_heap;
+  } else {
+    Node *new_heap = new Node[3 * capacity];
+    std::copy(old_data, old_data + (3 * size_), new_heap);
+    if (!was_inline) {
+      delete[] old_data;
+    }
+    heap_ = new_heap;
+  }
+  capacity_ = capacity;
+}
+
+void Bucket::ToHub(uint8_t shape) {
+  assert(!IsInline() && size_ > 0);
+  std::vector<Triplet> facts(begin(), end());
+  // Adding in order lets PostingList append without re-encoding.
+  std::sort(facts.begin(), facts.end());
+  PostingList *hub = new PostingList(facts.front(), shape);
+  for (const Triplet &fact : facts) {
+    hub->Add(fact);
+  }
+  delete[] heap_;
+  hub_ = hub;
+  capacity_ = kHubCapacity;
+}
+
+void Bucket::ToFlat() {
+  assert(IsHub() && size_ > kInlineFacts);
+  PostingList *old_hub = hub_;
+  uint32_t capacity = kInlineFacts;
+  while (capacity < size_) {
+    capacity *= 2;
+  }
+  Node *heap = new Node[3 * capacity];
+  Node *at = heap;
+  for (auto it = old_hub->begin(); !(it == old_hub->end()); it.Next()) {
+    at = std::copy(it.fact().begin(), it.fact().end(), at);
+  }
+  delete old_hub;
+  heap_ = heap;
+  capacity_ = capacity;
+}
+
+size_t Bucket::HeapBytes() const {
+  if (IsHub()) {
+    return sizeof(PostingList) + hub_->HeapBytes();
+  }
+  return IsInline() ? 0 : sizeof(Node) * 3 * capacity_;
+}
@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+#include "ts_lib.h"
+
+namespace {
+
+void Append(const Triplet &fact, std::vector<Node> *flat) {
+  flat->insert(flat->end(), fact.begin(), fact.end());
+}
+
+}  // namespace
+
+std::vector<RuleFacts> ExtractRules(const Structure &structure,
+                                    Node rule_type) {
+  TraceSpan span("ExtractRules");
+  // Map nodes by rule.
+  std::map<Node, std::set<Node>> rules;
+  for (const Triplet &fact : structure.Lookup(Triplet(0, 0, rule_type))) {
+    rules[fact[1]].insert(fact[0]);
+  }
+
+  std::vector<RuleFacts> extracted;
+  extracted.reserve(rules.size());
+  std::vector<Triplet> facts;
+  for (const auto &rule : rules) {
+    RuleFacts rule_facts;
+    rule_facts.rule = rule.first;
+    std::set<Node> nodes{rule.first};
+    std::vector<Triplet> maps;
+    for (const Node map : rule.second) {
+      nodes.insert(map);
+      for (const Triplet &fact : structure.Lookup(Triplet(map, 0, 0))) {
+        // As the pattern [(0, rule, /RULE), (0, 1, 2)] would match them.
+        if (fact[1] != map && fact[2] != map && fact[1] != fact[2]) {
+          maps.push_back(fact);
+          nodes.insert(fact[1]);
+        }
+      }
+    }
+    std::sort(maps.begin(), maps.end());
+    for (const Triplet &fact : maps) {
+      Append(fact, &rule_facts.maps);
+    }
+
+    facts.clear();
+    for (const Node node : nodes) {
+      FactRange about = structure.Lookup(Triplet(node, 0, 0));
+      facts.insert(facts.end(), about.begin(), about.end());
+    }
+    // Facts under different keys (i, 0, 0) are disjoint.
+    std::sort(facts.begin(), facts.end());
+    rule_facts.facts.reserve(3 * facts.size());
+    for (const Triplet &fact : facts) {
+      Append(fact, &rule_facts.facts);
+    }
+    extracted.push_back(std::move(rule_facts));
+  }
+  return extracted;
+}
@@ -0,0 +1,506 @@
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "ts_lib.h"
+
+CompiledRule::CompiledRule(
+    const size_t n_variables,
+    const std::vector<Triplet> &must,
+    const std::vector<Triplet> &try_constraints,
+    const std::vector<std::vector<Triplet>> &nevers,
+    const std::vector<std::set<size_t>> &maybe_equal,
+    const RuleTemplate &action,
+    const std::vector<std::pair<std::string, size_t>> &named_variables,
+    const std::vector<std::pair<std::string, size_t>> &inserts,
+    const std::vector<size_t> &remove_variables,
+    const std::vector<size_t> &subtract_variables)
+    : n_variables_(n_variables), must_(must), try_(try_constraints),
+      nevers_(nevers), maybe_equal_(maybe_equal), action_(action),
+      named_variables_(named_variables), inserts_(inserts),
+      remove_variables_(remove_variables),
+      subtract_variables_(subtract_variables),
+      is_must_(n_variables, false) {
+  assert(maybe_equal_.size() == n_variables_);
+  for (const Triplet &constraint : must_) {
+    for (const Node &node : constraint) {
+      if (node <= 0) {
+        is_must_.at(-node) = true;
+      }
+    }
+  }
+}
+
+// Fills in the assigned variables of @constraint.
+static Triplet Substitute(const Triplet &constraint,
+                          const std::vector<Node> &assignment) {
+  Triplet filled(constraint);
+  for (size_t i = 0; i < 3; i++) {
+    if (filled[i] <= 0 && assignment[-filled[i]] != Node(0)) {
+      filled[i] = assignment[-filled[i]];
+    }
+  }
+  return filled;
+}
+
+// Calls @callback with every extension of @partial satisfying @constraints,
+// as in runtime/pattern.py:Pattern.assignments, until it returns false.
+// Variables are searched in the order chosen by
+// runtime/cpp_structure.py:CPPPattern.
+template <typename Callback>
+static void Solve(const Structure &structure, const NodeNames &names,
+                  const std::vector<Triplet> &constraints,
+                  const std::vector<std::set<size_t>> &maybe_equal,
+                  const std::vector<Node> &partial, Callback callback) {
+  if (constraints.empty()) {
+    callback(partial);
+    return;
+  }
+  std::vector<Triplet> working;
+  std::vector<size_t> n_fixed, colons;
+  size_t n_free = 0;
+  std::vector<bool> is_free(partial.size(), false);
+  for (const Triplet &constraint : constraints) {
+    working.push_back(Substitute(constraint, partial));
+    n_fixed.push_back(0);
+    colons.push_back(0);
+    for (const Node &node : working.back()) {
+      if (node > 0) {
+        n_fixed.back()++;
+        colons.back() += names.Colons(node);
+      } else if (!is_free[-node]) {
+        is_free[-node] = true;
+        n_free++;
+      }
+    }
+  }
+  if (n_free == 0) {
+    if (structure.AllTrue(working) && ValidMaybeEquals(maybe_equal, partial)) {
+      callback(partial);
+    }
+    return;
+  }
+
+  // order[k] is the rule variable searched for k-th.
+  std::vector<size_t> order;
+  std::vector<bool> ordered(partial.size(), false);
+  while (order.size() < n_free) {
+    auto key = [&](size_t i) {
+      return std::make_tuple(n_fixed[i] != 3, n_fixed[i], colons[i]);
+    };
+    size_t best = 0;
+    for (size_t i = 1; i < working.size(); i++) {
+      if (key(i) > key(best)) {
+        best = i;
+      }
+    }
+    size_t variable = 0;
+    for (const Node &node : working[best]) {
+      if (node <= 0 && !ordered[-node]) {
+        variable = -node;
+        break;
+      }
+    }
+    order.push_back(variable);
+    ordered[variable] = true;
+    for (size_t i = 0; i < working.size(); i++) {
+      if (std::count(working[i].begin(), working[i].end(), -Node(variable))) {
+        n_fixed[i]++;
+      }
+    }
+  }
+
+  std::vector<size_t> index_of(partial.size(), 0);
+  for (size_t k = 0; k < order.size(); k++) {
+    index_of[order[k]] = k;
+  }
+  for (Triplet &constraint : working) {
+    for (Node &node : constraint) {
+      if (node <= 0) {
+        node = -Node(index_of[-node]);
+      }
+    }
+  }
+  std::vector<std::set<size_t>> solver_maybe_equal(order.size());
+  for (size_t k = 0; k < order.size(); k++) {
+    for (size_t other : maybe_equal[order[k]]) {
+      if (is_free[other]) {
+        solver_maybe_equal[k].insert(index_of[other]);
+      }
+    }
+  }
+
+  Solver solver(structure, order.size(), working, solver_maybe_equal);
+  std::vector<Node> full(partial);
+  while (solver.IsValid()) {
+    std::vector<Node> assignment = solver.NextAssignment();
+    if (assignment.empty()) {
+      return;
+    }
+    for (size_t k = 0; k < order.size(); k++) {
+      full[order[k]] = assignment[k];
+    }
+    if (ValidMaybeEquals(maybe_equal, full) && !callback(full)) {
+      return;
+    }
+  }
+}
+
+// As in runtime/matcher.py:PatternMatcher.unify, returns false if @fact can
+// not satisfy @constraint under @assignment, otherwise fills in @assignment.
+static bool Unify(const Triplet &constraint, const Triplet &fact,
+                  std::vector<Node> *assignment) {
+  for (size_t i = 0; i < 3; i++) {
+    Node node = constraint[i];
+    if (node > 0) {
+      if (node != fact[i]) {
+        return false;
+      }
+    } else if ((*assignment)[-node] == Node(0)) {
+      (*assignment)[-node] = fact[i];
+    } else if ((*assignment)[-node] != fact[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<Node> CompiledRule::Matches(
+    const Structure &structure, const NodeNames &names,
+    const std::vector<Node> &partial) const {
+  std::vector<Node> flat;
+  Solve(structure, names, must_, maybe_equal_, partial,
+        [&](const std::vector<Node> &must) {
+    for (const std::vector<Triplet> &never : nevers_) {
+      bool any = false;
+      Solve(structure, names, never, maybe_equal_, must,
+            [&](const std::vector<Node> &) {
+              any = true;
+              return false;
+            });
+      if (any) {
+        return true;
+      }
+    }
+    size_t before = flat.size();
+    Solve(structure, names, try_, maybe_equal_, must,
+          [&](const std::vector<Node> &assignment) {
+            flat.insert(flat.end(), assignment.begin(), assignment.end());
+            return true;
+          });
+    // With no try constraints, the must assignment was just added.
+    if (flat.size() == before) {
+      flat.insert(flat.end(), must.begin(), must.end());
+    }
+    return true;
+  });
+  return flat;
+}
+
+uint8_t CompiledRule::Shapes() const {
+  uint8_t shapes = 0;
+  auto add = [&](const Triplet &constraint) {
+    uint8_t constants = 0;
+    for (uint8_t j = 0; j < 3; j++) {
+      if (constraint[j] > 0) {
+        constants |= (1 << j);
+      }
+    }
+    // Variables may or may not be assigned at lookup time, but the variable
+    // being solved for never is.
+    for (uint8_t shape = 0; shape < 7; shape++) {
+      if ((shape & constants) == constants) {
+        shapes |= (1 << shape);
+      }
+    }
+  };
+  std::for_each(must_.begin(), must_.end(), add);
+  std::for_each(try_.begin(), try_.end(), add);
+  for (const std::vector<Triplet> &never : nevers_) {
+    std::for_each(never.begin(), never.end(), add);
+  }
+  return shapes;
+}
+
+std::vector<std::vector<Node>> MatchAll(
+    const Structure &structure, const NodeNames &names,
+    const std::vector<const CompiledRule *> &rules,
+    const std::vector<std::vector<Node>> &partials, size_t n_threads) {
+  TraceSpan span("MatchAll");
+  assert(rules.size() == partials.size());
+  uint8_t shapes = 0;
+  for (const CompiledRule *rule : rules) {
+    shapes |= rule->Shapes();
+  }
+  structure.MaterializeShapes(shapes);
+
+  std::vector<std::vector<Node>> matches(rules.size());
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t i = next++; i < rules.size(); i = next++) {
+      TraceSpan span("CompiledRule::Matches");
+      matches[i] = rules[i]->Matches(structure, names, partials[i]);
+    }
+  };
+  if (n_threads == 0) {
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  n_threads = std::min(n_threads, rules.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n_threads; i++) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return matches;
+}
+
+Fixedpoint::Fixedpoint(Structure *structure, NodeNames *names,
+                       bool compact_names)
+    : structure_(structure), names_(names), compact_names_(compact_names) { }
+
+void Fixedpoint::Run(const std::vector<const CompiledRule *> &rules,
+                     const std::vector<std::vector<Node>> &partials) {
+  TraceSpan span("Fixedpoint::Run");
+  assert(rules.size() == partials.size());
+  bool full = true;
+  std::vector<Triplet> added;
+  while (true) {
+    TraceSpan round("Fixedpoint::Round");
+    std::vector<Matches> matches(rules.size());
+    for (size_t i = 0; i < rules.size(); i++) {
+      if (full) {
+        Solve(*structure_, *names_, rules[i]->must_, rules[i]->maybe_equal_,
+              partials[i], [&](const std::vector<Node> &must) {
+                matches[i].insert(must);
+                return true;
+              });
+      } else {
+        Join(*rules[i], partials[i], added, &matches[i]);
+      }
+    }
+
+    rounds_++;
+    size_t firings = firings_;
+    round_added_.clear();
+    round_removed_ = false;
+    for (size_t i = 0; i < rules.size(); i++) {
+      for (const std::vector<Node> &must : matches[i]) {
+        FireAll(*rules[i], must);
+      }
+    }
+    if (firings_ == firings) {
+      return;
+    }
+    full = round_removed_;
+    added.clear();
+    for (const Triplet &fact : round_added_) {
+      if (structure_->IsTrue(fact)) {
+        added.push_back(fact);
+      }
+    }
+  }
+}
+
+void Fixedpoint::Join(const CompiledRule &rule,
+                      const std::vector<Node> &partial,
+                      const std::vector<Triplet> &added,
+                      Matches *matches) const {
+  auto insert = [&](const std::vector<Node> &must) {
+    matches->insert(must);
+    return true;
+  };
+  for (const Triplet &fact : added) {
+    for (const Triplet &constraint : rule.must_) {
+      std::vector<Node> unified(partial);
+      if (Unify(constraint, fact, &unified)) {
+        Solve(*structure_, *names_, rule.must_, rule.maybe_equal_, unified,
+              insert);
+      }
+    }
+    // Existing must-assignments can gain try-assignments.
+    for (const Triplet &constraint : rule.try_) {
+      std::vector<Node> unified(partial);
+      if (!Unify(constraint, fact, &unified)) {
+        continue;
+      }
+      for (size_t variable = 0; variable < unified.size(); variable++) {
+        if (!rule.is_must_[variable] && partial[variable] == Node(0)) {
+          unified[variable] = 0;
+        }
+      }
+      Solve(*structure_, *names_, rule.must_, rule.maybe_equal_, unified,
+            insert);
+    }
+  }
+}
+
+bool Fixedpoint::Blocked(const CompiledRule &rule,
+                         const std::vector<Node> &assignment) const {
+  for (const std::vector<Triplet> &never : rule.nevers_) {
+    bool any = false;
+    Solve(*structure_, *names_, never, rule.maybe_equal_, assignment,
+          [&](const std::vector<Node> &) {
+            any = true;
+            return false;
+          });
+    if (any) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Fixedpoint::FireAll(const CompiledRule &rule,
+                         const std::vector<Node> &must) {
+  auto valid = [&]() {
+    for (const Triplet &constraint : rule.must_) {
+      if (!structure_->IsTrue(Substitute(constraint, must))) {
+        return false;
+      }
+    }
+    return !Blocked(rule, must);
+  };
+  if (!valid()) {
+    return;
+  }
+  std::vector<std::vector<Node>> tries;
+  if (!rule.try_.empty()) {
+    Solve(*structure_, *names_, rule.try_, rule.maybe_equal_, must,
+          [&](const std::vector<Node> &assignment) {
+            tries.push_back(assignment);
+            return true;
+          });
+  }
+  if (tries.empty()) {
+    firings_ += Fire(rule, must);
+    return;
+  }
+  for (size_t i = 0; i < tries.size(); i++) {
+    // Earlier firings may have invalidated this one.
+    bool still_true = (i == 0) || valid();
+    for (const Triplet &constraint : rule.try_) {
+      still_true = still_true &&
+                   structure_->IsTrue(Substitute(constraint, tries[i]));
+    }
+    if (still_true) {
+      firings_ += Fire(rule, tries[i]);
+    }
+  }
+}
+
+bool Fixedpoint::Fire(const CompiledRule &rule, std::vector<Node> assignment) {
+  bool changed = false;
+  // See runtime/assignment.py:Assignment.add_nodes.
+  std::vector<std::string> parts;
+  for (const auto &named : rule.named_variables_) {
+    if (assignment[named.second] != Node(0)) {
+      parts.push_back(named.first);
+      parts.push_back(names_->Name(assignment[named.second]));
+    }
+  }
+  for (const auto &insert : rule.inserts_) {
+    if (assignment[insert.second] != Node(0)) {
+      continue;
+    }
+    parts.push_back(insert.first);
+    std::string prefix = "/:" + StableName(parts, compact_names_) + ":";
+    parts.pop_back();
+    // Fill in the "??" as in ts_lib.py:TripletStructure.__getitem__.
+    Node node(0);
+    for (size_t i = 0; ; i++) {
+      std::string name = prefix + std::to_string(i);
+      node = names_->Find(name);
+      if (node == Node(0)) {
+        node = names_->Add(name);
+        names_->SetPresent(node, false);
+      }
+      if (!names_->IsPresent(node)) {
+        break;
+      }
+    }
+    TouchNode(node, true);
+    changed = true;
+    assignment[insert.second] = node;
+  }
+
+  auto delta = rule.action_.Apply(structure_, assignment);
+  for (size_t i = 0; i < delta.first.size(); i += 3) {
+    TouchFact(Triplet(delta.first[i], delta.first[i + 1],
+                      delta.first[i + 2]), true);
+  }
+  for (size_t i = 0; i < delta.second.size(); i += 3) {
+    TouchFact(Triplet(delta.second[i], delta.second[i + 1],
+                      delta.second[i + 2]), false);
+  }
+  changed = changed || !delta.first.empty() || !delta.second.empty();
+
+  // See runtime/assignment.py:Assignment.remove_nodes.
+  for (const auto *variables : {&rule.remove_variables_,
+                                &rule.subtract_variables_}) {
+    for (const size_t variable : *variables) {
+      Node node = assignment[variable];
+      if (node == Node(0) || !names_->IsPresent(node)) {
+        continue;
+      }
+      bool any_facts = false;
+      for (size_t i = 0; i < 3 && !any_facts; i++) {
+        Triplet key(0, 0, 0);
+        key[i] = node;
+        any_facts = !structure_->Lookup(key).empty();
+      }
+      if (!any_facts) {
+        TouchNode(node, false);
+        changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+void Fixedpoint::TouchFact(const Triplet &fact, bool added) {
+  if (facts_before_.emplace(fact, !added).second) {
+    touched_facts_.push_back(fact);
+  }
+  if (added) {
+    round_added_.push_back(fact);
+  } else {
+    round_removed_ = true;
+  }
+}
+
+void Fixedpoint::TouchNode(Node node, bool present) {
+  if (nodes_before_.emplace(node, names_->IsPresent(node)).second) {
+    touched_nodes_.push_back(node);
+  }
+  names_->SetPresent(node, present);
+  if (!present) {
+    round_removed_ = true;
+  }
+}
+
+std::vector<Node> Fixedpoint::NetFacts(bool added) const {
+  std::vector<Node> facts;
+  for (const Triplet &fact : touched_facts_) {
+    bool before = facts_before_.at(fact);
+    if (structure_->IsTrue(fact) == added && before != added) {
+      facts.insert(facts.end(), fact.begin(), fact.end());
+    }
+  }
+  return facts;
+}
+
+std::vector<Node> Fixedpoint::NetNodes(bool added) const {
+  std::vector<Node> nodes;
+  for (const Node &node : touched_nodes_) {
+    if (names_->IsPresent(node) == added && nodes_before_.at(node) != added) {
+      nodes.push_back(node);
+    }
+  }
+  return nodes;
+}
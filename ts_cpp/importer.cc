@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "ts_lib.h"
+
+namespace {
+
+const size_t kChunk = 1 << 24;
+
+size_t ThreadCount(size_t n_threads) {
+  if (n_threads == 0) {
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  return n_threads;
+}
+
+// Runs @work(i) for each thread i < @n_threads, thread 0 being this one.
+template <typename Work>
+void RunThreads(size_t n_threads, const Work &work) {
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n_threads; i++) {
+    threads.emplace_back(work, i);
+  }
+  work(0);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+// [begin, end) of a term's name in the file.
+typedef std::pair<const char *, const char *> Term;
+
+// Splits the TSV line [@begin, @end) into @terms, which is left empty if the
+// line has no fact. Returns false, setting @error, if it is malformed.
+bool ParseTsv(const char *begin, const char *end, std::vector<Term> *terms,
+              std::string *error) {
+  terms->clear();
+  if (begin == end || *begin == '#') {
+    return true;
+  }
+  const char *start = begin;
+  for (const char *c = begin; ; c++) {
+    if (c == end || *c == '\t') {
+      terms->emplace_back(start, c);
+      if (c == end) {
+        break;
+      }
+      start = c + 1;
+    }
+  }
+  if (terms->size() != 3) {
+    *error = "expected 3 tab-separated fields, got " +
+             std::to_string(terms->size());
+    return false;
+  }
+  for (const Term &term : *terms) {
+    if (term.first == term.second) {
+      *error = "empty field";
+      return false;
+    }
+  }
+  return true;
+}
+
+const char *SkipSpace(const char *c, const char *end) {
+  while (c != end && (*c == ' ' || *c == '\t')) {
+    c++;
+  }
+  return c;
+}
+
+// Parses the N-Triples term starting at @c, setting @term to its name (see
+// ImportFacts). Returns the end of the term, or nullptr if it is malformed.
+const char *ParseTerm(const char *c, const char *end, Term *term) {
+  if (*c == '<') {
+    const char *close = std::find(c + 1, end, '>');
+    if (close == end) {
+      return nullptr;
+    }
+    *term = Term(c + 1, close);
+    return close + 1;
+  }
+  if (*c == '_') {
+    if (end - c < 3 || c[1] != ':') {
+      return nullptr;
+    }
+    const char *stop = c + 2;
+    while (stop != end && *stop != ' ' && *stop != '\t') {
+      stop++;
+    }
+    // Labels can not end with a '.', so one there ends the line.
+    while (stop != c + 2 && stop[-1] == '.') {
+      stop--;
+    }
+    if (stop == c + 2) {
+      return nullptr;
+    }
+    *term = Term(c, stop);
+    return stop;
+  }
+  if (*c == '"') {
+    const char *d = c + 1;
+    while (d != end && *d != '"') {
+      if (*d == '\\' && ++d == end) {
+        return nullptr;
+      }
+      d++;
+    }
+    if (d == end) {
+      return nullptr;
+    }
+    d++;
+    if (d != end && *d == '@') {
+      const char *tag = ++d;
+      while (d != end && (std::isalnum(static_cast<unsigned char>(*d)) ||
+                          *d == '-')) {
+        d++;
+      }
+      if (d == tag) {
+        return nullptr;
+      }
+    } else if (end - d >= 2 && d[0] == '^' && d[1] == '^') {
+      d += 2;
+      if (d == end || *d != '<') {
+        return nullptr;
+      }
+      d = std::find(d, end, '>');
+      if (d == end) {
+        return nullptr;
+      }
+      d++;
+    }
+    *term = Term(c, d);
+    return d;
+  }
+  return nullptr;
+}
+
+// As ParseTsv, for N-Triples lines.
+bool ParseNTriples(const char *begin, const char *end,
+                   std::vector<Term> *terms, std::string *error) {
+  terms->clear();
+  const char *c = SkipSpace(begin, end);
+  if (c == end || *c == '#') {
+    return true;
+  }
+  for (int i = 0; i < 3; i++) {
+    Term term;
+    c = (c == end) ? nullptr : ParseTerm(c, end, &term);
+    if (c == nullptr) {
+      *error = "malformed term " + std::to_string(i + 1);
+      return false;
+    }
+    terms->push_back(term);
+    c = SkipSpace(c, end);
+  }
+  if (c == end || *c != '.') {
+    *error = "expected '.' after the object";
+    return false;
+  }
+  c = SkipSpace(c + 1, end);
+  if (c != end && *c != '#') {
+    *error = "unexpected text after '.'";
+    return false;
+  }
+  return true;
+}
+
+// A run of whole lines of a chunk, tokenized by one thread. Names are
+// numbered locally in order of first appearance, so that merging the pieces
+// in order numbers them in order of first appearance in the file.
+struct Piece {
+  const char *begin = nullptr;
+  const char *end = nullptr;
+  std::unordered_map<std::string, uint32_t> ids;
+  // The keys of ids by local ID.
+  std::vector<const std::string *> names;
+  // Three local IDs per fact.
+  std::vector<uint32_t> facts;
+  // Lines read, and what is wrong with the next one if it is malformed.
+  size_t lines = 0;
+  std::string error;
+};
+
+void Tokenize(bool ntriples, Piece *piece) {
+  std::vector<Term> terms;
+  std::string name;
+  const char *line = piece->begin;
+  while (line != piece->end) {
+    const char *newline = std::find(line, piece->end, '\n');
+    const char *stop = newline;
+    if (stop != line && stop[-1] == '\r') {
+      stop--;
+    }
+    bool valid = ntriples ? ParseNTriples(line, stop, &terms, &piece->error)
+                          : ParseTsv(line, stop, &terms, &piece->error);
+    if (!valid) {
+      return;
+    }
+    for (const Term &term : terms) {
+      name.assign(term.first, term.second);
+      auto it = piece->ids.find(name);
+      if (it == piece->ids.end()) {
+        it = piece->ids.emplace(name, piece->names.size()).first;
+        piece->names.push_back(&it->first);
+      }
+      piece->facts.push_back(it->second);
+    }
+    piece->lines++;
+    if (newline == piece->end) {
+      break;
+    }
+    line = newline + 1;
+  }
+}
+
+}  // namespace
+
+Structure Structure::Build(const std::vector<Triplet> &facts,
+                           size_t n_threads) {
+  TraceSpan span("Structure::Build");
+  n_threads = std::min(ThreadCount(n_threads), size_t(FactSet::kShards));
+  std::vector<uint8_t> shards(facts.size());
+  RunThreads(n_threads, [&](size_t thread) {
+    size_t begin = (facts.size() * thread) / n_threads;
+    size_t end = (facts.size() * (thread + 1)) / n_threads;
+    for (size_t i = begin; i < end; i++) {
+      shards[i] = FactSet::IndexOf(facts[i]);
+    }
+  });
+
+  Structure structure;
+  FactSet &ground = structure.MutableGround();
+  // Each thread fills the shards i with i % n_threads == thread.
+  RunThreads(n_threads, [&](size_t thread) {
+    for (size_t i = 0; i < facts.size(); i++) {
+      if (shards[i] % n_threads == thread) {
+        ground.MutableShard(facts[i]).insert(facts[i]);
+      }
+    }
+  });
+  return structure;
+}
+
+Structure ImportFacts(const std::string &path, const std::string &format,
+                      const std::string &prefix, NodeNames *names,
+                      size_t n_threads) {
+  TraceSpan span("ImportFacts");
+  bool ntriples = false;
+  if (format == "ntriples") {
+    ntriples = true;
+  } else if (format != "tsv") {
+    throw std::runtime_error("Unknown fact format " + format);
+  }
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Could not open " + path);
+  }
+  n_threads = ThreadCount(n_threads);
+
+  std::vector<Triplet> facts;
+  std::vector<char> buffer;
+  // Bytes of an unfinished line carried over from the last chunk, and the
+  // number of lines before the current chunk.
+  size_t carry = 0, lines = 0;
+  while (true) {
+    buffer.resize(carry + kChunk);
+    in.read(buffer.data() + carry, kChunk);
+    if (in.bad()) {
+      throw std::runtime_error("Could not read " + path);
+    }
+    bool last = in.eof();
+    const char *begin = buffer.data();
+    const char *end = begin + carry + in.gcount();
+    const char *filled = end;
+    if (!last) {
+      // Only whole lines are tokenized; the rest waits for the next chunk.
+      while (end != begin && end[-1] != '\n') {
+        end--;
+      }
+      if (end == begin) {
+        carry = filled - begin;
+        continue;
+      }
+    }
+
+    TraceSpan chunk("ImportFacts::Chunk");
+    std::vector<Piece> pieces(std::max<size_t>(1, n_threads));
+    const char *start = begin;
+    for (size_t i = 0; i < pieces.size(); i++) {
+      const char *stop = end;
+      if (i + 1 < pieces.size()) {
+        stop = std::max(start, begin + (((end - begin) * (i + 1))
+                                        / pieces.size()));
+        stop = std::find(stop, end, '\n');
+        if (stop != end) {
+          stop++;
+        }
+      }
+      pieces[i].begin = start;
+      pieces[i].end = stop;
+      start = stop;
+    }
+    RunThreads(pieces.size(), [&](size_t i) {
+      Tokenize(ntriples, &pieces[i]);
+    });
+
+    for (const Piece &piece : pieces) {
+      if (!piece.error.empty()) {
+        throw std::runtime_error(path + ":" +
+                                 std::to_string(lines + piece.lines + 1) +
+                                 ": " + piece.error);
+      }
+      lines += piece.lines;
+      std::vector<Node> nodes(piece.names.size());
+      for (size_t i = 0; i < nodes.size(); i++) {
+        nodes[i] = names->Add(prefix + *piece.names[i]);
+      }
+      for (size_t i = 0; i < piece.facts.size(); i += 3) {
+        facts.emplace_back(nodes[piece.facts[i]], nodes[piece.facts[i + 1]],
+                           nodes[piece.facts[i + 2]]);
+      }
+    }
+    carry = filled - end;
+    std::memmove(buffer.data(), end, carry);
+    if (last) {
+      break;
+    }
+  }
+  return Structure::Build(facts, n_threads);
+}
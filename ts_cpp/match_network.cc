@@ -0,0 +1,530 @@
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "ts_lib.h"
+
+// Fills in the variables of @constraint which are assigned in @assignment.
+static Triplet Fill(const Triplet &constraint,
+                    const std::vector<Node> &assignment) {
+  Triplet filled(constraint);
+  for (Node &node : filled) {
+    if (node <= 0 && size_t(-node) < assignment.size() &&
+        assignment[-node] != Node(0)) {
+      node = assignment[-node];
+    }
+  }
+  return filled;
+}
+
+MatchNetwork::MatchNetwork(Structure *structure) : structure_(structure) {
+  nodes_.push_back(
+      JoinNode{0, Triplet(0, 0, 0), {}, 0, {}, {}, {}, {}, {}, {}});
+  nodes_[0].tuples.insert(Tuple());
+  structure_->AddFeed(&feed_);
+}
+
+MatchNetwork::~MatchNetwork() {
+  structure_->RemoveFeed(&feed_);
+}
+
+size_t MatchNetwork::AddReader(
+    const std::vector<Triplet> &constraints,
+    const std::vector<std::set<size_t>> &maybe_equal,
+    const std::vector<Node> &partial) {
+  Sync();
+  Reader reader{0, {}, maybe_equal, partial, {}, {}, false};
+  std::vector<Triplet> remaining;
+  for (const Triplet &constraint : constraints) {
+    remaining.push_back(Fill(constraint, partial));
+  }
+  // canonical[v] is the canonical variable of pattern variable v, or -1.
+  std::vector<int> canonical(partial.size(), -1);
+  auto maybe_equal_to = [&](size_t a, size_t b) {
+    return maybe_equal[a].count(b) > 0 || maybe_equal[b].count(a) > 0;
+  };
+  size_t node = 0;
+  while (!remaining.empty()) {
+    // Greedily pick the most constrained remaining constraint, like
+    // CPPPattern does, preferring ones joining with the prefix and breaking
+    // ties by the canonical constraint so equal prefixes are ordered the
+    // same way in every pattern.
+    size_t best = 0;
+    std::tuple<size_t, bool, size_t, Triplet> best_key(0, false, 0,
+                                                       Triplet(0, 0, 0));
+    for (size_t i = 0; i < remaining.size(); i++) {
+      size_t n_fixed = 0, n_constants = 0;
+      bool joins = (node == 0);
+      int next = int(nodes_[node].width);
+      std::vector<std::pair<Node, int>> fresh;
+      Triplet rep(remaining[i]);
+      for (Node &arg : rep) {
+        if (arg > 0) {
+          n_fixed++;
+          n_constants++;
+        } else if (canonical[-arg] >= 0) {
+          n_fixed++;
+          joins = true;
+          arg = -canonical[-arg];
+        } else {
+          auto it = std::find_if(
+              fresh.begin(), fresh.end(),
+              [&](const std::pair<Node, int> &f) { return f.first == arg; });
+          if (it == fresh.end()) {
+            fresh.emplace_back(arg, next++);
+            it = fresh.end() - 1;
+          }
+          arg = -it->second;
+        }
+      }
+      // Larger is better, except for the canonical constraint.
+      auto key = std::make_tuple(n_fixed, joins, n_constants, rep);
+      if (i == 0 || std::get<0>(key) > std::get<0>(best_key) ||
+          (std::get<0>(key) == std::get<0>(best_key) &&
+           (std::get<1>(key) > std::get<1>(best_key) ||
+            (std::get<1>(key) == std::get<1>(best_key) &&
+             (std::get<2>(key) > std::get<2>(best_key) ||
+              (std::get<2>(key) == std::get<2>(best_key) &&
+               std::get<3>(key) < std::get<3>(best_key))))))) {
+        best = i;
+        best_key = key;
+      }
+    }
+    size_t width = reader.variables.size();
+    for (const Node &arg : remaining[best]) {
+      if (arg <= 0 && canonical[-arg] < 0) {
+        canonical[-arg] = int(reader.variables.size());
+        reader.variables.push_back(size_t(-arg));
+      }
+    }
+    // New variables may not equal earlier ones, or nodes given by @partial,
+    // unless the pattern allows it.
+    Distinct distinct;
+    for (size_t i = width; i < reader.variables.size(); i++) {
+      size_t variable = reader.variables[i];
+      for (size_t j = 0; j < i; j++) {
+        if (!maybe_equal_to(variable, reader.variables[j])) {
+          distinct.emplace_back(i, -Node(j));
+        }
+      }
+      for (size_t other = 0; other < partial.size(); other++) {
+        if (partial[other] != Node(0) && !maybe_equal_to(variable, other)) {
+          distinct.emplace_back(i, partial[other]);
+        }
+      }
+    }
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()),
+                   distinct.end());
+    node = Child(node, std::get<3>(best_key), distinct);
+    remaining.erase(remaining.begin() + best);
+  }
+  reader.node = node;
+  nodes_[node].readers.push_back(readers_.size());
+  readers_.push_back(std::move(reader));
+  return readers_.size() - 1;
+}
+
+size_t MatchNetwork::Child(size_t parent, const Triplet &constraint,
+                           const Distinct &distinct) {
+  auto it = nodes_[parent].children.find(std::make_pair(constraint, distinct));
+  if (it != nodes_[parent].children.end()) {
+    return it->second;
+  }
+  size_t parent_width = nodes_[parent].width, width = parent_width;
+  std::vector<size_t> join_variables;
+  for (const Node &arg : constraint) {
+    if (arg > 0) {
+      continue;
+    }
+    width = std::max(width, size_t(-arg) + 1);
+    if (size_t(-arg) < parent_width) {
+      join_variables.push_back(size_t(-arg));
+    }
+  }
+  std::sort(join_variables.begin(), join_variables.end());
+  join_variables.erase(
+      std::unique(join_variables.begin(), join_variables.end()),
+      join_variables.end());
+  size_t node = nodes_.size();
+  nodes_.push_back(JoinNode{parent, constraint, distinct, width, {}, {},
+                            join_variables, {}, {}, {}});
+  nodes_[parent].children[std::make_pair(constraint, distinct)] = node;
+
+  uint8_t shape = 0;
+  Triplet key = AlphaKey(constraint, &shape);
+  alphas_[shape][key].push_back(node);
+
+  for (const Tuple &tuple : nodes_[parent].tuples) {
+    nodes_[node].by_join[JoinKey(node, tuple)].insert(&tuple);
+  }
+  for (const Tuple &tuple : nodes_[parent].tuples) {
+    Extend(node, tuple, nullptr);
+  }
+  return node;
+}
+
+Triplet MatchNetwork::AlphaKey(const Triplet &constraint, uint8_t *shape) {
+  Triplet key(constraint);
+  *shape = 0;
+  for (uint8_t j = 0; j < 3; j++) {
+    if (key[j] > 0) {
+      *shape |= (1 << j);
+    } else {
+      key[j] = 0;
+    }
+  }
+  return key;
+}
+
+void MatchNetwork::RemoveReader(size_t reader) {
+  Reader &removed = readers_.at(reader);
+  assert(!removed.released);
+  removed.released = true;
+  std::set<Tuple>().swap(removed.removed);
+  std::set<Tuple>().swap(removed.added);
+  std::vector<size_t> &readers = nodes_[removed.node].readers;
+  readers.erase(std::find(readers.begin(), readers.end(), reader));
+  // Drops the join nodes no reader needs any more, from the reader's up.
+  // Their slots in nodes_ are left empty, so node IDs stay valid.
+  size_t node = removed.node;
+  while (node != 0 && nodes_[node].readers.empty() &&
+         nodes_[node].children.empty()) {
+    JoinNode &join = nodes_[node];
+    nodes_[join.parent].children.erase(
+        std::make_pair(join.constraint, join.distinct));
+    uint8_t shape = 0;
+    Triplet key = AlphaKey(join.constraint, &shape);
+    auto alpha = alphas_[shape].find(key);
+    alpha->second.erase(
+        std::find(alpha->second.begin(), alpha->second.end(), node));
+    if (alpha->second.empty()) {
+      alphas_[shape].erase(alpha);
+    }
+    std::set<Tuple>().swap(join.tuples);
+    decltype(join.by_fact)().swap(join.by_fact);
+    decltype(join.by_join)().swap(join.by_join);
+    released_nodes_++;
+    node = join.parent;
+  }
+}
+
+MatchNetwork::Tuple MatchNetwork::JoinKey(size_t node,
+                                          const Tuple &parent_tuple) const {
+  Tuple key;
+  for (const size_t variable : nodes_[node].join_variables) {
+    key.push_back(parent_tuple[variable]);
+  }
+  return key;
+}
+
+void MatchNetwork::Extend(size_t node, const Tuple &tuple,
+                          const Triplet *fact) {
+  const JoinNode &join = nodes_[node];
+  auto consider = [&](const Triplet &match) {
+    Tuple extended(tuple);
+    extended.resize(join.width, Node(0));
+    for (size_t j = 0; j < 3; j++) {
+      Node arg = join.constraint[j];
+      if (arg > 0) {
+        if (arg != match[j]) {
+          return;
+        }
+      } else if (extended[-arg] == Node(0)) {
+        extended[-arg] = match[j];
+      } else if (extended[-arg] != match[j]) {
+        return;
+      }
+    }
+    for (const auto &pair : join.distinct) {
+      Node other = pair.second > 0 ? pair.second : extended[-pair.second];
+      if (extended[pair.first] == other) {
+        return;
+      }
+    }
+    Insert(node, std::move(extended));
+  };
+  if (fact != nullptr) {
+    consider(*fact);
+    return;
+  }
+  Triplet key = Fill(join.constraint, tuple);
+  for (Node &arg : key) {
+    arg = std::max(arg, Node(0));
+  }
+  for (const Triplet &match : structure_->Lookup(key)) {
+    consider(match);
+  }
+}
+
+void MatchNetwork::Insert(size_t node, Tuple tuple) {
+  JoinNode &join = nodes_[node];
+  auto inserted = join.tuples.insert(std::move(tuple));
+  if (!inserted.second) {
+    return;
+  }
+  const Tuple &added = *inserted.first;
+  join.by_fact[Fill(join.constraint, added)].insert(&added);
+  for (const auto &child : join.children) {
+    nodes_[child.second].by_join[JoinKey(child.second, added)].insert(&added);
+  }
+  Notify(node, added, true);
+  for (const auto &child : join.children) {
+    Extend(child.second, added, nullptr);
+  }
+}
+
+void MatchNetwork::Erase(size_t node, const Tuple &tuple) {
+  JoinNode &join = nodes_[node];
+  auto it = join.tuples.find(tuple);
+  if (it == join.tuples.end()) {
+    return;
+  }
+  // Tuples of the children extending @tuple are contiguous.
+  for (const auto &child : join.children) {
+    const std::set<Tuple> &tuples = nodes_[child.second].tuples;
+    std::vector<Tuple> extensions;
+    for (auto at = tuples.lower_bound(tuple);
+         at != tuples.end() &&
+         std::equal(tuple.begin(), tuple.end(), at->begin());
+         at++) {
+      extensions.push_back(*at);
+    }
+    for (const Tuple &extension : extensions) {
+      Erase(child.second, extension);
+    }
+  }
+  for (const auto &child : join.children) {
+    auto &by_join = nodes_[child.second].by_join;
+    auto users = by_join.find(JoinKey(child.second, *it));
+    users->second.erase(&*it);
+    if (users->second.empty()) {
+      by_join.erase(users);
+    }
+  }
+  auto users = join.by_fact.find(Fill(join.constraint, tuple));
+  users->second.erase(&*it);
+  if (users->second.empty()) {
+    join.by_fact.erase(users);
+  }
+  Tuple erased(*it);
+  join.tuples.erase(it);
+  Notify(node, erased, false);
+}
+
+std::vector<size_t> MatchNetwork::Candidates(const Triplet &fact) const {
+  std::vector<size_t> candidates;
+  for (uint8_t shape = 0; shape < 8; shape++) {
+    if (alphas_[shape].empty()) {
+      continue;
+    }
+    Triplet key(fact);
+    for (uint8_t j = 0; j < 3; j++) {
+      if (!((shape >> j) & 0b1)) {
+        key[j] = 0;
+      }
+    }
+    auto it = alphas_[shape].find(key);
+    if (it != alphas_[shape].end()) {
+      candidates.insert(candidates.end(), it->second.begin(),
+                        it->second.end());
+    }
+  }
+  return candidates;
+}
+
+void MatchNetwork::AddFact(const Triplet &fact) {
+  for (const size_t node : Candidates(fact)) {
+    const JoinNode &join = nodes_[node];
+    // The parent's variables fixed by unifying with @fact.
+    Tuple fixed(nodes_[join.parent].width, Node(0));
+    bool unifies = true;
+    for (size_t j = 0; j < 3; j++) {
+      Node arg = join.constraint[j];
+      if (arg > 0 || size_t(-arg) >= fixed.size()) {
+        continue;
+      }
+      unifies = unifies &&
+                (fixed[-arg] == Node(0) || fixed[-arg] == fact[j]);
+      fixed[-arg] = fact[j];
+    }
+    if (!unifies) {
+      continue;
+    }
+    auto parents = join.by_join.find(JoinKey(node, fixed));
+    if (parents == join.by_join.end()) {
+      continue;
+    }
+    std::vector<const Tuple *> matching(parents->second.begin(),
+                                        parents->second.end());
+    for (const Tuple *tuple : matching) {
+      Extend(node, *tuple, &fact);
+    }
+  }
+}
+
+void MatchNetwork::RemoveFact(const Triplet &fact) {
+  for (const size_t node : Candidates(fact)) {
+    auto users = nodes_[node].by_fact.find(fact);
+    if (users == nodes_[node].by_fact.end()) {
+      continue;
+    }
+    std::vector<Tuple> doomed;
+    for (const Tuple *tuple : users->second) {
+      doomed.push_back(*tuple);
+    }
+    for (const Tuple &tuple : doomed) {
+      Erase(node, tuple);
+    }
+  }
+}
+
+void MatchNetwork::Sync() {
+  TraceSpan span("MatchNetwork::Sync");
+  if (feed_.reset) {
+    feed_.reset = false;
+    feed_.changes.clear();
+    Rebuild();
+    return;
+  }
+  std::vector<std::pair<Triplet, bool>> changes;
+  changes.swap(feed_.changes);
+  for (const auto &change : changes) {
+    if (change.second) {
+      AddFact(change.first);
+    } else {
+      RemoveFact(change.first);
+    }
+  }
+}
+
+void MatchNetwork::Rebuild() {
+  std::vector<std::set<Tuple>> before(nodes_.size());
+  for (size_t node = 1; node < nodes_.size(); node++) {
+    if (!nodes_[node].readers.empty()) {
+      before[node] = nodes_[node].tuples;
+    }
+    nodes_[node].tuples.clear();
+    nodes_[node].by_fact.clear();
+    if (nodes_[node].parent != 0) {
+      nodes_[node].by_join.clear();
+    }
+  }
+  rebuilding_ = true;
+  for (const auto &child : nodes_[0].children) {
+    Extend(child.second, Tuple(), nullptr);
+  }
+  rebuilding_ = false;
+  for (size_t node = 1; node < nodes_.size(); node++) {
+    if (nodes_[node].readers.empty()) {
+      continue;
+    }
+    const std::set<Tuple> &after = nodes_[node].tuples;
+    for (const Tuple &tuple : before[node]) {
+      if (!after.count(tuple)) {
+        Notify(node, tuple, false);
+      }
+    }
+    for (const Tuple &tuple : after) {
+      if (!before[node].count(tuple)) {
+        Notify(node, tuple, true);
+      }
+    }
+  }
+}
+
+bool MatchNetwork::ToAssignment(const Reader &reader, const Tuple &tuple,
+                                Tuple *assignment) const {
+  *assignment = reader.partial;
+  for (size_t i = 0; i < tuple.size(); i++) {
+    (*assignment)[reader.variables[i]] = tuple[i];
+  }
+  return ValidMaybeEquals(reader.maybe_equal, *assignment);
+}
+
+void MatchNetwork::Notify(size_t node, const Tuple &tuple, bool added) {
+  if (rebuilding_) {
+    return;
+  }
+  for (const size_t id : nodes_[node].readers) {
+    Reader &reader = readers_[id];
+    Tuple assignment;
+    if (!ToAssignment(reader, tuple, &assignment)) {
+      continue;
+    }
+    // Changes which cancel out are dropped.
+    std::set<Tuple> &undo = added ? reader.removed : reader.added;
+    std::set<Tuple> &changed = added ? reader.added : reader.removed;
+    if (!undo.erase(assignment)) {
+      changed.insert(std::move(assignment));
+    }
+  }
+}
+
+std::vector<Node> MatchNetwork::Assignments(size_t reader) const {
+  assert(!readers_.at(reader).released);
+  std::vector<Node> flat;
+  Tuple assignment;
+  for (const Tuple &tuple : nodes_[readers_.at(reader).node].tuples) {
+    if (ToAssignment(readers_[reader], tuple, &assignment)) {
+      flat.insert(flat.end(), assignment.begin(), assignment.end());
+    }
+  }
+  return flat;
+}
+
+std::pair<std::vector<Node>, std::vector<Node>> MatchNetwork::Read(
+    size_t reader) {
+  Reader &from = readers_.at(reader);
+  assert(!from.released);
+  std::pair<std::vector<Node>, std::vector<Node>> changes;
+  for (const Tuple &tuple : from.removed) {
+    changes.first.insert(changes.first.end(), tuple.begin(), tuple.end());
+  }
+  for (const Tuple &tuple : from.added) {
+    changes.second.insert(changes.second.end(), tuple.begin(), tuple.end());
+  }
+  from.removed.clear();
+  from.added.clear();
+  return changes;
+}
+
+// Tuples are counted once for @tuples; the indexes only hold pointers.
+size_t MatchNetwork::MemoryUsage() const {
+  size_t bytes = VectorBytes(nodes_) + VectorBytes(readers_) +
+                 VectorBytes(feed_.changes);
+  for (const JoinNode &node : nodes_) {
+    bytes += VectorBytes(node.distinct) + VectorBytes(node.join_variables) +
+             VectorBytes(node.readers) + TreeBytes(node.children) +
+             TreeBytes(node.tuples) +
+             (node.tuples.size() * node.width * sizeof(Node)) +
+             TableBytes(node.by_fact) + TableBytes(node.by_join);
+    for (auto &entry : node.by_fact) {
+      bytes += TableBytes(entry.second);
+    }
+    for (auto &entry : node.by_join) {
+      bytes += VectorBytes(entry.first) + TableBytes(entry.second);
+    }
+  }
+  for (const Reader &reader : readers_) {
+    bytes += VectorBytes(reader.variables) + VectorBytes(reader.partial) +
+             VectorBytes(reader.maybe_equal) + TreeBytes(reader.removed) +
+             TreeBytes(reader.added);
+    for (auto &may_equal : reader.maybe_equal) {
+      bytes += TreeBytes(may_equal);
+    }
+    for (auto &tuple : reader.removed) {
+      bytes += VectorBytes(tuple);
+    }
+    for (auto &tuple : reader.added) {
+      bytes += VectorBytes(tuple);
+    }
+  }
+  for (auto &alphas : alphas_) {
+    bytes += TableBytes(alphas);
+    for (auto &entry : alphas) {
+      bytes += VectorBytes(entry.second);
+    }
+  }
+  return bytes;
+}
@@ -0,0 +1,30 @@
+#include <algorithm>
+#include <string>
+#include "ts_lib.h"
+
+Node NodeNames::Add(const std::string &name) {
+  assert(readers_.Idle());
+  auto it = ids_.find(name);
+  if (it != ids_.end()) {
+    SetPresent(it->second, true);
+    return it->second;
+  }
+  names_.push_back(name);
+  present_.push_back(true);
+  colons_.push_back(std::count(name.begin(), name.end(), ':'));
+  Node node = names_.size();
+  ids_[name] = node;
+  return node;
+}
+
+void NodeNames::Remove(const std::string &name) {
+  Node node = Find(name);
+  if (node != Node(0)) {
+    SetPresent(node, false);
+  }
+}
+
+Node NodeNames::Find(const std::string &name) const {
+  auto it = ids_.find(name);
+  return it == ids_.end() ? Node(0) : it->second;
+}
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include "ts_lib.h"
+
+// Little-endian base-128 varints, as used by eg. protobuf.
+static void PutVarint(uint32_t value, std::vector<uint8_t> *bytes) {
+  while (value >= 0x80) {
+    bytes->push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  bytes->push_back(static_cast<uint8_t>(value));
+}
+
+static uint32_t GetVarint(const std::vector<uint8_t> &bytes, size_t *offset) {
+  uint32_t value = 0;
+  for (int shift = 0; ; shift += 7) {
+    uint8_t byte = bytes[(*offset)++];
+    value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+}
+
+PostingList::PostingList(const Triplet &key, uint8_t shape)
+    : key_(key), n_free_(0) {
+  for (uint8_t j = 0; j < 3; j++) {
+    if ((shape >> j) & 0b1) {
+      continue;
+    }
+    key_[j] = Node(0);
+    free_[n_free_++] = j;
+  }
+}
+
+PostingList::Entry PostingList::EntryOf(const Triplet &fact) const {
+  Entry entry = {{0, 0, 0}};
+  for (uint8_t i = 0; i < n_free_; i++) {
+    entry[i] = fact[free_[i]];
+  }
+  return entry;
+}
+
+void PostingList::FillFact(const Entry &entry, Triplet *fact) const {
+  *fact = key_;
+  for (uint8_t i = 0; i < n_free_; i++) {
+    (*fact)[free_[i]] = entry[i];
+  }
+}
+
+// Index of the block which @entry belongs in: the last one whose first entry
+// is <= @entry, or the first block if there is none.
+size_t PostingList::FindBlock(const Entry &entry) const {
+  auto it = std::upper_bound(
+      blocks_.begin(), blocks_.end(), entry,
+      [](const Entry &entry, const std::shared_ptr<Block> &block) {
+        return entry < block->first;
+      });
+  return it == blocks_.begin() ? 0 : (it - blocks_.begin()) - 1;
+}
+
+// Entries are delta-encoded lexicographically: each element is stored as the
+// difference from the previous entry's up to and including the first element
+// that differs, then verbatim (all nodes are positive).
+void PostingList::DecodeNext(const std::vector<uint8_t> &bytes,
+                             size_t *offset, Entry *entry) const {
+  bool equal_so_far = true;
+  for (uint8_t i = 0; i < n_free_; i++) {
+    uint32_t value = GetVarint(bytes, offset);
+    if (equal_so_far) {
+      (*entry)[i] += value;
+      equal_so_far = (value == 0);
+    } else {
+      (*entry)[i] = value;
+    }
+  }
+}
+
+std::vector<PostingList::Entry> PostingList::Decode(const Block &block) const {
+  std::vector<Entry> entries;
+  entries.reserve(block.size);
+  entries.push_back(block.first);
+  size_t offset = 0;
+  for (uint32_t i = 1; i < block.size; i++) {
+    Entry entry = entries.back();
+    DecodeNext(block.rest, &offset, &entry);
+    entries.push_back(entry);
+  }
+  return entries;
+}
+
+std::shared_ptr<PostingList::Block> PostingList::Encode(
+    std::vector<Entry>::const_iterator begin,
+    std::vector<Entry>::const_iterator end) const {
+  std::shared_ptr<Block> block = std::make_shared<Block>();
+  block->first = *begin;
+  block->last = *(end - 1);
+  block->size = end - begin;
+  for (auto it = begin + 1; it < end; it++) {
+    EncodeNext(*(it - 1), *it, &block->rest);
+  }
+  block->rest.shrink_to_fit();
+  return block;
+}
+
+void PostingList::EncodeNext(const Entry &previous, const Entry &entry,
+                             std::vector<uint8_t> *bytes) const {
+  bool equal_so_far = true;
+  for (uint8_t i = 0; i < n_free_; i++) {
+    if (equal_so_far) {
+      PutVarint(entry[i] - previous[i], bytes);
+      equal_so_far = (entry[i] == previous[i]);
+    } else {
+      PutVarint(entry[i], bytes);
+    }
+  }
+}
+
+void PostingList::Add(const Triplet &fact) {
+  Entry entry = EntryOf(fact);
+  if (blocks_.empty()) {
+    std::vector<Entry> entries(1, entry);
+    blocks_.push_back(Encode(entries.begin(), entries.end()));
+    return;
+  }
+  size_t block = FindBlock(entry);
+  std::shared_ptr<Block> &into = blocks_[block];
+  if (into->last < entry && into->size < kBlockSize) {
+    // Fast path for appending to a block. This is the common case, since new
+    // nodes get increasing IDs and Structure::Materialize adds in order.
+    Block &unshared = Unshare(&into);
+    EncodeNext(unshared.last, entry, &unshared.rest);
+    unshared.last = entry;
+    unshared.size++;
+    return;
+  }
+  std::vector<Entry> entries = Decode(*into);
+  auto at = std::lower_bound(entries.begin(), entries.end(), entry);
+  assert(at == entries.end() || *at != entry);
+  entries.insert(at, entry);
+  if (entries.size() <= kBlockSize) {
+    into = Encode(entries.begin(), entries.end());
+    return;
+  }
+  // Split full blocks in half.
+  auto middle = entries.begin() + (entries.size() / 2);
+  into = Encode(entries.begin(), middle);
+  blocks_.insert(blocks_.begin() + block + 1, Encode(middle, entries.end()));
+}
+
+bool PostingList::Remove(const Triplet &fact) {
+  if (blocks_.empty()) {
+    return false;
+  }
+  Entry entry = EntryOf(fact);
+  size_t block = FindBlock(entry);
+  std::vector<Entry> entries = Decode(*blocks_[block]);
+  auto at = std::lower_bound(entries.begin(), entries.end(), entry);
+  if (at == entries.end() || *at != entry) {
+    return false;
+  }
+  entries.erase(at);
+  if (entries.empty()) {
+    blocks_.erase(blocks_.begin() + block);
+  } else {
+    blocks_[block] = Encode(entries.begin(), entries.end());
+  }
+  return true;
+}
+
+PostingList::Cursor::Cursor(const PostingList *list, size_t block)
+    : list_(list), block_(block), index_(0), offset_(0), entry_(),
+      fact_(0, 0, 0) {
+  LoadFirst();
+}
+
+void PostingList::Cursor::LoadFirst() {
+  if (block_ < list_->blocks_.size()) {
+    entry_ = list_->blocks_[block_]->first;
+    list_->FillFact(entry_, &fact_);
+  }
+}
+
+void PostingList::Cursor::Next() {
+  const Block &block = *list_->blocks_[block_];
+  if (++index_ < block.size) {
+    list_->DecodeNext(block.rest, &offset_, &entry_);
+    list_->FillFact(entry_, &fact_);
+    return;
+  }
+  block_++;
+  index_ = 0;
+  offset_ = 0;
+  LoadFirst();
+}
+
+size_t PostingList::HeapBytes() const {
+  size_t bytes = VectorBytes(blocks_);
+  for (const std::shared_ptr<Block> &block : blocks_) {
+    // Blocks are allocated along with their shared_ptr counts.
+    bytes += sizeof(Block) + (2 * sizeof(long)) + block->rest.capacity();
+  }
+  return bytes;
+}
@@ -0,0 +1,72 @@
+#include <vector>
+#include "ts_lib.h"
+
+RuleTemplate::RuleTemplate(const size_t n_variables,
+                           const std::vector<Triplet> &inserts,
+                           const std::vector<Triplet> &subtracts,
+                           const std::vector<size_t> &remove_slots)
+    : n_variables_(n_variables), inserts_(inserts), subtracts_(subtracts),
+      remove_slots_(remove_slots) { }
+
+bool RuleTemplate::Fill(const Triplet &instruction,
+                        const std::vector<Node> &assignment,
+                        Triplet *fact) const {
+  for (size_t i = 0; i < 3; i++) {
+    Node node = instruction[i];
+    if (node <= 0) {
+      node = assignment.at(-node);
+      if (node == Node(0)) {
+        return false;
+      }
+    }
+    (*fact)[i] = node;
+  }
+  return true;
+}
+
+static void Append(const Triplet &fact, std::vector<Node> *flat) {
+  flat->insert(flat->end(), fact.begin(), fact.end());
+}
+
+std::pair<std::vector<Node>, std::vector<Node>> RuleTemplate::Apply(
+    Structure *structure, const std::vector<Node> &assignment) const {
+  TraceSpan span("RuleTemplate::Apply");
+  assert(assignment.size() == n_variables_);
+  std::vector<Node> added, removed;
+  Triplet filled(0, 0, 0);
+
+  for (const Triplet &instruction : inserts_) {
+    if (!Fill(instruction, assignment, &filled)) {
+      continue;
+    }
+    if (!structure->IsTrue(filled)) {
+      structure->AddFact(filled);
+      Append(filled, &added);
+    }
+  }
+
+  std::vector<Node> remove_nodes;
+  for (const size_t slot : remove_slots_) {
+    Node node = assignment.at(slot);
+    if (node != Node(0)) {
+      remove_nodes.push_back(node);
+    }
+  }
+  if (!remove_nodes.empty()) {
+    std::vector<Node> facts = structure->RemoveNodesWithFacts(remove_nodes);
+    removed.insert(removed.end(), facts.begin(), facts.end());
+  }
+
+  // Subtracts take precedence over inserts of the same fact, as in
+  // runtime/assignment.py:Assignment.remove.
+  for (const Triplet &instruction : subtracts_) {
+    if (!Fill(instruction, assignment, &filled)) {
+      continue;
+    }
+    if (structure->IsTrue(filled)) {
+      structure->RemoveFact(filled);
+      Append(filled, &removed);
+    }
+  }
+  return std::make_pair(added, removed);
+}
@@ -8,7 +8,8 @@ import pybind11
 
 TC_CPP_MODULE = Extension("ts_cpp",
                           include_dirs=[pybind11.get_include()],
-                          extra_compile_args=["-O3", "-std=c++11"],
+                          extra_compile_args=["-O3", "-std=c++11", "-pthread"],
+                          extra_link_args=["-pthread"],
                           sources=glob("*.cc"))
 
 setup(name="ts_cpp",
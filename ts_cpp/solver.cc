@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <tuple>
 #include <string>
 #include "ts_lib.h"
@@ -18,6 +19,7 @@ Solver::Solver(const Structure &structure, const size_t n_variables,
       var_to_constraints_(n_variables, std::vector<size_t>({})),
       may_equal_(maybe_equal), assignment_(n_variables, 0),
       states_(n_variables, State()), current_index_(0) {
+  TraceSpan span("Solver::Solver");
   assert(n_variables > 0);
   for (size_t constraint_i = 0;
        constraint_i < constraints.size();
@@ -81,6 +83,16 @@ std::vector<Node> Solver::NextAssignment() {
   return {};
 }
 
+std::vector<Node> Solver::NextAssignments(size_t max) {
+  TraceSpan span("Solver::NextAssignments");
+  std::vector<Node> assignments;
+  for (size_t i = 0; i < max && valid_; i++) {
+    std::vector<Node> assignment = NextAssignment();
+    assignments.insert(assignments.end(), assignment.begin(), assignment.end());
+  }
+  return assignments;
+}
+
 void Solver::Assign(const Node to) {
   assignment_[current_index_] = to;
   int var = CurrentVariable();
@@ -143,7 +155,7 @@ void Solver::GetOptions() {
     // valid assignments to @var are. Note that we want a running intersection
     // with @options.
     std::set<Node> local_options;
-    for (auto &triplet : structure_.Lookup(emptied)) {
+    for (const Triplet &triplet : structure_.Lookup(emptied)) {
       Node choice = 0;
       // In theory we can avoid this loop (and hole_is_var)
       for (size_t j = 0; j < 3; j++) {
@@ -192,3 +204,41 @@ void Solver::GetOptions() {
   }
   states_[current_index_].options_it = options.begin();
 }
+
+size_t Solver::MemoryUsage() const {
+  size_t bytes = VectorBytes(constraints_) + VectorBytes(working_constraints_) +
+                 VectorBytes(var_to_constraints_) + VectorBytes(may_equal_) +
+                 VectorBytes(assignment_) + VectorBytes(states_);
+  for (auto &constraints : var_to_constraints_) {
+    bytes += VectorBytes(constraints);
+  }
+  for (auto &may_equal : may_equal_) {
+    bytes += TreeBytes(may_equal);
+  }
+  for (auto &state : states_) {
+    bytes += TreeBytes(state.options);
+  }
+  return bytes;
+}
+
+bool ValidMaybeEquals(const std::vector<std::set<size_t>> &maybe_equal,
+                      const std::vector<Node> &assignment) {
+  std::vector<std::pair<Node, size_t>> preimages;
+  for (size_t variable = 0; variable < assignment.size(); variable++) {
+    if (assignment[variable] != Node(0)) {
+      preimages.emplace_back(assignment[variable], variable);
+    }
+  }
+  std::sort(preimages.begin(), preimages.end());
+  // Every variable must be allowed to equal the first one with its node.
+  size_t first = 0;
+  for (size_t i = 1; i < preimages.size(); i++) {
+    if (preimages[i].first != preimages[first].first) {
+      first = i;
+    } else if (maybe_equal[preimages[first].second].count(
+                   preimages[i].second) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,91 @@
+#include <string>
+#include <vector>
+#include "ts_lib.h"
+
+// SipHash-2-4 with 128-bit output, following the reference implementation.
+// The key is fixed (bytes 0x00, ..., 0x0f, as in the reference test vectors);
+// the point is a well-distributed hash which never changes, not a keyed one.
+
+static inline uint64_t RotateLeft(uint64_t x, int b) {
+  return (x << b) | (x >> (64 - b));
+}
+
+static inline uint64_t ReadLittleEndian(const uint8_t *bytes, size_t n) {
+  uint64_t word = 0;
+  for (size_t i = 0; i < n; i++) {
+    word |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+  }
+  return word;
+}
+
+namespace {
+
+struct SipState {
+  uint64_t v0, v1, v2, v3;
+
+  void Round() {
+    v0 += v1; v1 = RotateLeft(v1, 13); v1 ^= v0; v0 = RotateLeft(v0, 32);
+    v2 += v3; v3 = RotateLeft(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = RotateLeft(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = RotateLeft(v1, 17); v1 ^= v2; v2 = RotateLeft(v2, 32);
+  }
+
+  void Compress(uint64_t word) {
+    v3 ^= word;
+    Round();
+    Round();
+    v0 ^= word;
+  }
+};
+
+}  // namespace
+
+std::array<uint64_t, 2> StableHash(const std::string &bytes) {
+  const uint64_t k0 = 0x0706050403020100ull, k1 = 0x0f0e0d0c0b0a0908ull;
+  SipState state = {k0 ^ 0x736f6d6570736575ull, k1 ^ 0x646f72616e646f6dull,
+                    k0 ^ 0x6c7967656e657261ull, k1 ^ 0x7465646279746573ull};
+  state.v1 ^= 0xee;
+
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(bytes.data());
+  size_t size = bytes.size(), full = size - (size % 8);
+  for (size_t i = 0; i < full; i += 8) {
+    state.Compress(ReadLittleEndian(data + i, 8));
+  }
+  uint64_t last = static_cast<uint64_t>(size & 0xff) << 56;
+  state.Compress(last | ReadLittleEndian(data + full, size - full));
+
+  std::array<uint64_t, 2> hash;
+  state.v2 ^= 0xee;
+  for (int i = 0; i < 4; i++) {
+    state.Round();
+  }
+  hash[0] = state.v0 ^ state.v1 ^ state.v2 ^ state.v3;
+  state.v1 ^= 0xdd;
+  for (int i = 0; i < 4; i++) {
+    state.Round();
+  }
+  hash[1] = state.v0 ^ state.v1 ^ state.v2 ^ state.v3;
+  return hash;
+}
+
+std::string StableName(const std::vector<std::string> &parts, bool numeric) {
+  std::string bytes;
+  for (const std::string &part : parts) {
+    bytes += part;
+    bytes.push_back('\0');
+  }
+  std::array<uint64_t, 2> hash = StableHash(bytes);
+  if (numeric) {
+    return std::to_string(hash[0]);
+  }
+  static const char kDigits[] = "0123456789abcdef";
+  std::string name;
+  for (uint64_t word : hash) {
+    // Little-endian, matching the reference's byte output.
+    for (int byte = 0; byte < 8; byte++) {
+      name.push_back(kDigits[(word >> (8 * byte + 4)) & 0xf]);
+      name.push_back(kDigits[(word >> (8 * byte)) & 0xf]);
+    }
+  }
+  return name;
+}
@@ -5,36 +5,363 @@
 #include <string>
 #include "ts_lib.h"
 
+// Returns the key of shape @shape which holds @fact.
+static Triplet KeyOf(const Triplet &fact, uint8_t shape) {
+  Triplet key(fact);
+  for (uint8_t j = 0; j < 3; j++) {
+    if (!((shape >> j) & 0b1)) {
+      key[j] = Node(0);
+    }
+  }
+  return key;
+}
+
+uint8_t Structure::ShapeOf(const Triplet &key) {
+  uint8_t shape = 0;
+  for (uint8_t j = 0; j < 3; j++) {
+    if (key[j] != Node(0)) {
+      shape |= (0b1 << j);
+    }
+  }
+  return shape;
+}
+
 void Structure::AddFact(const Triplet &fact) {
+  assert(readers_.Idle());
+  if (mapped_) {
+    Thaw();
+  }
   assert(!IsTrue(fact));
-  Triplet key(fact);
-  for (uint8_t i = 0; i < 8; i++) {
-    for (uint8_t j = 0; j < 3; j++) {
-      if ((i >> j) & 0b1) {
-        key[j] = fact[j];
-      } else {
-        key[j] = Node(0);
-      }
+  for (uint8_t shape = 0; shape < 8; shape++) {
+    if ((materialized_ >> shape) & 0b1) {
+      Triplet key = KeyOf(fact, shape);
+      MutableIndex(shape).MutableShard(key)[key].Add(fact, shape);
     }
-    facts_[key].push_back(fact);
+  }
+  MutableGround().MutableShard(fact).insert(fact);
+  if (open_ != 0) {
+    undo_log_.push_back(Undo{fact, true});
+  }
+  Record(fact, true);
+  if (++modifications_ % kCompactInterval == 0) {
+    CompactIndex();
   }
 }
 
 void Structure::RemoveFact(const Triplet &fact) {
+  assert(readers_.Idle());
+  if (mapped_) {
+    Thaw();
+  }
   assert(IsTrue(fact));
-  Triplet key(fact);
-  for (uint8_t i = 0; i < 8; i++) {
-    for (uint8_t j = 0; j < 3; j++) {
-      if ((i >> j) & 0b1) {
-        key[j] = fact[j];
-      } else {
-        key[j] = Node(0);
+  for (uint8_t shape = 0; shape < 8; shape++) {
+    if (!((materialized_ >> shape) & 0b1)) {
+      continue;
+    }
+    Triplet key = KeyOf(fact, shape);
+    auto &shard = MutableIndex(shape).MutableShard(key);
+    auto bucket = shard.find(key);
+    assert(bucket != shard.end());
+    bool removed = bucket->second.Remove(fact);
+    assert(removed);
+    // Drop emptied buckets so that misses in Lookup stay misses in facts_.
+    if (bucket->second.empty()) {
+      shard.erase(bucket);
+    }
+  }
+  MutableGround().MutableShard(fact).erase(fact);
+  if (open_ != 0) {
+    undo_log_.push_back(Undo{fact, false});
+  }
+  Record(fact, false);
+  if (++modifications_ % kCompactInterval == 0) {
+    CompactIndex();
+  }
+}
+
+void Structure::AddFeed(Feed *feed) {
+  assert(std::find(feeds_.begin(), feeds_.end(), feed) == feeds_.end());
+  feeds_.push_back(feed);
+}
+
+void Structure::RemoveFeed(Feed *feed) {
+  auto it = std::find(feeds_.begin(), feeds_.end(), feed);
+  assert(it != feeds_.end());
+  feeds_.erase(it);
+}
+
+void Structure::Record(const Triplet &fact, bool added) {
+  for (Feed *feed : feeds_) {
+    if (feed->reset) {
+      continue;
+    }
+    if (feed->changes.size() == kMaxFeed) {
+      feed->changes.clear();
+      feed->reset = true;
+      continue;
+    }
+    feed->changes.emplace_back(fact, added);
+  }
+}
+
+void Structure::CompactIndex() {
+  assert(readers_.Idle());
+  uint8_t unused = used_ == 0 ? 0 : (materialized_ & ~used_);
+  for (uint8_t shape = 0; shape < 8; shape++) {
+    if ((unused >> shape) & 0b1) {
+      facts_[shape].reset();
+    } else if ((materialized_ >> shape) & 0b1) {
+      MutableIndex(shape).Compact();
+    }
+  }
+  materialized_ &= ~unused;
+  used_ = 0;
+}
+
+Structure Structure::Snapshot() const {
+  Structure snapshot;
+  // Concurrent lookups may be building shapes.
+  std::lock_guard<std::mutex> lock(build_mutex_);
+  snapshot.facts_ = facts_;
+  snapshot.materialized_ = materialized_;
+  snapshot.used_ = used_;
+  snapshot.modifications_ = modifications_;
+  snapshot.ground_ = ground_;
+  snapshot.mapped_ = mapped_;
+  return snapshot;
+}
+
+void Structure::Publish() {
+  std::shared_ptr<const Structure> version =
+      std::make_shared<const Structure>(Snapshot());
+  std::atomic_store(&published_, version);
+}
+
+Structure Structure::Published() const {
+  std::shared_ptr<const Structure> version = std::atomic_load(&published_);
+  return version ? version->Snapshot() : Structure();
+}
+
+void Structure::Restore(const Structure &snapshot) {
+  assert(readers_.Idle());
+  facts_ = snapshot.facts_;
+  materialized_ = snapshot.materialized_;
+  used_ = snapshot.used_;
+  modifications_ = snapshot.modifications_;
+  ground_ = snapshot.ground_;
+  mapped_ = snapshot.mapped_;
+  undo_log_.clear();
+  transactions_.clear();
+  open_ = 0;
+  for (Feed *feed : feeds_) {
+    feed->changes.clear();
+    feed->reset = true;
+  }
+}
+
+StructureMemory Structure::MemoryUsage() const {
+  StructureMemory usage;
+  // Concurrent lookups may be building shapes.
+  std::lock_guard<std::mutex> lock(build_mutex_);
+  for (uint8_t shape = 0; shape < 8; shape++) {
+    if (!((materialized_ >> shape) & 0b1)) {
+      continue;
+    }
+    const Index &index = *facts_[shape];
+    StructureMemory::Shape &usage_of = usage.shapes[shape];
+    usage_of.table_bytes = index.HeapBytes();
+    for (size_t i = 0; i < Index::kShards; i++) {
+      for (auto &entry : index.ShardAt(i)) {
+        const Bucket &bucket = entry.second;
+        usage_of.keys++;
+        usage_of.facts += bucket.size();
+        if (bucket.IsHub()) {
+          usage_of.hub_buckets++;
+          usage_of.hub_bytes += bucket.HeapBytes();
+        } else if (bucket.IsInline()) {
+          usage_of.inline_buckets++;
+        } else {
+          usage_of.flat_buckets++;
+          usage_of.flat_bytes += bucket.HeapBytes();
+        }
+      }
+    }
+  }
+  usage.ground_bytes = ground_->HeapBytes();
+  usage.mapped_bytes = mapped_ ? mapped_->bytes() : 0;
+  usage.undo_bytes = VectorBytes(undo_log_) + VectorBytes(transactions_);
+  return usage;
+}
+
+size_t Structure::size() const {
+  return mapped_ ? mapped_->size() : ground_->size();
+}
+
+size_t Structure::Begin() {
+  open_ = next_transaction_++;
+  transactions_.emplace_back(open_, undo_log_.size());
+  return open_;
+}
+
+void Structure::Commit(size_t txn) {
+  assert(txn == open_);
+  open_ = 0;
+}
+
+bool Structure::Rollback(size_t txn) {
+  TraceSpan span("Structure::Rollback");
+  auto first = std::lower_bound(
+      transactions_.begin(), transactions_.end(),
+      std::make_pair(txn, size_t(0)));
+  if (first == transactions_.end() || first->first != txn) {
+    return false;
+  }
+  size_t start = first->second;
+  // Don't record the undos themselves. The checks skip facts which were
+  // changed again outside of any transaction.
+  open_ = 0;
+  for (size_t i = undo_log_.size(); i > start; i--) {
+    const Undo &undo = undo_log_[i - 1];
+    if (undo.added && IsTrue(undo.fact)) {
+      RemoveFact(undo.fact);
+    } else if (!undo.added && !IsTrue(undo.fact)) {
+      AddFact(undo.fact);
+    }
+  }
+  undo_log_.erase(undo_log_.begin() + start, undo_log_.end());
+  transactions_.erase(first, transactions_.end());
+  return true;
+}
+
+void Structure::Forget(size_t txn) {
+  auto first = std::lower_bound(
+      transactions_.begin(), transactions_.end(),
+      std::make_pair(txn, size_t(0)));
+  if (first == transactions_.begin()) {
+    return;
+  }
+  size_t start = first == transactions_.end() ? undo_log_.size()
+                                              : first->second;
+  undo_log_.erase(undo_log_.begin(), undo_log_.begin() + start);
+  transactions_.erase(transactions_.begin(), first);
+  for (auto &transaction : transactions_) {
+    transaction.second -= start;
+  }
+}
+
+void Structure::AddFacts(const std::vector<Node> &triplets) {
+  assert(triplets.size() % 3 == 0);
+  for (size_t i = 0; i < triplets.size(); i += 3) {
+    AddFact(Triplet(triplets[i], triplets[i + 1], triplets[i + 2]));
+  }
+}
+
+void Structure::RemoveFacts(const std::vector<Node> &triplets) {
+  assert(triplets.size() % 3 == 0);
+  for (size_t i = 0; i < triplets.size(); i += 3) {
+    RemoveFact(Triplet(triplets[i], triplets[i + 1], triplets[i + 2]));
+  }
+}
+
+std::vector<Node> Structure::RemoveNodesWithFacts(
+    const std::vector<Node> &nodes) {
+  TraceSpan span("Structure::RemoveNodesWithFacts");
+  assert(readers_.Idle());
+  std::vector<Node> sorted(nodes);
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+  assert(sorted.empty() || sorted.front() != Node(0));
+  auto removed = [&sorted](Node node) {
+    return std::binary_search(sorted.begin(), sorted.end(), node);
+  };
+  // Each fact is taken from the first of its slots holding a removed node.
+  std::vector<Triplet> facts;
+  for (const Node node : sorted) {
+    for (size_t i = 0; i < 3; i++) {
+      Triplet key(0, 0, 0);
+      key[i] = node;
+      for (const Triplet &fact : Lookup(key)) {
+        if ((i < 1 || !removed(fact[0])) && (i < 2 || !removed(fact[1]))) {
+          facts.push_back(fact);
+        }
+      }
+    }
+  }
+  if (facts.empty()) {
+    return std::vector<Node>();
+  }
+  if (mapped_) {
+    Thaw();
+  }
+
+  for (uint8_t shape = 0; shape < 8; shape++) {
+    if (!((materialized_ >> shape) & 0b1)) {
+      continue;
+    }
+    Index &index = MutableIndex(shape);
+    for (const Triplet &fact : facts) {
+      Triplet key = KeyOf(fact, shape);
+      auto &shard = index.MutableShard(key);
+      if (removed(key[0]) || removed(key[1]) || removed(key[2])) {
+        // A no-op if another fact already dropped it.
+        shard.erase(key);
+        continue;
+      }
+      auto bucket = shard.find(key);
+      assert(bucket != shard.end());
+      bool was_removed = bucket->second.Remove(fact);
+      assert(was_removed);
+      if (bucket->second.empty()) {
+        shard.erase(bucket);
       }
     }
-    auto it = std::find(facts_[key].begin(), facts_[key].end(), fact);
-    assert(it != facts_[key].end());
-    facts_[key].erase(it);
   }
+
+  std::vector<Node> flat;
+  flat.reserve(3 * facts.size());
+  FactSet &ground = MutableGround();
+  for (const Triplet &fact : facts) {
+    ground.MutableShard(fact).erase(fact);
+    if (open_ != 0) {
+      undo_log_.push_back(Undo{fact, false});
+    }
+    Record(fact, false);
+    flat.insert(flat.end(), fact.begin(), fact.end());
+  }
+  size_t before = modifications_;
+  modifications_ += facts.size();
+  if (before / kCompactInterval != modifications_ / kCompactInterval) {
+    CompactIndex();
+  }
+  return flat;
+}
+
+Structure::Index &Structure::MutableIndex(uint8_t shape) {
+  return Unshare(&facts_[shape]);
+}
+
+Structure::FactSet &Structure::MutableGround() {
+  return Unshare(&ground_);
+}
+
+void Structure::Materialize(uint8_t shape) const {
+  assert(!facts_[shape]);
+  // Sorting puts the facts under every key in PostingList order, so hub
+  // buckets are built by appending.
+  std::vector<Triplet> facts;
+  facts.reserve(ground_->size());
+  for (size_t i = 0; i < FactSet::kShards; i++) {
+    facts.insert(facts.end(), ground_->ShardAt(i).begin(),
+                 ground_->ShardAt(i).end());
+  }
+  std::sort(facts.begin(), facts.end());
+  std::shared_ptr<Index> index = std::make_shared<Index>();
+  for (const Triplet &fact : facts) {
+    Triplet key = KeyOf(fact, shape);
+    index->MutableShard(key)[key].Add(fact, shape);
+  }
+  facts_[shape] = index;
+  materialized_ |= (0b1 << shape);
 }
 
 void Structure::AddFactPy(Node i, Node j, Node k) {
@@ -45,13 +372,55 @@ void Structure::RemoveFactPy(Node i, Node j, Node k) {
   RemoveFact(Triplet(i, j, k));
 }
 
-const std::vector<Triplet> &Structure::Lookup(const Triplet &fact) const {
-  try {
-    return facts_.at(fact);
-  } catch (std::out_of_range &) {
-    // TODO(masotoud): Maybe not?
-    return empty_;
+void Structure::MaterializeShapes(uint8_t shapes) const {
+  if (mapped_) {
+    // Every shape is served by the file.
+    return;
+  }
+  std::lock_guard<std::mutex> lock(build_mutex_);
+  for (uint8_t shape = 0; shape < 8; shape++) {
+    if (((shapes & ~materialized_) >> shape) & 0b1) {
+      Materialize(shape);
+    }
+  }
+  used_ |= shapes;
+}
+
+FactRange Structure::Lookup(const Triplet &fact) const {
+  if (mapped_) {
+    return mapped_->Lookup(fact);
   }
+  uint8_t shape = ShapeOf(fact);
+  if (!((materialized_ >> shape) & 0b1)) {
+    std::lock_guard<std::mutex> lock(build_mutex_);
+    // Another reader may have built it while we waited.
+    if (!((materialized_ >> shape) & 0b1)) {
+      Materialize(shape);
+    }
+  }
+  // Only written when it changes, see MaterializeShapes.
+  if (!((used_ >> shape) & 0b1)) {
+    used_ |= (0b1 << shape);
+  }
+  auto &shard = facts_[shape]->Shard(fact);
+  auto it = shard.find(fact);
+  const Bucket &bucket = it == shard.end() ? empty_ : it->second;
+  return FactRange(bucket.begin(), bucket.end(), bucket.size());
+}
+
+std::vector<Triplet> Structure::LookupPy(Node i, Node j, Node k) const {
+  FactRange facts = Lookup(Triplet(i, j, k));
+  return std::vector<Triplet>(facts.begin(), facts.end());
+}
+
+std::vector<Node> Structure::LookupFlat(Node i, Node j, Node k) const {
+  FactRange facts = Lookup(Triplet(i, j, k));
+  std::vector<Node> flat;
+  flat.reserve(3 * facts.size());
+  for (const Triplet &fact : facts) {
+    flat.insert(flat.end(), fact.begin(), fact.end());
+  }
+  return flat;
 }
 
 bool Structure::AllTrue(const std::vector<Triplet> &facts) const {
@@ -64,5 +433,24 @@ bool Structure::AllTrue(const std::vector<Triplet> &facts) const {
 }
 
 bool Structure::IsTrue(const Triplet &fact) const {
-  return facts_.count(fact) > 0 && !facts_.at(fact).empty();
+  if (mapped_) {
+    return mapped_->IsTrue(fact);
+  }
+  return ground_->Shard(fact).count(fact) > 0;
+}
+
+std::vector<bool> Structure::IsTrueMany(
+    const std::vector<Node> &triplets) const {
+  assert(triplets.size() % 3 == 0);
+  std::vector<bool> result(triplets.size() / 3, false);
+  for (size_t i = 0; i < result.size(); i++) {
+    Triplet fact(triplets[3 * i], triplets[(3 * i) + 1],
+                 triplets[(3 * i) + 2]);
+    result[i] = IsTrue(fact);
+  }
+  return result;
+}
+
+bool Structure::IsTruePy(Node i, Node j, Node k) const {
+  return IsTrue(Triplet(i, j, k));
 }
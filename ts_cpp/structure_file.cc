@@ -0,0 +1,323 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "ts_lib.h"
+
+namespace {
+
+const char kMagic[8] = {'T', 'S', 'S', 'T', 'R', 'U', 'C', 'T'};
+// Written as is, so files from machines of the other endianness are
+// rejected rather than misread.
+const uint32_t kByteOrder = 0x01020304;
+const size_t kPage = 4096;
+
+enum Section {
+  kNameOffsets, kNameBytes, kPresent,
+  kFacts0, kFacts1, kFacts2,
+  kStarts0, kStarts1, kStarts2,
+  kSections,
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t n_facts;
+  uint64_t n_nodes;
+  uint64_t max_node;
+  uint64_t offsets[kSections];
+  uint64_t sizes[kSections];
+};
+
+size_t PageAlign(size_t bytes) {
+  return ((bytes + kPage - 1) / kPage) * kPage;
+}
+
+// The sort order and number of leading slots of that order which are filled
+// in, for keys of each shape (see Structure::ShapeOf).
+const uint8_t kPlans[8][2] = {
+  {0, 0}, {0, 1}, {1, 1}, {0, 2}, {2, 1}, {2, 2}, {1, 2}, {0, 3},
+};
+
+}  // namespace
+
+const uint8_t MappedStructure::kOrders[3][3] = {
+  {0, 1, 2}, {1, 2, 0}, {2, 0, 1},
+};
+
+void MappedStructure::Write(const std::string &path,
+                            std::vector<Triplet> facts,
+                            const NodeNames *names) {
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.byte_order = kByteOrder;
+  header.n_facts = facts.size();
+  header.n_nodes = names == nullptr ? 0 : names->size();
+  Node max_node = 0;
+  for (const Triplet &fact : facts) {
+    for (const Node &node : fact) {
+      assert(node > 0);
+      max_node = std::max(max_node, node);
+    }
+  }
+  header.max_node = max_node;
+
+  std::vector<uint64_t> name_offsets(header.n_nodes + 1, 0);
+  std::string name_bytes;
+  std::vector<uint8_t> present(header.n_nodes, 0);
+  for (size_t i = 0; i < header.n_nodes; i++) {
+    name_offsets[i] = name_bytes.size();
+    name_bytes += names->Name(Node(i + 1));
+    present[i] = names->IsPresent(Node(i + 1));
+  }
+  name_offsets[header.n_nodes] = name_bytes.size();
+
+  std::array<std::vector<Node>, 3> sorted;
+  std::array<std::vector<uint64_t>, 3> starts;
+  for (uint8_t order = 0; order < 3; order++) {
+    const uint8_t *slots = kOrders[order];
+    std::sort(facts.begin(), facts.end(),
+              [slots](const Triplet &a, const Triplet &b) {
+                return std::make_tuple(a[slots[0]], a[slots[1]], a[slots[2]])
+                       < std::make_tuple(b[slots[0]], b[slots[1]],
+                                         b[slots[2]]);
+              });
+    sorted[order].reserve(3 * facts.size());
+    // starts[order][node + 1] counts the facts starting with @node, then
+    // the prefix sums turn the counts into offsets.
+    starts[order].assign(max_node + 2, 0);
+    for (const Triplet &fact : facts) {
+      sorted[order].insert(sorted[order].end(), fact.begin(), fact.end());
+      starts[order][fact[slots[0]] + 1]++;
+    }
+    for (size_t i = 1; i < starts[order].size(); i++) {
+      starts[order][i] += starts[order][i - 1];
+    }
+  }
+
+  std::array<std::pair<const char *, size_t>, kSections> sections;
+  sections[kNameOffsets] = std::make_pair(
+      reinterpret_cast<const char *>(name_offsets.data()),
+      sizeof(uint64_t) * name_offsets.size());
+  sections[kNameBytes] = std::make_pair(name_bytes.data(), name_bytes.size());
+  sections[kPresent] = std::make_pair(
+      reinterpret_cast<const char *>(present.data()), present.size());
+  for (uint8_t order = 0; order < 3; order++) {
+    sections[kFacts0 + order] = std::make_pair(
+        reinterpret_cast<const char *>(sorted[order].data()),
+        sizeof(Node) * sorted[order].size());
+    sections[kStarts0 + order] = std::make_pair(
+        reinterpret_cast<const char *>(starts[order].data()),
+        sizeof(uint64_t) * starts[order].size());
+  }
+  size_t offset = kPage;
+  for (size_t i = 0; i < kSections; i++) {
+    header.offsets[i] = offset;
+    header.sizes[i] = sections[i].second;
+    offset = PageAlign(offset + sections[i].second);
+  }
+
+  // Write to a new file, then rename it over @path, so that processes which
+  // have the old file mapped keep seeing it unchanged.
+  std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    std::vector<char> padding(kPage, 0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(padding.data(), kPage - sizeof(header));
+    for (size_t i = 0; i < kSections; i++) {
+      out.write(sections[i].first, sections[i].second);
+      size_t end = header.offsets[i] + sections[i].second;
+      out.write(padding.data(), PageAlign(end) - end);
+    }
+    if (!out.good()) {
+      throw std::runtime_error("Could not write " + temporary);
+    }
+  }
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    throw std::runtime_error("Could not rename " + temporary + " to " + path);
+  }
+}
+
+MappedStructure::MappedStructure(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Could not open " + path);
+  }
+  struct stat stats;
+  if (fstat(fd, &stats) != 0) {
+    close(fd);
+    throw std::runtime_error("Could not stat " + path);
+  }
+  length_ = stats.st_size;
+  if (length_ < kPage) {
+    close(fd);
+    throw std::runtime_error(path + " is not a Structure file");
+  }
+  data_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data_ == MAP_FAILED) {
+    data_ = nullptr;
+    throw std::runtime_error("Could not map " + path);
+  }
+
+  // The destructor is not run if the constructor throws.
+  auto fail = [this, &path](const std::string &problem) {
+    munmap(data_, length_);
+    data_ = nullptr;
+    throw std::runtime_error(path + ": " + problem);
+  };
+  const Header &header = *static_cast<const Header *>(data_);
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    fail("not a Structure file");
+  }
+  if (header.byte_order != kByteOrder) {
+    fail("written on a machine of different endianness");
+  }
+  if (header.version != kVersion) {
+    fail("version " + std::to_string(header.version) + " is not supported");
+  }
+  n_facts_ = header.n_facts;
+  n_nodes_ = header.n_nodes;
+  max_node_ = Node(header.max_node);
+  std::array<uint64_t, kSections> expected;
+  expected[kNameOffsets] = sizeof(uint64_t) * (n_nodes_ + 1);
+  expected[kNameBytes] = header.sizes[kNameBytes];
+  expected[kPresent] = n_nodes_;
+  for (uint8_t order = 0; order < 3; order++) {
+    expected[kFacts0 + order] = sizeof(Node) * 3 * n_facts_;
+    expected[kStarts0 + order] = sizeof(uint64_t) * (max_node_ + 2);
+  }
+  for (size_t i = 0; i < kSections; i++) {
+    if (header.sizes[i] != expected[i] || header.offsets[i] % kPage != 0 ||
+        header.offsets[i] + header.sizes[i] > length_) {
+      fail("section " + std::to_string(i) + " is truncated or corrupt");
+    }
+  }
+
+  const char *bytes = static_cast<const char *>(data_);
+  name_offsets_ =
+      reinterpret_cast<const uint64_t *>(bytes + header.offsets[kNameOffsets]);
+  name_bytes_ = bytes + header.offsets[kNameBytes];
+  present_ = reinterpret_cast<const uint8_t *>(bytes + header.offsets[kPresent]);
+  for (uint8_t order = 0; order < 3; order++) {
+    facts_[order] = reinterpret_cast<const Node *>(
+        bytes + header.offsets[kFacts0 + order]);
+    starts_[order] = reinterpret_cast<const uint64_t *>(
+        bytes + header.offsets[kStarts0 + order]);
+  }
+}
+
+MappedStructure::~MappedStructure() {
+  if (data_ != nullptr) {
+    munmap(data_, length_);
+  }
+}
+
+size_t MappedStructure::Bound(uint8_t order, uint8_t depth,
+                              const Triplet &key, size_t begin, size_t end,
+                              bool upper) const {
+  const uint8_t *slots = kOrders[order];
+  const Node *facts = facts_[order];
+  // Binary search for the first fact which is not before the bound.
+  while (begin < end) {
+    size_t middle = begin + ((end - begin) / 2);
+    const Node *fact = facts + (3 * middle);
+    int comparison = 0;
+    for (uint8_t i = 0; i < depth && comparison == 0; i++) {
+      Node a = fact[slots[i]], b = key[slots[i]];
+      comparison = (a < b) ? -1 : ((a > b) ? 1 : 0);
+    }
+    if (comparison < 0 || (upper && comparison == 0)) {
+      begin = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  return begin;
+}
+
+FactRange MappedStructure::Lookup(const Triplet &key) const {
+  uint8_t shape = Structure::ShapeOf(key);
+  uint8_t order = kPlans[shape][0], depth = kPlans[shape][1];
+  size_t begin = 0, end = n_facts_;
+  if (depth > 0) {
+    Node first = key[kOrders[order][0]];
+    if (first < 0 || first > max_node_) {
+      begin = end = 0;
+    } else {
+      begin = starts_[order][first];
+      end = starts_[order][first + 1];
+    }
+    if (depth > 1) {
+      size_t lower = Bound(order, depth, key, begin, end, false);
+      end = Bound(order, depth, key, lower, end, true);
+      begin = lower;
+    }
+  }
+  const Node *facts = facts_[order];
+  return FactRange(Bucket::Iterator(facts + (3 * begin)),
+                   Bucket::Iterator(facts + (3 * end)), end - begin);
+}
+
+bool MappedStructure::IsTrue(const Triplet &fact) const {
+  // Facts are fully ground, so keys with holes are never true.
+  return Structure::ShapeOf(fact) == 0b111 && !Lookup(fact).empty();
+}
+
+void MappedStructure::ReadNames(NodeNames *names) const {
+  assert(names->size() == 0);
+  for (size_t i = 0; i < n_nodes_; i++) {
+    Node node = names->Add(std::string(
+        name_bytes_ + name_offsets_[i], name_offsets_[i + 1] - name_offsets_[i]));
+    assert(node == Node(i + 1));
+    if (!present_[i]) {
+      names->SetPresent(node, false);
+    }
+  }
+}
+
+void Structure::Save(const std::string &path, const NodeNames *names) const {
+  std::vector<Triplet> facts;
+  if (mapped_) {
+    FactRange all = mapped_->Lookup(Triplet(0, 0, 0));
+    facts.assign(all.begin(), all.end());
+  } else {
+    facts.reserve(ground_->size());
+    for (size_t i = 0; i < FactSet::kShards; i++) {
+      facts.insert(facts.end(), ground_->ShardAt(i).begin(),
+                   ground_->ShardAt(i).end());
+    }
+  }
+  MappedStructure::Write(path, std::move(facts), names);
+}
+
+Structure Structure::Open(const std::string &path, NodeNames *names) {
+  Structure structure;
+  structure.mapped_ = std::make_shared<const MappedStructure>(path);
+  if (names != nullptr) {
+    structure.mapped_->ReadNames(names);
+  }
+  return structure;
+}
+
+void Structure::Thaw() {
+  std::shared_ptr<FactSet> ground = std::make_shared<FactSet>();
+  for (const Triplet &fact : mapped_->Lookup(Triplet(0, 0, 0))) {
+    ground->MutableShard(fact).insert(fact);
+  }
+  ground_ = ground;
+  mapped_.reset();
+}
@@ -0,0 +1,42 @@
+#include <chrono>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "ts_lib.h"
+
+std::atomic<bool> Trace::enabled_(false);
+
+namespace {
+
+std::mutex events_mutex;
+std::vector<Trace::Event> events;
+std::atomic<size_t> n_threads(0);
+
+}  // namespace
+
+void Trace::Enable(bool enabled) {
+  enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+double Trace::Now() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration<double, std::micro>(now).count();
+}
+
+size_t Trace::Thread() {
+  thread_local size_t thread = ++n_threads;
+  return thread;
+}
+
+void Trace::Record(const char *name, double start) {
+  Event event{name, Thread(), start, Now() - start};
+  std::lock_guard<std::mutex> lock(events_mutex);
+  events.push_back(event);
+}
+
+std::vector<Trace::Event> Trace::Take() {
+  std::vector<Event> taken;
+  std::lock_guard<std::mutex> lock(events_mutex);
+  std::swap(taken, events);
+  return taken;
+}
@@ -4,23 +4,219 @@
 
 namespace py = pybind11;
 
+namespace {
+
+// Marks a read of an object for its lifetime, see ReaderCount. It must be
+// constructed while the GIL is still held and before releasing it, so that
+// it is destroyed after the GIL is taken back.
+class Reading {
+ public:
+  explicit Reading(const ReaderCount &readers) : readers_(readers) {
+    readers_.Enter();
+  }
+  ~Reading() { readers_.Exit(); }
+
+ private:
+  const ReaderCount &readers_;
+};
+
+}  // namespace
+
 PYBIND11_MODULE(ts_cpp, m) {
   py::class_<Triplet>(m, "Triplet")
     .def(py::init<Node, Node, Node>());
 
+  // Reads of a Structure (and Solvers over it) are safe to run concurrently,
+  // so they release the GIL to let Python threads solve in parallel. Each
+  // holds a Reading, so that a modification from another Python thread
+  // meanwhile fails an assertion instead of racing with it.
+  typedef py::call_guard<py::gil_scoped_release> release_gil;
+
   py::class_<Structure>(m, "Structure")
     .def(py::init<>())
     .def("addFact", &Structure::AddFactPy)
     .def("removeFact", &Structure::RemoveFactPy)
-    .def("lookup", &Structure::Lookup);
+    .def("lookup", [](const Structure &structure, Node i, Node j, Node k) {
+      Reading reading(structure.readers());
+      py::gil_scoped_release release;
+      return structure.LookupPy(i, j, k);
+    })
+    .def("lookupFlat", [](const Structure &structure, Node i, Node j, Node k) {
+      Reading reading(structure.readers());
+      py::gil_scoped_release release;
+      return structure.LookupFlat(i, j, k);
+    })
+    .def("isTrue", [](const Structure &structure, Node i, Node j, Node k) {
+      Reading reading(structure.readers());
+      py::gil_scoped_release release;
+      return structure.IsTruePy(i, j, k);
+    })
+    .def("isTrueMany", [](const Structure &structure,
+                          const std::vector<Node> &triplets) {
+      Reading reading(structure.readers());
+      py::gil_scoped_release release;
+      return structure.IsTrueMany(triplets);
+    })
+    .def("allTrue", [](const Structure &structure,
+                       const std::vector<Triplet> &facts) {
+      Reading reading(structure.readers());
+      py::gil_scoped_release release;
+      return structure.AllTrue(facts);
+    })
+    .def("materializedShapes", &Structure::MaterializedShapes)
+    .def("compactIndex", &Structure::CompactIndex)
+    .def("snapshot", &Structure::Snapshot)
+    .def("restore", &Structure::Restore)
+    .def("begin", &Structure::Begin)
+    .def("commit", &Structure::Commit)
+    .def("rollback", &Structure::Rollback)
+    .def("forget", &Structure::Forget)
+    .def("addFacts", &Structure::AddFacts)
+    .def("removeFacts", &Structure::RemoveFacts)
+    .def("removeNodesWithFacts", &Structure::RemoveNodesWithFacts)
+    .def("publish", &Structure::Publish)
+    .def("published", &Structure::Published, release_gil())
+    .def("memoryUsage", [](const Structure &structure) {
+      Reading reading(structure.readers());
+      py::gil_scoped_release release;
+      return structure.MemoryUsage();
+    })
+    .def("size", &Structure::size)
+    .def("save", [](const Structure &structure, const std::string &path,
+                    const NodeNames *names) {
+      Reading reading(structure.readers());
+      std::unique_ptr<Reading> reading_names(
+          names ? new Reading(names->readers()) : nullptr);
+      py::gil_scoped_release release;
+      structure.Save(path, names);
+    })
+    .def_static("open", &Structure::Open);
+
+  py::class_<StructureMemory::Shape>(m, "ShapeMemory")
+    .def_readonly("keys", &StructureMemory::Shape::keys)
+    .def_readonly("facts", &StructureMemory::Shape::facts)
+    .def_readonly("inline_buckets", &StructureMemory::Shape::inline_buckets)
+    .def_readonly("flat_buckets", &StructureMemory::Shape::flat_buckets)
+    .def_readonly("hub_buckets", &StructureMemory::Shape::hub_buckets)
+    .def_readonly("table_bytes", &StructureMemory::Shape::table_bytes)
+    .def_readonly("flat_bytes", &StructureMemory::Shape::flat_bytes)
+    .def_readonly("hub_bytes", &StructureMemory::Shape::hub_bytes)
+    .def("bytes", &StructureMemory::Shape::bytes);
+
+  py::class_<StructureMemory>(m, "StructureMemory")
+    .def_readonly("shapes", &StructureMemory::shapes)
+    .def_readonly("ground_bytes", &StructureMemory::ground_bytes)
+    .def_readonly("mapped_bytes", &StructureMemory::mapped_bytes)
+    .def_readonly("undo_bytes", &StructureMemory::undo_bytes)
+    .def("total", &StructureMemory::total);
 
   py::class_<Solver>(m, "Solver")
+    .def(py::init([](const Structure &structure, const size_t n_variables,
+                     const std::vector<Triplet> &constraints,
+                     const std::vector<std::set<size_t>> &maybe_equal) {
+           Reading reading(structure.readers());
+           py::gil_scoped_release release;
+           return new Solver(structure, n_variables, constraints,
+                             maybe_equal);
+         }), py::keep_alive<1, 2>())
+    .def("isValid", &Solver::IsValid)
+    .def("nextAssignment", [](Solver &solver) {
+      Reading reading(solver.structure().readers());
+      py::gil_scoped_release release;
+      return solver.NextAssignment();
+    })
+    .def("nextAssignments", [](Solver &solver, size_t max) {
+      Reading reading(solver.structure().readers());
+      py::gil_scoped_release release;
+      return solver.NextAssignments(max);
+    })
+    .def("memoryUsage", &Solver::MemoryUsage);
+
+  py::class_<RuleTemplate>(m, "RuleTemplate")
     .def(py::init<
-           const Structure&,
            const size_t,
            const std::vector<Triplet>&,
-           const std::vector<std::set<size_t>>
+           const std::vector<Triplet>&,
+           const std::vector<size_t>&
          >())
-    .def("isValid", &Solver::IsValid)
-    .def("nextAssignment", &Solver::NextAssignment);
+    .def("apply", &RuleTemplate::Apply);
+
+  m.def("stableName", &StableName);
+
+  py::class_<NodeNames>(m, "NodeNames")
+    .def(py::init<>())
+    .def("add", &NodeNames::Add)
+    .def("remove", &NodeNames::Remove)
+    .def("find", &NodeNames::Find)
+    .def("name", &NodeNames::Name)
+    .def("isPresent", &NodeNames::IsPresent)
+    .def("size", &NodeNames::size);
+
+  py::class_<CompiledRule>(m, "CompiledRule")
+    .def(py::init<
+           const size_t,
+           const std::vector<Triplet>&,
+           const std::vector<Triplet>&,
+           const std::vector<std::vector<Triplet>>&,
+           const std::vector<std::set<size_t>>&,
+           const RuleTemplate&,
+           const std::vector<std::pair<std::string, size_t>>&,
+           const std::vector<std::pair<std::string, size_t>>&,
+           const std::vector<size_t>&,
+           const std::vector<size_t>&
+         >());
+
+  // Solves on its own threads, so the GIL is released meanwhile.
+  m.def("matchAll", [](const Structure &structure, const NodeNames &names,
+                       const std::vector<const CompiledRule *> &rules,
+                       const std::vector<std::vector<Node>> &partials,
+                       size_t n_threads) {
+    Reading reading(structure.readers()), reading_names(names.readers());
+    py::gil_scoped_release release;
+    return MatchAll(structure, names, rules, partials, n_threads);
+  });
+  // Adds to @names, so the GIL is kept.
+  m.def("importFacts", &ImportFacts);
+
+  py::class_<RuleFacts>(m, "RuleFacts")
+    .def_readonly("rule", &RuleFacts::rule)
+    .def_readonly("maps", &RuleFacts::maps)
+    .def_readonly("facts", &RuleFacts::facts);
+  m.def("extractRules", [](const Structure &structure, Node rule_type) {
+    Reading reading(structure.readers());
+    py::gil_scoped_release release;
+    return ExtractRules(structure, rule_type);
+  });
+
+  py::class_<Fixedpoint>(m, "Fixedpoint")
+    .def(py::init<Structure*, NodeNames*, bool>(),
+         py::keep_alive<1, 2>(), py::keep_alive<1, 3>())
+    .def("run", &Fixedpoint::Run)
+    .def("addedFacts", &Fixedpoint::AddedFacts)
+    .def("removedFacts", &Fixedpoint::RemovedFacts)
+    .def("addedNodes", &Fixedpoint::AddedNodes)
+    .def("removedNodes", &Fixedpoint::RemovedNodes)
+    .def("rounds", &Fixedpoint::rounds)
+    .def("firings", &Fixedpoint::firings);
+
+  py::class_<MatchNetwork>(m, "MatchNetwork")
+    .def(py::init<Structure*>(), py::keep_alive<1, 2>())
+    .def("addReader", &MatchNetwork::AddReader)
+    .def("removeReader", &MatchNetwork::RemoveReader)
+    .def("sync", &MatchNetwork::Sync)
+    .def("assignments", &MatchNetwork::Assignments)
+    .def("read", &MatchNetwork::Read)
+    .def("size", &MatchNetwork::size)
+    .def("memoryUsage", &MatchNetwork::MemoryUsage);
+
+  // Opt-in tracing of the native engine, see runtime/trace.py.
+  py::class_<Trace::Event>(m, "TraceEvent")
+    .def_readonly("name", &Trace::Event::name)
+    .def_readonly("thread", &Trace::Event::thread)
+    .def_readonly("start", &Trace::Event::start)
+    .def_readonly("duration", &Trace::Event::duration);
+  m.def("enableTrace", &Trace::Enable);
+  m.def("traceNow", &Trace::Now);
+  m.def("traceThread", &Trace::Thread);
+  m.def("takeTrace", &Trace::Take);
 }
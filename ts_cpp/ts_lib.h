@@ -2,6 +2,13 @@
 #define TS_LIB_H_
 
 #include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -35,20 +42,664 @@ template<> struct hash<Triplet> {
 };
 }  // namespace std
 
+// Copy-on-write: returns *@pointer, first replacing it with a copy if the
+// object is shared with another pointer (eg. in a snapshot). Other threads
+// may still be reading through those pointers; the fence orders their reads
+// (before they dropped their references) before our writes.
+template <typename T>
+T &Unshare(std::shared_ptr<T> *pointer) {
+  if (pointer->use_count() > 1) {
+    *pointer = std::make_shared<T>(**pointer);
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return **pointer;
+}
+
+// Approximate heap bytes used by containers, for the MemoryUsage methods.
+// They only count the container's own allocations, not memory owned by the
+// elements. Hash tables are counted as a bucket array plus one node (next
+// pointer, cached hash and value) per element; trees as one node (three
+// pointers, color and value) per element.
+template <typename T>
+size_t VectorBytes(const std::vector<T> &vector) {
+  return vector.capacity() * sizeof(T);
+}
+
+template <typename Table>
+size_t TableBytes(const Table &table) {
+  return (table.bucket_count() * sizeof(void *)) +
+         (table.size() *
+          (2 * sizeof(void *) + sizeof(typename Table::value_type)));
+}
+
+template <typename Tree>
+size_t TreeBytes(const Tree &tree) {
+  return tree.size() *
+         (4 * sizeof(void *) + sizeof(typename Tree::value_type));
+}
+
+// Sorted, delta-encoded list of the facts under a hub key like (0, 0, /:Word).
+//
+// Only the slots left empty in the key (the 'free' slots) are stored, as an
+// Entry, since the other slots are implied by the key. Entries are kept sorted
+// and split into blocks of at most kBlockSize; each block stores its first
+// entry verbatim and every later entry as varint deltas from the one before
+// it, so updates only ever re-encode a single block.
+class PostingList {
+ public:
+  // Only the first n_free_ elements are used, the rest are kept 0.
+  typedef std::array<Node, 3> Entry;
+
+  // Streams the facts in the list, decoding one entry at a time.
+  class Cursor {
+   public:
+    Cursor() : list_(nullptr), block_(0), index_(0), offset_(0), entry_(),
+               fact_(0, 0, 0) { }
+    Cursor(const PostingList *list, size_t block);
+    const Triplet &fact() const { return fact_; }
+    void Next();
+    bool operator==(const Cursor &other) const {
+      return block_ == other.block_ && index_ == other.index_;
+    }
+
+   private:
+    void LoadFirst();
+
+    const PostingList *list_;
+    size_t block_;
+    uint32_t index_;
+    size_t offset_;
+    Entry entry_;
+    Triplet fact_;
+  };
+
+  // @key can be any fact under the hub key, @shape is the shape of the key
+  // (see Structure::ShapeOf).
+  PostingList(const Triplet &key, uint8_t shape);
+  void Add(const Triplet &fact);
+  // Returns false iff @fact was not in the list.
+  bool Remove(const Triplet &fact);
+  Cursor begin() const { return Cursor(this, 0); }
+  Cursor end() const { return Cursor(this, blocks_.size()); }
+  // Approximate heap bytes of the list, see VectorBytes. Blocks shared with
+  // copies of the list are counted in full.
+  size_t HeapBytes() const;
+
+  static const size_t kBlockSize = 128;
+
+ private:
+  struct Block {
+    Entry first;
+    Entry last;
+    uint32_t size;
+    // Varint-encoded deltas for entries [1, size).
+    std::vector<uint8_t> rest;
+  };
+
+  Entry EntryOf(const Triplet &fact) const;
+  void FillFact(const Entry &entry, Triplet *fact) const;
+  size_t FindBlock(const Entry &entry) const;
+  std::vector<Entry> Decode(const Block &block) const;
+  std::shared_ptr<Block> Encode(std::vector<Entry>::const_iterator begin,
+                                std::vector<Entry>::const_iterator end) const;
+  void EncodeNext(const Entry &previous, const Entry &entry,
+                  std::vector<uint8_t> *bytes) const;
+  void DecodeNext(const std::vector<uint8_t> &bytes, size_t *offset,
+                  Entry *entry) const;
+
+  Triplet key_;
+  uint8_t n_free_;
+  // Slots of the key which are free, in order.
+  uint8_t free_[3];
+  // Blocks are shared copy-on-write between copies of the list, so copying a
+  // hub (eg. when a Structure snapshot is modified) only copies pointers.
+  std::vector<std::shared_ptr<Block>> blocks_;
+};
+
+// Holds the facts stored under a single key of the Structure index.
+//
+// Most keys (eg. the fully-specified (A, B, C) key and most (A, B, 0) keys)
+// only ever hold one or two facts, so we keep up to kInlineFacts facts inline
+// and spill to a flat heap array for larger keys. Hub keys with more than
+// kHubThreshold facts are stored as a compressed PostingList instead.
+// Iterating yields Triplets by value.
+class Bucket {
+ public:
+  class Iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Triplet value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Triplet *pointer;
+    typedef Triplet reference;
+
+    explicit Iterator(const Node *at) : at_(at), cursor_() { }
+    explicit Iterator(const PostingList::Cursor &cursor)
+        : at_(nullptr), cursor_(cursor) { }
+    Triplet operator*() const {
+      return at_ ? Triplet(at_[0], at_[1], at_[2]) : cursor_.fact();
+    }
+    Iterator &operator++() {
+      if (at_) {
+        at_ += 3;
+      } else {
+        cursor_.Next();
+      }
+      return *this;
+    }
+    bool operator==(const Iterator &other) const {
+      return at_ == other.at_ && (at_ || cursor_ == other.cursor_);
+    }
+    bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+   private:
+    // Set for flat buckets, nullptr for hubs.
+    const Node *at_;
+    PostingList::Cursor cursor_;
+  };
+
+  Bucket() : size_(0), capacity_(kInlineFacts) { }
+  Bucket(const Bucket &other);
+  Bucket(Bucket &&other) noexcept;
+  Bucket &operator=(Bucket other) noexcept;
+  ~Bucket();
+
+  // @shape is the shape of the key this bucket is stored under (see
+  // Structure::ShapeOf), used when converting to a PostingList.
+  void Add(const Triplet &fact, uint8_t shape);
+  // Returns false iff @fact was not in the bucket.
+  bool Remove(const Triplet &fact);
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  bool IsInline() const { return capacity_ == kInlineFacts; }
+  bool IsHub() const { return capacity_ == kHubCapacity; }
+  Iterator begin() const;
+  Iterator end() const;
+  // Heap bytes of the flat array or PostingList, if any.
+  size_t HeapBytes() const;
+
+  static const uint32_t kInlineFacts = 2;
+  static const uint32_t kHubThreshold = 32;
+
+ private:
+  // Sentinel capacity_ for buckets stored as a PostingList.
+  static const uint32_t kHubCapacity = 0;
+
+  const Node *data() const { return IsInline() ? inline_ : heap_; }
+  Node *data() { return IsInline() ? inline_ : heap_; }
+  void Reallocate(uint32_t capacity);
+  void ToHub(uint8_t shape);
+  void ToFlat();
+
+  uint32_t size_;
+  uint32_t capacity_;
+  union {
+    Node inline_[3 * kInlineFacts];
+    Node *heap_;
+    PostingList *hub_;
+  };
+};
+
+// The facts under a key of the Structure index, as returned by
+// Structure::Lookup: either the facts of a Bucket or a range of a
+// MappedStructure. Only valid until the structure is next modified.
+class FactRange {
+ public:
+  FactRange(const Bucket::Iterator &begin, const Bucket::Iterator &end,
+            size_t size)
+      : begin_(begin), end_(end), size_(size) { }
+  Bucket::Iterator begin() const { return begin_; }
+  Bucket::Iterator end() const { return end_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+ private:
+  Bucket::Iterator begin_;
+  Bucket::Iterator end_;
+  size_t size_;
+};
+
+// A hash table split into kShards shards which are shared, copy-on-write,
+// between copies of the table. Copying a ShardedMap only copies the shard
+// pointers and the first write to a shard after a copy clones only that
+// shard. Shards are allocated on first write, so small tables stay small.
+// @Map should be an unordered_map or unordered_set keyed by Triplet.
+template <typename Map>
+class ShardedMap {
+ public:
+  static const size_t kShards = 128;
+
+  ShardedMap() : shards_(kShards) { }
+
+  const Map &Shard(const Triplet &key) const { return ShardAt(IndexOf(key)); }
+  Map &MutableShard(const Triplet &key) {
+    std::shared_ptr<Map> &shard = shards_[IndexOf(key)];
+    if (!shard) {
+      shard = std::make_shared<Map>();
+    }
+    return Unshare(&shard);
+  }
+  const Map &ShardAt(size_t i) const {
+    static const Map empty;
+    return shards_[i] ? *shards_[i] : empty;
+  }
+  // Shrinks the tables of shards not shared with copies of the map to fit
+  // their elements once they are less than kCompactLoadFactor full, eg.
+  // after many removals. Fuller shards are left alone, since rehashing them
+  // would save little, and so are shared shards, since compacting them would
+  // first clone them.
+  static constexpr float kCompactLoadFactor = 0.25f;
+  void Compact() {
+    for (auto &shard : shards_) {
+      if (shard && shard.use_count() == 1 &&
+          shard->load_factor() <
+              kCompactLoadFactor * shard->max_load_factor()) {
+        shard->rehash(0);
+      }
+    }
+  }
+  size_t size() const {
+    size_t size = 0;
+    for (auto &shard : shards_) {
+      size += shard ? shard->size() : 0;
+    }
+    return size;
+  }
+  // Approximate heap bytes of the shards and their tables, see TableBytes.
+  // Shards shared with copies of the map are counted in full.
+  size_t HeapBytes() const {
+    size_t bytes = VectorBytes(shards_);
+    for (auto &shard : shards_) {
+      if (shard) {
+        // The Map itself is allocated along with its shared_ptr count.
+        bytes += sizeof(Map) + (2 * sizeof(long)) + TableBytes(*shard);
+      }
+    }
+    return bytes;
+  }
+  // The index of the shard holding @key, see ShardAt. Writers on different
+  // threads may fill disjoint shards of one map at once.
+  static size_t IndexOf(const Triplet &key) {
+    // std::hash<Triplet> is weak in the low bits, so mix it before picking
+    // the shard (Fibonacci hashing).
+    uint64_t hash = std::hash<Triplet>{}(key) * 0x9E3779B97F4A7C15ull;
+    return (hash >> 32) % kShards;
+  }
+
+ private:
+  std::vector<std::shared_ptr<Map>> shards_;
+};
+
+// An atomic which copies its value (the copy itself is not atomic) and a
+// mutex which copies as a new, unlocked mutex, so that classes holding them
+// keep their implicit copy constructors.
+template <typename T>
+class CopyableAtomic : public std::atomic<T> {
+ public:
+  CopyableAtomic(T value = T()) : std::atomic<T>(value) { }
+  CopyableAtomic(const CopyableAtomic &other)
+      : std::atomic<T>(other.load()) { }
+  CopyableAtomic &operator=(const CopyableAtomic &other) {
+    this->store(other.load());
+    return *this;
+  }
+  using std::atomic<T>::operator=;
+};
+
+class CopyableMutex : public std::mutex {
+ public:
+  CopyableMutex() { }
+  CopyableMutex(const CopyableMutex &) { }
+  CopyableMutex &operator=(const CopyableMutex &) { return *this; }
+};
+
+// Counts the native calls reading an object with the GIL released, see
+// Reading in ts_lib.cc. Modifications hold the GIL, so no such read can start
+// during one, and they assert that none is running either. Copies start with
+// no readers.
+class ReaderCount {
+ public:
+  ReaderCount() { }
+  ReaderCount(const ReaderCount &) { }
+  ReaderCount &operator=(const ReaderCount &) { return *this; }
+  void Enter() const { count_++; }
+  void Exit() const { count_--; }
+  bool Idle() const { return count_ == 0; }
+
+ private:
+  mutable std::atomic<size_t> count_{0};
+};
+
+// Opt-in tracing of where the time goes in the engine, see runtime/trace.py.
+// While tracing is enabled, each TraceSpan records an Event when it goes out
+// of scope; otherwise constructing one only costs a relaxed atomic load.
+class Trace {
+ public:
+  struct Event {
+    // The name passed to TraceSpan, which must be a string literal.
+    const char *name;
+    // See Trace::Thread.
+    size_t thread;
+    // In microseconds of Trace::Now.
+    double start;
+    double duration;
+  };
+
+  static void Enable(bool enabled);
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+  // Microseconds since an arbitrary point, on a monotonic clock.
+  static double Now();
+  // ID of the calling thread, numbered from 1 in order of first use.
+  static size_t Thread();
+  // Records an event for the calling thread from @start until now.
+  static void Record(const char *name, double start);
+  // Removes and returns the events recorded so far, by every thread.
+  static std::vector<Event> Take();
+
+ private:
+  static std::atomic<bool> enabled_;
+};
+
+// Records the time until it goes out of scope under @name, see Trace.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char *name)
+      : name_(Trace::enabled() ? name : nullptr),
+        start_(name_ == nullptr ? 0.0 : Trace::Now()) { }
+  ~TraceSpan() {
+    if (name_ != nullptr) {
+      Trace::Record(name_, start_);
+    }
+  }
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+ private:
+  const char *name_;
+  double start_;
+};
+
+// Facts added to (true) or removed from (false) a Structure, in order, see
+// Structure::AddFeed. @reset is set if the changes could not be recorded (eg.
+// after Structure::Restore), in which case consumers must start over.
+struct Feed {
+  std::vector<std::pair<Triplet, bool>> changes;
+  bool reset = false;
+};
+
+// Approximate heap memory of a Structure, see Structure::MemoryUsage. Index
+// shards shared with snapshots (or published versions) are counted in full
+// by each Structure sharing them.
+struct StructureMemory {
+  // The index of one shape; all zero if the shape is not built.
+  struct Shape {
+    size_t keys = 0;
+    size_t facts = 0;
+    // Number of buckets by storage, see Bucket.
+    size_t inline_buckets = 0;
+    size_t flat_buckets = 0;
+    size_t hub_buckets = 0;
+    // The hash tables (which hold the inline buckets), the flat arrays of
+    // spilled buckets and the PostingLists of hub buckets.
+    size_t table_bytes = 0;
+    size_t flat_bytes = 0;
+    size_t hub_bytes = 0;
+
+    size_t bytes() const { return table_bytes + flat_bytes + hub_bytes; }
+  };
+
+  std::array<Shape, 8> shapes;
+  // The membership set of ground facts.
+  size_t ground_bytes = 0;
+  // The file mapped by Structure::Open, if it is still in use. These pages
+  // are shared with every other process mapping the file.
+  size_t mapped_bytes = 0;
+  // Undo log of the transactions which can still be rolled back.
+  size_t undo_bytes = 0;
+
+  size_t total() const {
+    size_t total = ground_bytes + mapped_bytes + undo_bytes;
+    for (const Shape &shape : shapes) {
+      total += shape.bytes();
+    }
+    return total;
+  }
+};
+
+class NodeNames;
+
+// A Structure file mapped read-only into memory, see Structure::Save.
+//
+// Files are in native byte order and start with a one-page header, followed
+// by page-aligned sections: the node names (offsets into a string table, and
+// whether each node is present) and the facts sorted in three orders, (i, j,
+// k), (j, k, i) and (k, i, j), so that the facts under any key of the index
+// are a contiguous range of one of them. Each order also has the offset of
+// the first fact starting with each node, so lookups are a single offset
+// read and (for keys with two or three nodes) a binary search in the range.
+// Facts are stored in slot order whatever their sort order, so ranges are
+// iterated in place.
+class MappedStructure {
+ public:
+  // Maps the file at @path, throwing std::runtime_error if it can not be
+  // read or is not a Structure file of version kVersion.
+  explicit MappedStructure(const std::string &path);
+  ~MappedStructure();
+  MappedStructure(const MappedStructure &) = delete;
+  MappedStructure &operator=(const MappedStructure &) = delete;
+
+  // Writes @facts (in any order) and the names in @names, if any, to @path.
+  // The file is written next to @path and then renamed over it, so processes
+  // which have the old file mapped keep seeing it unchanged.
+  static void Write(const std::string &path, std::vector<Triplet> facts,
+                    const NodeNames *names);
+
+  FactRange Lookup(const Triplet &key) const;
+  bool IsTrue(const Triplet &fact) const;
+  // Adds the stored names to @names, which must be empty, so that they get
+  // the same IDs.
+  void ReadNames(NodeNames *names) const;
+  // Number of facts.
+  size_t size() const { return n_facts_; }
+  // Size of the mapping.
+  size_t bytes() const { return length_; }
+
+  static const uint32_t kVersion = 1;
+
+ private:
+  // Slot order of each sort order.
+  static const uint8_t kOrders[3][3];
+
+  // Index of the first fact of @order in [@begin, @end) whose first @depth
+  // slots (in @order) are >= (or if @upper, > ) those of @key.
+  size_t Bound(uint8_t order, uint8_t depth, const Triplet &key, size_t begin,
+               size_t end, bool upper) const;
+
+  void *data_ = nullptr;
+  size_t length_ = 0;
+  size_t n_facts_ = 0;
+  size_t n_nodes_ = 0;
+  Node max_node_ = 0;
+  std::array<const Node *, 3> facts_;
+  // starts_[order][node] is the first fact of @order starting with @node,
+  // for nodes in [0, max_node_ + 1].
+  std::array<const uint64_t *, 3> starts_;
+  const uint64_t *name_offsets_ = nullptr;
+  const char *name_bytes_ = nullptr;
+  const uint8_t *present_ = nullptr;
+};
+
+// Any number of threads may read a Structure at once (lookups, IsTrue and
+// Solvers over it), including the Python bindings, which release the GIL for
+// reads. Modifying it while it is being read is not allowed, which
+// modifications assert through readers().
 class Structure {
  public:
   void AddFact(const Triplet &fact);
   void RemoveFact(const Triplet &fact);
   void AddFactPy(Node i, Node j, Node k);
   void RemoveFactPy(Node i, Node j, Node k);
-  const std::vector<Triplet> &Lookup(const Triplet &fact) const;
+  FactRange Lookup(const Triplet &fact) const;
+  std::vector<Triplet> LookupPy(Node i, Node j, Node k) const;
+  // Lookup as a flat buffer of facts, as in IsTrueMany.
+  std::vector<Node> LookupFlat(Node i, Node j, Node k) const;
   bool AllTrue(const std::vector<Triplet> &facts) const;
   bool IsTrue(const Triplet &fact) const;
+  // @triplets is a flat buffer (i0, j0, k0, i1, j1, k1, ...) of fully ground
+  // facts; the result has one entry per triplet in the buffer.
+  std::vector<bool> IsTrueMany(const std::vector<Node> &triplets) const;
+  bool IsTruePy(Node i, Node j, Node k) const;
+
+  // The index is keyed by 'shapes:' shape bit j is set iff slot j of the key
+  // is filled in, so eg. (A, 0, C) has shape 0b101. Shapes are only built the
+  // first time they are looked up and are only maintained while built.
+  static uint8_t ShapeOf(const Triplet &key);
+  // Bitmask of the shapes currently built.
+  uint8_t MaterializedShapes() const { return materialized_; }
+  // Builds the shapes in the bitmask @shapes now, rather than on their first
+  // lookup. Concurrent lookups of shapes built this way never wait on
+  // build_mutex_.
+  void MaterializeShapes(uint8_t shapes) const;
+  // Drops every built shape not looked up since the last CompactIndex and
+  // compacts the sparse shards of the others in place (see
+  // ShardedMap::Compact). If nothing at
+  // all was looked up (eg. during a bulk load) no shape is dropped, since
+  // that says nothing about which ones are needed. This is called
+  // automatically every kCompactInterval modifications.
+  void CompactIndex();
+
+  static const size_t kCompactInterval = 1 << 16;
+
+  // Returns a snapshot of the structure in O(1). The snapshot and @this share
+  // their index copy-on-write, so either one can keep being modified, or be
+  // solved against, without affecting the other. Transactions are not part
+  // of the snapshot.
+  Structure Snapshot() const;
+  // Restores the structure to @snapshot in O(1). This discards every
+  // transaction, since their undo logs no longer apply.
+  void Restore(const Structure &snapshot);
+
+  // Transactions. Begin opens a new transaction (closing the open one, if
+  // any) and every modification until it is committed is recorded in its
+  // undo log. Committed transactions can still be rolled back; Rollback(txn)
+  // undoes @txn and every transaction after it, newest first, after which no
+  // transaction is open. Modifications made while no transaction is open are
+  // not recorded. Rollback returns false, changing nothing, if @txn is not in
+  // the undo log (eg. after Restore or Forget). Forget(txn) drops the undo
+  // log of every transaction before @txn, which can then no longer be rolled
+  // back.
+  size_t Begin();
+  void Commit(size_t txn);
+  bool Rollback(size_t txn);
+  void Forget(size_t txn);
+  // Batch versions of AddFact/RemoveFact over flat buffers, as in IsTrueMany.
+  void AddFacts(const std::vector<Node> &triplets);
+  void RemoveFacts(const std::vector<Node> &triplets);
+  // Removes every fact using any of @nodes, returning them as a flat buffer.
+  // The facts are found through the single-node shapes, which serve as the
+  // structure's node-incidence index, and are unlinked in one pass: buckets
+  // whose key uses one of @nodes hold only removed facts, so they are
+  // dropped whole rather than emptied fact by fact.
+  std::vector<Node> RemoveNodesWithFacts(const std::vector<Node> &nodes);
+
+  // Read-copy-update, for reading the structure on other threads while this
+  // one keeps modifying it. Publish makes a snapshot of the structure the
+  // current version. Published may be called on any thread, even during
+  // modifications, and returns a snapshot of the current version (or an
+  // empty structure if none was published). Readers take no locks and never
+  // block the writer: a version is freed once its last snapshot is dropped,
+  // and the writer's copy-on-write leaves shared data untouched.
+  void Publish();
+  Structure Published() const;
+
+  // Records every later change to the structure in @feed, until it is
+  // removed by RemoveFeed. Any number of feeds (eg. one per MatchNetwork)
+  // may be added. Snapshots do not inherit feeds.
+  void AddFeed(Feed *feed);
+  void RemoveFeed(Feed *feed);
+  // Feeds with more changes than this are reset instead.
+  static const size_t kMaxFeed = 1 << 20;
+
+  // Approximate heap memory of the structure, broken down by shape. This
+  // walks the buckets of every built shape but copies nothing, so it is
+  // cheap enough to sample during long runs. Like other reads, it may run
+  // concurrently with lookups.
+  StructureMemory MemoryUsage() const;
+  // Number of facts in the structure.
+  size_t size() const;
+
+  // Saves the facts of the structure, and the names in @names if it is not
+  // nullptr, to a file at @path; see MappedStructure for the format. Open
+  // returns a structure with the facts saved at @path, adding the saved
+  // names to @names (which must then be empty) if it is not nullptr. The
+  // file is memory-mapped rather than read, so opening takes time
+  // independent of its size and processes opening the same file share its
+  // pages. The structure reads straight from the file until it is first
+  // modified, when it builds its own copy (as a Structure built fact by fact
+  // would) and unmaps it. Both throw std::runtime_error on I/O errors.
+  void Save(const std::string &path, const NodeNames *names) const;
+
+  // The reads of the structure running without the GIL.
+  const ReaderCount &readers() const { return readers_; }
+  static Structure Open(const std::string &path, NodeNames *names);
+
+  // Returns a structure with @facts (duplicates are dropped), much faster
+  // than adding them one by one: the fact set is filled on up to @n_threads
+  // threads (one per core if 0), each owning some of its shards, and shapes
+  // are then built from it on first lookup as usual.
+  static Structure Build(const std::vector<Triplet> &facts, size_t n_threads);
 
  private:
-  std::unordered_map<Triplet, std::vector<Triplet>> facts_;
+  typedef ShardedMap<std::unordered_map<Triplet, Bucket>> Index;
+  typedef ShardedMap<std::unordered_set<Triplet>> FactSet;
+
+  void Materialize(uint8_t shape) const;
+  // Returns facts_[shape] (resp. ground_), first cloning it if it is shared
+  // with a snapshot.
+  Index &MutableIndex(uint8_t shape);
+  FactSet &MutableGround();
+  // Appends the change to each of feeds_.
+  void Record(const Triplet &fact, bool added);
+  // Copies the facts of mapped_ into ground_ and drops mapped_.
+  void Thaw();
+
+  // facts_[shape] maps keys of that shape to the matching facts, or is
+  // nullptr if the shape is not built. Lookups build shapes lazily, hence
+  // these are mutable. A shape is built under build_mutex_ and only then
+  // marked in materialized_, so lookups which find it marked need no lock.
+  mutable std::array<std::shared_ptr<Index>, 8> facts_;
+  mutable CopyableAtomic<uint8_t> materialized_{0};
+  // Shapes looked up since the last CompactIndex.
+  mutable CopyableAtomic<uint8_t> used_{0};
+  mutable CopyableMutex build_mutex_;
+  size_t modifications_ = 0;
+  // Membership set of the (fully ground) facts in the structure. This lets
+  // IsTrue answer with a single probe and no allocation, which matters for
+  // pattern-heavy workloads where most checks are misses (eg. /NO_MAP
+  // constraints). It is also the source for building shapes.
+  std::shared_ptr<FactSet> ground_ = std::make_shared<FactSet>();
   // TODO(masotoud)
-  std::vector<Triplet> empty_;
+  Bucket empty_;
+  // The file the structure was opened from, while it is unmodified; see
+  // Open. While set, it holds every fact and ground_ and facts_ are empty.
+  std::shared_ptr<const MappedStructure> mapped_;
+
+  struct Undo {
+    Triplet fact;
+    bool added;
+  };
+  // Undo entries of every transaction which can still be rolled back, oldest
+  // first. transactions_ holds the (ID, first undo entry) of each of them.
+  std::vector<Undo> undo_log_;
+  std::vector<std::pair<size_t, size_t>> transactions_;
+  // The open transaction, or 0 if there is none.
+  size_t open_ = 0;
+  size_t next_transaction_ = 1;
+  std::vector<Feed *> feeds_;
+  ReaderCount readers_;
+  // The current version, see Publish. Only accessed with std::atomic_load
+  // and std::atomic_store.
+  std::shared_ptr<const Structure> published_;
 };
 
 class Solver {
@@ -60,9 +711,16 @@ class Solver {
 
   bool IsValid() { return valid_; }
   std::vector<Node> NextAssignment();
+  // Up to @max calls of NextAssignment, concatenated. Fewer than @max
+  // assignments are returned only once the search is exhausted.
+  std::vector<Node> NextAssignments(size_t max);
   void Assign(const Node to);
   void UnAssign();
   void GetOptions();
+  // Approximate heap bytes of the search state, see VectorBytes. Does not
+  // include the structure.
+  size_t MemoryUsage() const;
+  const Structure &structure() const { return structure_; }
 
  private:
   int CurrentVariable() const;
@@ -93,4 +751,357 @@ class Solver {
   int current_index_ = 0;
 };
 
+// True iff variables assigned the same node in @assignment (one entry per
+// variable, 0 if unassigned) are allowed to be equal, as in
+// runtime/pattern.py:Pattern.valid_maybe_equals.
+bool ValidMaybeEquals(const std::vector<std::set<size_t>> &maybe_equal,
+                      const std::vector<Node> &assignment);
+
+// The action side of a production rule, compiled to fact instructions over
+// variable slots. As in Solver, nodes <= 0 in the instructions are variables
+// (variable i is -i); positive nodes are constants.
+class RuleTemplate {
+ public:
+  // @inserts are added in order, then every fact using a node in
+  // @remove_slots is removed, then @subtracts are removed, even if they were
+  // also inserted. Each instruction only applies if all of its variables are
+  // assigned.
+  RuleTemplate(const size_t n_variables,
+               const std::vector<Triplet> &inserts,
+               const std::vector<Triplet> &subtracts,
+               const std::vector<size_t> &remove_slots);
+
+  // Applies the template to @structure given @assignment, which has one
+  // entry per variable (0 if unassigned). Returns the facts actually added
+  // and removed, in order, as flat buffers (see Structure::IsTrueMany).
+  std::pair<std::vector<Node>, std::vector<Node>> Apply(
+      Structure *structure, const std::vector<Node> &assignment) const;
+
+ private:
+  // Fills in the variables of @instruction, returning false if any of them
+  // are unassigned.
+  bool Fill(const Triplet &instruction, const std::vector<Node> &assignment,
+            Triplet *fact) const;
+
+  const size_t n_variables_;
+  std::vector<Triplet> inserts_;
+  std::vector<Triplet> subtracts_;
+  std::vector<size_t> remove_slots_;
+};
+
+// SipHash-2-4 with 128-bit output over @bytes. Unlike std::hash, the result
+// is the same across runs and platforms, so it can be used to name nodes.
+std::array<uint64_t, 2> StableHash(const std::string &bytes);
+// Returns a name for @parts: StableHash of the parts, each followed by a 0
+// byte, as 32 hex digits or (if @numeric) the first 64 bits in decimal.
+std::string StableName(const std::vector<std::string> &parts, bool numeric);
+
+// Names of the nodes by ID, mirroring CPPStructure.dictionary, and which of
+// them are currently in the TripletStructure. IDs start at 1 and are never
+// reused.
+class NodeNames {
+ public:
+  // Marks @name as present, giving it the next ID if it is new. Returns its
+  // ID.
+  Node Add(const std::string &name);
+  // Marks @name as not present.
+  void Remove(const std::string &name);
+  // Returns the ID of @name, or 0 if it has none.
+  Node Find(const std::string &name) const;
+  const std::string &Name(Node node) const { return names_.at(node - 1); }
+  bool IsPresent(Node node) const { return present_.at(node - 1); }
+  void SetPresent(Node node, bool present) {
+    assert(readers_.Idle());
+    present_.at(node - 1) = present;
+  }
+  // Number of ':'s in the name, used for ordering variables (see Solve).
+  size_t Colons(Node node) const { return colons_.at(node - 1); }
+  size_t size() const { return names_.size(); }
+  // The reads of the names running without the GIL, see ReaderCount.
+  const ReaderCount &readers() const { return readers_; }
+
+ private:
+  ReaderCount readers_;
+  std::vector<std::string> names_;
+  std::vector<bool> present_;
+  std::vector<size_t> colons_;
+  std::unordered_map<std::string, Node> ids_;
+};
+
+// A production rule compiled for native matching and firing, see
+// runtime/cpp_structure.py:CPPRule. Constraints are over rule variables,
+// encoded as in RuleTemplate, and assignments have one entry per variable (0
+// if unassigned).
+class CompiledRule {
+ public:
+  // @named_variables are the (rule node, variable) pairs sorted by rule node
+  // name and @inserts the (/INSERT node, variable) pairs; both are used to
+  // name inserted nodes as in runtime/assignment.py:Assignment.node_name.
+  CompiledRule(const size_t n_variables,
+               const std::vector<Triplet> &must,
+               const std::vector<Triplet> &try_constraints,
+               const std::vector<std::vector<Triplet>> &nevers,
+               const std::vector<std::set<size_t>> &maybe_equal,
+               const RuleTemplate &action,
+               const std::vector<std::pair<std::string, size_t>> &named_variables,
+               const std::vector<std::pair<std::string, size_t>> &inserts,
+               const std::vector<size_t> &remove_variables,
+               const std::vector<size_t> &subtract_variables);
+
+  size_t n_variables() const { return n_variables_; }
+  // The assignments extending @partial, in the order
+  // runtime/matcher.py:OneOffMatcher yields them, as a flat buffer with one
+  // entry per variable. Only reads @structure and @names.
+  std::vector<Node> Matches(const Structure &structure, const NodeNames &names,
+                            const std::vector<Node> &partial) const;
+  // Bitmask of the shapes Matches may look up.
+  uint8_t Shapes() const;
+
+ private:
+  friend class Fixedpoint;
+
+  const size_t n_variables_;
+  std::vector<Triplet> must_;
+  std::vector<Triplet> try_;
+  std::vector<std::vector<Triplet>> nevers_;
+  std::vector<std::set<size_t>> maybe_equal_;
+  RuleTemplate action_;
+  std::vector<std::pair<std::string, size_t>> named_variables_;
+  std::vector<std::pair<std::string, size_t>> inserts_;
+  std::vector<size_t> remove_variables_;
+  std::vector<size_t> subtract_variables_;
+  // Whether each variable appears in must_.
+  std::vector<bool> is_must_;
+};
+
+// CompiledRule::Matches for each of @rules, extending @partials[i] for
+// @rules[i], solved on up to @n_threads threads (or one per core if it is 0).
+// Results are in the order of @rules however they are scheduled. @structure
+// and @names must not be modified meanwhile.
+std::vector<std::vector<Node>> MatchAll(
+    const Structure &structure, const NodeNames &names,
+    const std::vector<const CompiledRule *> &rules,
+    const std::vector<std::vector<Node>> &partials, size_t n_threads);
+
+// Reads the facts in the text file at @path into a new structure, built with
+// Structure::Build. @format is "tsv", for three tab-separated node names per
+// line, or "ntriples", for N-Triples: subject, predicate and object terms per
+// line, followed by a '.'. Blank lines and lines starting with '#' are
+// skipped. Node names are @prefix followed by the term as written, except
+// that IRIs lose their angle brackets; literals keep their quotes, escapes
+// and language or datatype. New names are added to @names in order of first
+// appearance.
+//
+// The file is streamed in chunks of 16 MiB, each split at line
+// boundaries between up to @n_threads threads (one per core if 0) which
+// tokenize and intern names locally; names are then merged in file order.
+// Throws std::runtime_error on I/O errors and on the first malformed line.
+Structure ImportFacts(const std::string &path, const std::string &format,
+                      const std::string &prefix, NodeNames *names,
+                      size_t n_threads);
+
+// The facts making up one /RULE, as read by ExtractRules. Both are flat
+// buffers of facts, sorted.
+struct RuleFacts {
+  Node rule = 0;
+  // Every fact (map, value, key) using three different nodes, for each map
+  // node of the rule (ie. with (map, rule, /RULE) in the structure). These
+  // give the rule's node types (eg. key /MUST_MAP) and equivalences (key /=
+  // or /MAYBE=).
+  std::vector<Node> maps;
+  // Every fact whose first node is the rule, one of its map nodes or a value
+  // in maps: all the facts a ProductionRule may compile.
+  std::vector<Node> facts;
+};
+
+// Reads every rule in @structure in one pass, for TSRuntime.extract_rules
+// (see runtime/production_rule.py for how the facts are interpreted).
+// @rule_type is the ID of /RULE. Rules are sorted by node.
+std::vector<RuleFacts> ExtractRules(const Structure &structure,
+                                    Node rule_type);
+
+// Semi-naive evaluation of rules to fixedpoint, see
+// runtime/runtime.py:TSRuntime.fixedpoint. Each round fires every match found
+// for it (re-checking each one right before firing). While rounds only add facts,
+// the next round only joins against the facts added by the previous one; a
+// round which removes anything is followed by a full one.
+class Fixedpoint {
+ public:
+  Fixedpoint(Structure *structure, NodeNames *names, bool compact_names);
+
+  // Runs @rules until a round changes nothing; @partials[i] is the partial
+  // assignment for @rules[i].
+  void Run(const std::vector<const CompiledRule *> &rules,
+           const std::vector<std::vector<Node>> &partials);
+
+  // The net change made by Run. Facts are flat buffers as in
+  // Structure::IsTrueMany.
+  std::vector<Node> AddedFacts() const { return NetFacts(true); }
+  std::vector<Node> RemovedFacts() const { return NetFacts(false); }
+  std::vector<Node> AddedNodes() const { return NetNodes(true); }
+  std::vector<Node> RemovedNodes() const { return NetNodes(false); }
+  size_t rounds() const { return rounds_; }
+  // Number of firings which changed something.
+  size_t firings() const { return firings_; }
+
+ private:
+  typedef std::set<std::vector<Node>> Matches;
+
+  // Finds must-assignments of @rule extending @partial which might fire
+  // differently after @added were added, ie. new ones and ones with new
+  // try-assignments.
+  void Join(const CompiledRule &rule, const std::vector<Node> &partial,
+            const std::vector<Triplet> &added, Matches *matches) const;
+  // Fires every try-assignment extending @must (or @must itself if there are
+  // none), if they are still valid.
+  void FireAll(const CompiledRule &rule, const std::vector<Node> &must);
+  // Applies @rule to @assignment, returning true if it changed anything.
+  bool Fire(const CompiledRule &rule, std::vector<Node> assignment);
+  bool Blocked(const CompiledRule &rule,
+               const std::vector<Node> &assignment) const;
+  void TouchFact(const Triplet &fact, bool added);
+  void TouchNode(Node node, bool present);
+  std::vector<Node> NetFacts(bool added) const;
+  std::vector<Node> NetNodes(bool added) const;
+
+  Structure *structure_;
+  NodeNames *names_;
+  const bool compact_names_;
+  size_t rounds_ = 0;
+  size_t firings_ = 0;
+  // Facts added in the current round, and whether anything was removed.
+  std::vector<Triplet> round_added_;
+  bool round_removed_ = false;
+  // Every fact and node changed by Run, in order, with its state before it.
+  std::vector<Triplet> touched_facts_;
+  std::unordered_map<Triplet, bool> facts_before_;
+  std::vector<Node> touched_nodes_;
+  std::unordered_map<Node, bool> nodes_before_;
+};
+
+// Rete-style network matching the must patterns of every Matcher of a
+// runtime at once, see runtime/cpp_structure.py:CPPMatchNetwork.
+//
+// Patterns are ordered and renamed into a canonical form, so patterns which
+// start with the same constraints (up to renaming variables) share a path in
+// a trie of join nodes. Each join node stores the assignments to the prefix
+// of constraints ending at it; the Structure itself acts as the alpha
+// memories. Fact changes come from the Structure's Feed, and each one is
+// dispatched by its constants to the join nodes whose constraint it can
+// satisfy, so it is only tested once however many patterns use it.
+class MatchNetwork {
+ public:
+  explicit MatchNetwork(Structure *structure);
+  ~MatchNetwork();
+  MatchNetwork(const MatchNetwork &) = delete;
+  MatchNetwork &operator=(const MatchNetwork &) = delete;
+
+  // Adds a reader for the assignments to @constraints extending @partial.
+  // Constraints, @partial and @maybe_equal are over variables encoded as in
+  // RuleTemplate, with one entry per variable. Returns the reader's ID.
+  size_t AddReader(const std::vector<Triplet> &constraints,
+                   const std::vector<std::set<size_t>> &maybe_equal,
+                   const std::vector<Node> &partial);
+  // Releases @reader, along with the join nodes only it used. Its ID is not
+  // reused and may not be read from again.
+  void RemoveReader(size_t reader);
+  // Updates every join node with the changes to the structure so far.
+  void Sync();
+  // The current assignments of @reader as a flat buffer, with one entry per
+  // variable (0 if unassigned) for each assignment.
+  std::vector<Node> Assignments(size_t reader) const;
+  // Returns the assignments of @reader (removed, added) since the previous
+  // call, as in Assignments.
+  std::pair<std::vector<Node>, std::vector<Node>> Read(size_t reader);
+  // Number of join nodes in use, not counting the root.
+  size_t size() const { return nodes_.size() - 1 - released_nodes_; }
+  // Approximate heap bytes of the join nodes, readers and pending feed, see
+  // VectorBytes. Does not include the structure.
+  size_t MemoryUsage() const;
+
+ private:
+  typedef std::vector<Node> Tuple;
+
+  struct TupleHash {
+    size_t operator()(const Tuple &tuple) const noexcept {
+      size_t hash = tuple.size();
+      for (const Node &node : tuple) {
+        hash = hash * 31 + std::hash<int>{}(node);
+      }
+      return hash;
+    }
+  };
+  // Pairs (canonical variable, other) which must be assigned different
+  // nodes, where other is a canonical variable if <= 0 (as in constraints)
+  // and a node otherwise.
+  typedef std::vector<std::pair<size_t, Node>> Distinct;
+
+  // Assignments to the canonical variables of a prefix of constraints.
+  // Canonical variables are numbered in order of first appearance along the
+  // path, so tuples of a node extend those of its parent.
+  struct JoinNode {
+    size_t parent;
+    // Constants are > 0, canonical variable i is -i.
+    Triplet constraint;
+    // Checked for the variables introduced by @constraint, so tuples which
+    // no reader could accept are pruned as early as in Solver.
+    Distinct distinct;
+    size_t width;
+    std::set<Tuple> tuples;
+    // The tuples by the fact they use for @constraint.
+    std::unordered_map<Triplet, std::unordered_set<const Tuple *>> by_fact;
+    // Variables of the parent used by @constraint, and the parent's tuples
+    // by their values for them (ie. a hashed beta memory).
+    std::vector<size_t> join_variables;
+    std::unordered_map<Tuple, std::unordered_set<const Tuple *>, TupleHash>
+        by_join;
+    std::map<std::pair<Triplet, Distinct>, size_t> children;
+    std::vector<size_t> readers;
+  };
+
+  struct Reader {
+    size_t node;
+    // Pattern variable of each canonical variable.
+    std::vector<size_t> variables;
+    std::vector<std::set<size_t>> maybe_equal;
+    std::vector<Node> partial;
+    std::set<Tuple> removed, added;
+    bool released;
+  };
+
+  size_t Child(size_t parent, const Triplet &constraint,
+               const Distinct &distinct);
+  // The key of alphas_ holding join nodes with @constraint, and its shape.
+  static Triplet AlphaKey(const Triplet &constraint, uint8_t *shape);
+  Tuple JoinKey(size_t node, const Tuple &parent_tuple) const;
+  // Extends @tuple (of @node's parent) with every fact matching @node's
+  // constraint, or just @fact if it is not null.
+  void Extend(size_t node, const Tuple &tuple, const Triplet *fact);
+  void Insert(size_t node, Tuple tuple);
+  void Erase(size_t node, const Tuple &tuple);
+  void AddFact(const Triplet &fact);
+  void RemoveFact(const Triplet &fact);
+  // Join nodes whose constraint has the same constants as @fact.
+  std::vector<size_t> Candidates(const Triplet &fact) const;
+  void Rebuild();
+  // Translates a tuple of the reader's node to an assignment of its
+  // pattern, returning false if it is not valid for the reader.
+  bool ToAssignment(const Reader &reader, const Tuple &tuple,
+                    Tuple *assignment) const;
+  void Notify(size_t node, const Tuple &tuple, bool added);
+
+  Structure *structure_;
+  Feed feed_;
+  // nodes_[0] is the root, which has the single empty tuple.
+  std::vector<JoinNode> nodes_;
+  std::vector<Reader> readers_;
+  // alphas_[shape] maps constraints with constants in the slots of @shape
+  // (and 0s elsewhere) to the join nodes with such constraints.
+  std::array<std::unordered_map<Triplet, std::vector<size_t>>, 8> alphas_;
+  // Whether Notify calls are being collected by Rebuild.
+  bool rebuilding_ = false;
+  // Join nodes dropped by RemoveReader.
+  size_t released_nodes_ = 0;
+};
+
 #endif  // TS_LIB_H_
@@ -27,8 +27,11 @@ class TripletStructure:
     """
     def __init__(self):
         """Initializes a new triplet structure."""
-        # A list of the names of all nodes in the structure.
-        self.nodes = []
+        # The names of all nodes in the structure, in the order they were added.
+        # A dict with None values, used as an ordered set: membership tests,
+        # insertion and removal are O(1) (add_fact checks every node of every
+        # fact) while iteration keeps the order CPPStructure assigns IDs in.
+        self.nodes = dict()
         # Maps full_name -> short_name. The short name will be used in
         # user-facing printouts. We should maintain the invariant
         # self.display_names.keys() == self.nodes.
@@ -53,7 +56,15 @@ class TripletStructure:
         self.buffer = TSDelta(self)
         # (Optional) an object with [add,remove]_[node,fact] methods which will
         # shadow changes to the structure. Used to implement efficient solving
-        # with the C++ extensions.
+        # with the C++ extensions. The shadow may also have:
+        # - [add,remove]_facts methods, which are then called once per batch
+        #   with only the facts that actually changed, and
+        # - commit_txn/rollback_txn/forget_txns methods. commit_txn() ends the
+        #   shadow's running transaction and returns a token for it;
+        #   rollback_txn(token) undoes that transaction and all later ones, or
+        #   returns False if it can't; forget_txns(token) lets the shadow drop
+        #   what it keeps for transactions before @token (or all but the
+        #   running one if None). See TSDelta.rollback.
         self.shadow = None
 
     def __getitem__(self, node):
@@ -130,6 +141,7 @@ class TripletStructure:
         """Commits self.buffer to self.path."""
         if self.is_clean() and not commit_if_clean:
             return False
+        self._seal(self.buffer)
         self.path.append(self.buffer)
         self.buffer = TSDelta(self)
         return self.path[-1]
@@ -145,6 +157,7 @@ class TripletStructure:
         """
         old_running = self.buffer
         self.buffer = TSDelta(self)
+        self._seal(old_running)
         old_running.rollback()
         self.buffer = TSDelta(self)
         if to_time == 0:
@@ -179,7 +192,7 @@ class TripletStructure:
     def add_node(self, full_name, display_name=None):
         """Low-level method to add a node to the structure."""
         if not self.has_node(full_name):
-            self.nodes.append(full_name)
+            self.nodes[full_name] = None
             self.display_names[full_name] = display_name or full_name
             self.buffer.add_node(full_name)
             if self.shadow:
@@ -190,7 +203,7 @@ class TripletStructure:
         assert not self.facts_about_node(full_name, True), \
                f"Remove facts using {full_name} before removing it."
         if full_name in self.nodes:
-            self.nodes.remove(full_name)
+            del self.nodes[full_name]
             self.display_names.pop(full_name)
             self.buffer.remove_node(full_name)
             if self.shadow:
@@ -198,28 +211,27 @@ class TripletStructure:
 
     def add_fact(self, fact):
         """Low-level method to add a fact to the structure."""
-        if self.lookup(*fact, read_direct=True):
-            # The fact already exists in the structure.
-            return
-        assert all(map(self.has_node, fact)), \
-               f"Add all nodes in {fact} before adding the fact."
-        for key in self._iter_subfacts(fact):
-            self.facts[key].append(fact)
-        self.buffer.add_fact(fact)
-        if self.shadow:
+        if self._add_fact(fact) and self.shadow:
             self.shadow.add_fact(fact)
 
     def remove_fact(self, fact):
         """Remove a fact from the structure."""
-        if not self.lookup(*fact, read_direct=True):
-            # Fact was already removed, or never added.
-            return
-        for key in self._iter_subfacts(fact):
-            self.facts[key].remove(fact)
-        self.buffer.remove_fact(fact)
-        if self.shadow:
+        if self._remove_fact(fact) and self.shadow:
             self.shadow.remove_fact(fact)
 
+    def apply_shadowed(self, added, removed):
+        """Adds facts @added, then removes @removed, *without* the shadow.
+
+        Used when the shadow itself has already made the change, eg. when it
+        applies a rule natively (see runtime/cpp_structure.py). Every fact
+        must actually change.
+        """
+        for fact in added:
+            changed = self._add_fact(fact)
+            assert changed
+        assert all(self.lookup(*fact, read_direct=True) for fact in removed)
+        self._unlink_facts(removed)
+
     def add_nodes(self, nodes):
         """Helper to add multiple nodes to the structure."""
         for node in nodes:
@@ -230,15 +242,45 @@ class TripletStructure:
         for node in nodes:
             self.remove_node(node)
 
+    def remove_nodes_with_facts(self, nodes):
+        """Removes the nodes @nodes and every fact using any of them.
+
+        Much faster than removing the facts one by one: each key of self.facts
+        is filtered once, rather than once per fact it holds, and a shadow
+        with a remove_nodes_with_facts method removes them natively in one
+        call (see Structure::RemoveNodesWithFacts in ts_cpp/ts_lib.h).
+        """
+        nodes = [node for node in nodes if self.has_node(node)]
+        facts = list(dict.fromkeys(
+            fact for node in nodes
+            for fact in self.facts_about_node(node, read_direct=True)))
+        if facts:
+            self._unlink_facts(facts)
+            if hasattr(self.shadow, "remove_nodes_with_facts"):
+                self.shadow.remove_nodes_with_facts(nodes)
+            elif hasattr(self.shadow, "remove_facts"):
+                self.shadow.remove_facts(facts)
+            elif self.shadow:
+                for fact in facts:
+                    self.shadow.remove_fact(fact)
+        self.remove_nodes(nodes)
+
     def add_facts(self, facts):
         """Helper to add multiple facts to the structure."""
-        for fact in facts:
-            self.add_fact(fact)
+        if not hasattr(self.shadow, "add_facts"):
+            for fact in facts:
+                self.add_fact(fact)
+            return
+        self.shadow.add_facts([fact for fact in facts if self._add_fact(fact)])
 
     def remove_facts(self, facts):
         """Helper to remove multiple facts from the structure."""
-        for fact in facts:
-            self.remove_fact(fact)
+        if not hasattr(self.shadow, "remove_facts"):
+            for fact in facts:
+                self.remove_fact(fact)
+            return
+        self.shadow.remove_facts(
+            [fact for fact in facts if self._remove_fact(fact)])
 
     def print_delta(self):
         """Helper context that prints changes to the structure on exit."""
@@ -274,12 +316,68 @@ class TripletStructure:
             return name
         return "{}{}".format(self.current_scope, name)
 
+    def _add_fact(self, fact):
+        """Adds @fact without updating the shadow. True iff it was added."""
+        if self.lookup(*fact, read_direct=True):
+            # The fact already exists in the structure.
+            return False
+        assert all(map(self.has_node, fact)), \
+               f"Add all nodes in {fact} before adding the fact."
+        for key in self._iter_subfacts(fact):
+            self.facts[key].append(fact)
+        self.buffer.add_fact(fact)
+        return True
+
+    def _remove_fact(self, fact):
+        """Removes @fact without updating the shadow. True iff it was removed."""
+        if not self.lookup(*fact, read_direct=True):
+            # Fact was already removed, or never added.
+            return False
+        for key in self._iter_subfacts(fact):
+            self.facts[key].remove(fact)
+        self.buffer.remove_fact(fact)
+        return True
+
+    def _unlink_facts(self, facts):
+        """Removes @facts, which must all exist, without updating the shadow.
+
+        Each key of self.facts holding any of them is filtered in place once.
+        """
+        removed = set(facts)
+        keys = set(key for fact in removed
+                   for key in self._iter_subfacts(fact))
+        for key in keys:
+            facts_at = self.facts[key]
+            facts_at[:] = [fact for fact in facts_at if fact not in removed]
+        for fact in removed:
+            self.buffer.remove_fact(fact)
+
+    def _seal(self, delta):
+        """Ties the shadow's running transaction to @delta (if not None).
+
+        The shadow then starts a new transaction, so it should be called
+        exactly when the changes in @delta are done.
+        """
+        if hasattr(self.shadow, "commit_txn"):
+            txn = self.shadow.commit_txn()
+            if delta is not None:
+                delta.shadow_txn = (self.shadow, txn)
+            # Only transactions of deltas in the path (or @delta, which is
+            # about to be added or rolled back) can be rolled back later.
+            deltas = itertools.chain(self.path, [delta])
+            oldest = next((d.shadow_txn[1] for d in deltas
+                           if d is not None and d.shadow_txn is not None
+                           and d.shadow_txn[0] is self.shadow), None)
+            self.shadow.forget_txns(oldest)
+
     def _force_clean(self):
         """Manually clears the buffer.
 
         NOTE: Code outside of this file should **NEVER** call _force_clean.
         """
         self.buffer = TSDelta(self)
+        # Changes to the shadow since the last _seal are likewise forgotten.
+        self._seal(None)
 
     def __str__(self):
         """Returns a string representation of the Structure.
@@ -355,7 +453,8 @@ class TSScope:
     def __iter__(self):
         """Iterator for all nodes in the structure within the scope.
         """
-        for member_name in self.structure.nodes:
+        # Copied, so callers may add or remove nodes while iterating.
+        for member_name in list(self.structure.nodes):
             if member_name.startswith(self.prefix + ":"):
                 yield self.structure[member_name]
 
@@ -417,9 +516,7 @@ class NodeWrapper:
 
     def remove_with_facts(self):
         """Removes the node and all associated facts from the structure."""
-        self.structure.remove_facts(
-            self.structure.facts_about_node(self.full_name))
-        self.structure.remove_node(self.full_name)
+        self.structure.remove_nodes_with_facts([self.full_name])
 
     def remove(self):
         """Removes the node (without associated facts) from the structure.
@@ -462,6 +559,9 @@ class TSDelta:
         self.ts = ts
         self.add_nodes, self.add_facts = set(), set()
         self.remove_nodes, self.remove_facts = set(), set()
+        # (shadow, token) for the shadow transaction which made this change, if
+        # any. See TripletStructure._seal.
+        self.shadow_txn = None
 
     def apply(self):
         """Apply the TSDelta to self.ts."""
@@ -472,18 +572,42 @@ class TSDelta:
         self.ts.add_facts(sorted(self.add_facts))
         self.ts.remove_facts(sorted(self.remove_facts))
         self.ts.remove_nodes(sorted(self.remove_nodes))
+        self.ts._seal(self)
         self.ts._force_clean()
         # TODO: maybe this should just wrap it?
         self.ts.path.append(self)
 
     def rollback(self):
-        """Undo the TSDelta."""
+        """Undo the TSDelta.
+
+        If the delta was made in a shadow transaction, the shadow is rolled
+        back with a single rollback_txn call. That undoes every later
+        transaction too, so such deltas must be rolled back newest-first (as
+        ts.rollback does). If the shadow no longer has the transaction, the
+        delta is replayed through the shadow instead.
+        """
         assert self is not self.ts.buffer
-        # NOTE: Sorted here is just for determinism.
-        self.ts.remove_facts(sorted(self.add_facts))
-        self.ts.remove_nodes(sorted(self.add_nodes))
-        self.ts.add_nodes(sorted(self.remove_nodes))
-        self.ts.add_facts(sorted(self.remove_facts))
+        shadow = self.ts.shadow
+        native = (self.shadow_txn is not None and self.shadow_txn[0] is shadow
+                  and shadow.rollback_txn(self.shadow_txn[1]))
+        if native:
+            self.ts.shadow = None
+        try:
+            # NOTE: Sorted here is just for determinism.
+            self.ts.remove_facts(sorted(self.add_facts))
+            self.ts.remove_nodes(sorted(self.add_nodes))
+            self.ts.add_nodes(sorted(self.remove_nodes))
+            self.ts.add_facts(sorted(self.remove_facts))
+        finally:
+            self.ts.shadow = shadow
+        if native:
+            # The transaction only undoes facts; node changes are replayed so
+            # that the shadow's record of which nodes exist stays current.
+            for node in sorted(self.add_nodes):
+                shadow.remove_node(node)
+            for node in sorted(self.remove_nodes):
+                shadow.add_node(node)
+        self.shadow_txn = None
         # Maybe we should assert that this is at the end of the path and remove
         # it?
 